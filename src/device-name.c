@@ -0,0 +1,245 @@
+/*
+ * device-name.c - device arguments by GUID or model name
+ *
+ * licensed under the terms of version 2 of the GNU General Public License
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "fwutils.h"
+
+#define SYSFS_DEVICES	"/sys/bus/firewire/devices"
+
+struct entry {
+	unsigned long long guid;
+	char dev[16];
+	char model[256];
+};
+
+struct index {
+	struct entry *entries;
+	unsigned int count;
+};
+
+/* the key to look for */
+static bool by_guid;
+static unsigned long long guid;
+static const char *model;
+
+/* only the nodes themselves, fwN, not their units, fwN.M */
+static bool is_node(const char *name)
+{
+	unsigned int i;
+
+	if (name[0] != 'f' || name[1] != 'w' || !name[2])
+		return false;
+	for (i = 2; name[i]; ++i)
+		if (!isdigit(name[i]))
+			return false;
+	return i < sizeof(((struct entry *)NULL)->dev);
+}
+
+static bool read_attribute(const char *dev, const char *attribute, char *buf, size_t size)
+{
+	char *path;
+	FILE *f;
+	bool ok;
+
+	if (asprintf(&path, SYSFS_DEVICES "/%s/%s", dev, attribute) < 0)
+		return false;
+	f = fopen(path, "r");
+	free(path);
+	if (!f)
+		return false;
+	ok = fgets(buf, size, f) != NULL;
+	fclose(f);
+	if (ok)
+		buf[strcspn(buf, "\n")] = '\0';
+	return ok;
+}
+
+static bool read_entry(const char *dev, struct entry *e)
+{
+	char buf[32], *endptr;
+
+	if (!read_attribute(dev, "guid", buf, sizeof(buf)))
+		return false;
+	e->guid = strtoull(buf, &endptr, 16);
+	if (endptr == buf)
+		return false;
+	strcpy(e->dev, dev);
+	if (!read_attribute(dev, "model_name", e->model, sizeof(e->model)))
+		e->model[0] = '\0';
+	return true;
+}
+
+static void add_entry(struct index *index, const struct entry *e)
+{
+	struct entry *entries;
+
+	entries = realloc(index->entries, (index->count + 1) * sizeof(*entries));
+	if (!entries) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	entries[index->count++] = *e;
+	index->entries = entries;
+}
+
+/* device numbers are reused after reboots, so the index must not survive them */
+static char *index_file_name(void)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char *name;
+
+	if (!dir || !*dir)
+		return NULL;
+	if (asprintf(&name, "%s/firewire-devices", dir) < 0)
+		return NULL;
+	return name;
+}
+
+static void load_index(struct index *index)
+{
+	char *name = index_file_name();
+	char line[320];
+	struct entry e;
+	FILE *f;
+
+	if (!name)
+		return;
+	f = fopen(name, "r");
+	free(name);
+	if (!f)
+		return;
+	while (fgets(line, sizeof(line), f)) {
+		e.model[0] = '\0';
+		if (sscanf(line, "%llx %15s %255[^\n]", &e.guid, e.dev, e.model) >= 2 &&
+		    is_node(e.dev))
+			add_entry(index, &e);
+	}
+	fclose(f);
+}
+
+static void save_index(const struct index *index)
+{
+	char *name = index_file_name(), *tmp;
+	unsigned int i;
+	FILE *f;
+
+	if (!name)
+		return;
+	if (asprintf(&tmp, "%s.%d", name, (int)getpid()) < 0) {
+		free(name);
+		return;
+	}
+	f = fopen(tmp, "w");
+	if (f) {
+		for (i = 0; i < index->count; ++i)
+			fprintf(f, "%016llx %s %s\n", index->entries[i].guid,
+				index->entries[i].dev, index->entries[i].model);
+		if (fclose(f) == 0)
+			rename(tmp, name);
+		else
+			unlink(tmp);
+	}
+	free(tmp);
+	free(name);
+}
+
+static void scan_devices(struct index *index)
+{
+	DIR *dir;
+	struct dirent *dirent;
+	struct entry e;
+	__u64 t = fw_timing_begin();
+
+	dir = opendir(SYSFS_DEVICES);
+	if (!dir) {
+		perror(SYSFS_DEVICES);
+		exit(EXIT_FAILURE);
+	}
+	while ((dirent = readdir(dir)) != NULL)
+		if (is_node(dirent->d_name) && read_entry(dirent->d_name, &e))
+			add_entry(index, &e);
+	closedir(dir);
+	fw_timing_end(FW_TIMING_SCAN, t);
+	save_index(index);
+}
+
+static bool matches(const struct entry *e)
+{
+	return by_guid ? e->guid == guid : !strcasecmp(e->model, model);
+}
+
+/* returns the number of matching entries, and the first one */
+static unsigned int find(const struct index *index, struct entry **found)
+{
+	unsigned int i, count = 0;
+
+	for (i = 0; i < index->count; ++i)
+		if (matches(&index->entries[i]) && count++ == 0)
+			*found = &index->entries[i];
+	return count;
+}
+
+/*
+ * The index maps GUIDs to device files.  An entry that is found is
+ * checked against that one device's sysfs attributes, which catches
+ * devices that have been unplugged or renumbered; only then, or when
+ * nothing is found, is the whole device directory scanned again.
+ * Model names are not unique, and a device with the same name might
+ * have been plugged in since the index was written, so they are always
+ * looked up with a full scan.
+ */
+const char *fw_resolve_device_name(const char *arg)
+{
+	struct index index = { NULL, 0 };
+	struct entry *found = NULL, current;
+	unsigned int count;
+	char *endptr, *dev;
+
+	if (!strncasecmp(arg, "guid:", 5)) {
+		by_guid = true;
+		guid = strtoull(arg + 5, &endptr, 16);
+		if (arg[5] == '\0' || *endptr != '\0') {
+			fprintf(stderr, "invalid GUID: `%s'\n", arg + 5);
+			exit(EXIT_FAILURE);
+		}
+	} else if (!strncasecmp(arg, "name:", 5)) {
+		by_guid = false;
+		model = arg + 5;
+	} else {
+		return arg;
+	}
+
+	if (by_guid)
+		load_index(&index);
+	count = find(&index, &found);
+	if (count != 1 || !read_entry(found->dev, &current) || !matches(&current) ||
+	    current.guid != found->guid) {
+		index.count = 0;
+		scan_devices(&index);
+		count = find(&index, &found);
+	}
+	if (count == 0) {
+		fprintf(stderr, "no device found for `%s'\n", arg);
+		exit(EXIT_FAILURE);
+	}
+	if (count > 1) {
+		fprintf(stderr, "more than one device found for `%s'\n", arg);
+		exit(EXIT_FAILURE);
+	}
+	if (asprintf(&dev, "/dev/%s", found->dev) < 0) {
+		perror("asprintf failed");
+		exit(EXIT_FAILURE);
+	}
+	free(index.entries);
+	return dev;
+}
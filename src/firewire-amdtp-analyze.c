@@ -0,0 +1,549 @@
+/*
+ * firewire-amdtp-analyze.c - check the timing of IEC 61883 streams
+ *
+ * licensed under the terms of version 2 of the GNU General Public License
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/firewire-cdev.h>
+#include <asm/byteorder.h>
+#include "fwutils.h"
+
+#define ptr_to_u64(p) ((uintptr_t)(p))
+
+/* iso packet header, timestamp, and both CIP header quadlets */
+#define HEADER_SIZE		16
+/* the rest of the payload is not needed, but the DMA wants somewhere to put it */
+#define PAYLOAD_SIZE		4
+
+#define CYCLES_PER_WRAP		(8 * 8000)
+#define TICKS_PER_CYCLE		3072
+#define TICKS_PER_US		24.576
+
+#define FMT_AM824		0x10
+#define SYT_NO_INFO		0xffff
+
+typedef __u8 u8;
+typedef __u32 u32;
+typedef __u64 u64;
+
+struct stream {
+	unsigned int channel;
+	struct fw_device dev;
+	u32 handle;
+	u8 *buffer;
+	size_t buffer_size;
+	unsigned int ring_head;
+
+	unsigned long long packets;
+	unsigned long long no_cip_packets;
+	unsigned long long empty_packets;
+	unsigned long long data_blocks;
+	unsigned long long dbc_errors;
+	unsigned long long cip_changes;
+	bool have_cip;
+	u32 sid, dbs, fmt, fdf;
+	int next_dbc;
+
+	/* cycle count since the first packet */
+	u64 cycle;
+	int last_timestamp_cycle;
+
+	/* SYT, relative to the reception cycle, in ticks of 24.576 MHz */
+	unsigned long long syt_count;
+	double delay_sum;
+	double delay_square_sum;
+	unsigned int delay_min;
+	unsigned int delay_max;
+	u64 last_syt_time;
+	unsigned long long blocks_since_syt;
+	u64 syt_ticks;
+	unsigned long long syt_blocks;
+};
+
+static const char *device_name;
+static unsigned int n_streams;
+static struct stream *streams;
+static unsigned int buffer_packets = 4096;
+static unsigned int irq_interval = 256;
+static unsigned int duration;
+static unsigned int report_interval;
+static volatile sig_atomic_t stop;
+
+static struct fw_cdev_iso_packet *descriptors;
+
+static void help(void)
+{
+	fputs("Usage: firewire-amdtp-analyze [options] device channel...\n"
+	      "Options:\n"
+	      " -d, --duration=secs   stop after this many seconds\n"
+	      " -r, --report=secs     print the statistics every this many seconds\n"
+	      " -n, --packets=count   number of packets in the DMA buffer (default 4096)\n"
+	      " -i, --interrupt=count packets per interrupt (default 256)\n"
+	      " -h, --help            show this message and exit\n"
+	      " -V, --version         show version number and exit\n"
+	      "\n"
+	      "Report bugs to <" PACKAGE_BUGREPORT ">.\n"
+	      PACKAGE_NAME " home page: <" PACKAGE_URL ">.\n",
+	      stderr);
+}
+
+static unsigned long parse_number(const char *s, const char *what,
+				  unsigned long min, unsigned long max)
+{
+	char *endptr;
+	unsigned long long n;
+
+	errno = 0;
+	n = strtoull(s, &endptr, 0);
+	if (*s == '\0' || *endptr != '\0' || errno) {
+		fprintf(stderr, "invalid %s: `%s'\n", what, s);
+		exit(EXIT_FAILURE);
+	}
+	if (n < min || n > max) {
+		fprintf(stderr, "%s out of range\n", what);
+		exit(EXIT_FAILURE);
+	}
+	return n;
+}
+
+static void parse_parameters(int argc, char *argv[])
+{
+	static const char short_options[] = "d:r:n:i:hV";
+	static const struct option long_options[] = {
+		{ "duration", 1, NULL, 'd' },
+		{ "report", 1, NULL, 'r' },
+		{ "packets", 1, NULL, 'n' },
+		{ "interrupt", 1, NULL, 'i' },
+		{ "help", 0, NULL, 'h' },
+		{ "version", 0, NULL, 'V' },
+		{}
+	};
+	int c;
+	unsigned int i;
+
+	while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+		switch (c) {
+		case 'd':
+			duration = parse_number(optarg, "duration", 1, UINT_MAX);
+			break;
+		case 'r':
+			report_interval = parse_number(optarg, "report interval", 1, UINT_MAX);
+			break;
+		case 'n':
+			buffer_packets = parse_number(optarg, "packet count", 2, 1 << 20);
+			break;
+		case 'i':
+			irq_interval = parse_number(optarg, "interrupt interval", 1, 1 << 20);
+			break;
+		case 'h':
+			help();
+			exit(EXIT_SUCCESS);
+		case 'V':
+			puts("firewire-amdtp-analyze version " PACKAGE_VERSION);
+			exit(EXIT_SUCCESS);
+		default:
+		syntax_error:
+			help();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc)
+		goto syntax_error;
+	device_name = fw_resolve_device_name(argv[optind++]);
+
+	if (optind >= argc)
+		goto syntax_error;
+	n_streams = argc - optind;
+	streams = calloc(n_streams, sizeof(*streams));
+	if (!streams) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n_streams; ++i)
+		streams[i].channel = parse_number(argv[optind + i], "channel", 0, 63);
+
+	if (irq_interval > buffer_packets / 2)
+		irq_interval = buffer_packets / 2;
+}
+
+/*
+ * Every stream needs its own context, and every context its own file
+ * descriptor.
+ */
+static void open_stream(struct stream *stream)
+{
+	struct fw_cdev_create_iso_context create;
+
+	if (fw_device_open(&stream->dev, device_name) < 0) {
+		perror(device_name);
+		exit(EXIT_FAILURE);
+	}
+	if (stream->dev.version < 2) {
+		fputs("this kernel is too old\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	/* before ABI version 5, headers beyond one page per interrupt get lost */
+	if (stream->dev.version < 5 && irq_interval * HEADER_SIZE > getpagesize())
+		irq_interval = getpagesize() / HEADER_SIZE;
+
+	create.type = FW_CDEV_ISO_CONTEXT_RECEIVE;
+	create.header_size = HEADER_SIZE;
+	create.channel = stream->channel;
+	create.speed = 0;
+	create.closure = ptr_to_u64(stream);
+	if (ioctl(stream->dev.fd, FW_CDEV_IOC_CREATE_ISO_CONTEXT, &create) < 0) {
+		fprintf(stderr, "channel %u: ", stream->channel);
+		perror("CREATE_ISO_CONTEXT ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	stream->handle = create.handle;
+
+	stream->buffer_size = (size_t)buffer_packets * PAYLOAD_SIZE;
+	stream->buffer_size = (stream->buffer_size + getpagesize() - 1) &
+			      ~(size_t)(getpagesize() - 1);
+	stream->buffer = mmap(NULL, stream->buffer_size, PROT_READ, MAP_SHARED,
+			      stream->dev.fd, 0);
+	if (stream->buffer == MAP_FAILED) {
+		perror("mmap failed");
+		exit(EXIT_FAILURE);
+	}
+
+	stream->next_dbc = -1;
+	stream->last_timestamp_cycle = -1;
+	stream->delay_min = UINT_MAX;
+}
+
+static void init_descriptors(void)
+{
+	unsigned int i;
+
+	/* all streams use the same packet layout */
+	descriptors = calloc(buffer_packets, sizeof(*descriptors));
+	if (!descriptors) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < buffer_packets; ++i) {
+		descriptors[i].control = FW_CDEV_ISO_HEADER_LENGTH(HEADER_SIZE) |
+					 FW_CDEV_ISO_PAYLOAD_LENGTH(PAYLOAD_SIZE);
+		if ((i + 1) % irq_interval == 0 || i == buffer_packets - 1)
+			descriptors[i].control |= FW_CDEV_ISO_INTERRUPT;
+	}
+}
+
+static void queue(struct stream *stream, unsigned int first, unsigned int count)
+{
+	struct fw_cdev_queue_iso queue_iso;
+	unsigned int n;
+
+	while (count > 0) {
+		n = buffer_packets - first;
+		if (n > count)
+			n = count;
+		queue_iso.packets = ptr_to_u64(&descriptors[first]);
+		queue_iso.data = ptr_to_u64(stream->buffer + (size_t)first * PAYLOAD_SIZE);
+		queue_iso.size = n * sizeof(*descriptors);
+		queue_iso.handle = stream->handle;
+		if (ioctl(stream->dev.fd, FW_CDEV_IOC_QUEUE_ISO, &queue_iso) < 0) {
+			perror("QUEUE_ISO ioctl failed");
+			exit(EXIT_FAILURE);
+		}
+		if (queue_iso.size != 0) {
+			fputs("DMA queue is full; use fewer packets\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		first = (first + n) % buffer_packets;
+		count -= n;
+	}
+}
+
+static void start_stream(struct stream *stream)
+{
+	struct fw_cdev_start_iso start_iso;
+
+	queue(stream, 0, buffer_packets);
+	start_iso.cycle = -1;
+	start_iso.sync = 0;
+	start_iso.tags = FW_CDEV_ISO_CONTEXT_MATCH_ALL_TAGS;
+	start_iso.handle = stream->handle;
+	if (ioctl(stream->dev.fd, FW_CDEV_IOC_START_ISO, &start_iso) < 0) {
+		perror("START_ISO ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void stop_stream(struct stream *stream)
+{
+	struct fw_cdev_stop_iso stop_iso;
+
+	stop_iso.handle = stream->handle;
+	if (ioctl(stream->dev.fd, FW_CDEV_IOC_STOP_ISO, &stop_iso) < 0) {
+		perror("STOP_ISO ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	munmap(stream->buffer, stream->buffer_size);
+	fw_device_close(&stream->dev);
+}
+
+static void analyze_syt(struct stream *stream, unsigned int timestamp_cycle,
+			u32 syt, unsigned int blocks)
+{
+	unsigned int delta, delay;
+	u64 time;
+
+	/* the SYT has the low four bits of the cycle count */
+	delta = ((syt >> 12) - (timestamp_cycle & 0xf)) & 0xf;
+	delay = delta * TICKS_PER_CYCLE + (syt & 0xfff);
+	time = stream->cycle * TICKS_PER_CYCLE + delay;
+
+	++stream->syt_count;
+	stream->delay_sum += delay;
+	stream->delay_square_sum += (double)delay * delay;
+	if (delay < stream->delay_min)
+		stream->delay_min = delay;
+	if (delay > stream->delay_max)
+		stream->delay_max = delay;
+
+	if (stream->last_syt_time && time > stream->last_syt_time) {
+		stream->syt_ticks += time - stream->last_syt_time;
+		stream->syt_blocks += stream->blocks_since_syt;
+	}
+	stream->last_syt_time = time;
+	stream->blocks_since_syt = blocks;
+}
+
+/*
+ * Analyzes all packets reported by one interrupt.  Only the stripped
+ * headers are looked at; the payloads are never touched.
+ */
+static void analyze_packets(struct stream *stream, const u32 *headers, unsigned int count)
+{
+	const u32 *h;
+	u32 header, timestamp, cip0, cip1, length;
+	u32 sid, dbs, dbc, fmt, fdf, syt;
+	unsigned int blocks;
+	int timestamp_cycle;
+
+	for (h = headers; h < headers + count * (HEADER_SIZE / 4); h += HEADER_SIZE / 4) {
+		header = __be32_to_cpu(h[0]);
+		timestamp = __be32_to_cpu(h[1]);
+		length = header >> 16;
+
+		timestamp_cycle = ((timestamp >> 13) & 7) * 8000 + (timestamp & 0x1fff);
+		if (stream->last_timestamp_cycle >= 0)
+			stream->cycle += (timestamp_cycle - stream->last_timestamp_cycle +
+					  CYCLES_PER_WRAP) % CYCLES_PER_WRAP;
+		stream->last_timestamp_cycle = timestamp_cycle;
+		++stream->packets;
+
+		cip0 = __be32_to_cpu(h[2]);
+		cip1 = __be32_to_cpu(h[3]);
+		if (length < 8 || (cip0 & 0xc0000000) != 0 ||
+		    (cip1 & 0xc0000000) != 0x80000000) {
+			++stream->no_cip_packets;
+			continue;
+		}
+		sid = (cip0 >> 24) & 0x3f;
+		dbs = (cip0 >> 16) & 0xff;
+		dbc = cip0 & 0xff;
+		fmt = (cip1 >> 24) & 0x3f;
+		fdf = (cip1 >> 16) & 0xff;
+		syt = cip1 & 0xffff;
+
+		if (stream->have_cip &&
+		    (sid != stream->sid || dbs != stream->dbs ||
+		     fmt != stream->fmt || fdf != stream->fdf))
+			++stream->cip_changes;
+		stream->have_cip = true;
+		stream->sid = sid;
+		stream->dbs = dbs;
+		stream->fmt = fmt;
+		stream->fdf = fdf;
+
+		blocks = dbs ? (length - 8) / (dbs * 4) : 0;
+		if (!blocks)
+			++stream->empty_packets;
+		stream->data_blocks += blocks;
+
+		/* an empty packet has the DBC of the next data block */
+		if (stream->next_dbc >= 0 && dbc != stream->next_dbc)
+			++stream->dbc_errors;
+		stream->next_dbc = (dbc + blocks) & 0xff;
+
+		if (syt != SYT_NO_INFO && blocks)
+			analyze_syt(stream, timestamp_cycle, syt, blocks);
+		else
+			stream->blocks_since_syt += blocks;
+	}
+}
+
+static void handle_event(struct stream *stream, const struct fw_cdev_event_iso_interrupt *interrupt)
+{
+	unsigned int count = interrupt->header_length / HEADER_SIZE;
+
+	analyze_packets(stream, interrupt->header, count);
+	queue(stream, stream->ring_head, count);
+	stream->ring_head = (stream->ring_head + count) % buffer_packets;
+}
+
+static const char *format_name(u32 fmt)
+{
+	switch (fmt) {
+	case 0x00:	return "DV";
+	case 0x01:	return "audio/music (old)";
+	case FMT_AM824:	return "AM824";
+	case 0x20:	return "MPEG2-TS";
+	default:	return "unknown";
+	}
+}
+
+static void print_stream(const struct stream *stream, double secs)
+{
+	double mean, variance;
+
+	printf("channel %u: %llu packets (%.1f/s), %llu empty, %llu without CIP\n",
+	       stream->channel, stream->packets, stream->packets / secs,
+	       stream->empty_packets, stream->no_cip_packets);
+	if (!stream->have_cip)
+		return;
+	printf("  sid %u, dbs %u, fmt 0x%02x (%s), fdf 0x%02x",
+	       stream->sid, stream->dbs, stream->fmt, format_name(stream->fmt), stream->fdf);
+	if (stream->cip_changes)
+		printf(", %llu changes", stream->cip_changes);
+	printf("\n  %llu data blocks, %llu DBC discontinuities\n",
+	       stream->data_blocks, stream->dbc_errors);
+	if (!stream->syt_count)
+		return;
+	mean = stream->delay_sum / stream->syt_count;
+	variance = stream->delay_square_sum / stream->syt_count - mean * mean;
+	printf("  SYT: transfer delay %.1f us (min %.1f, max %.1f), jitter %.2f us",
+	       mean / TICKS_PER_US, stream->delay_min / TICKS_PER_US,
+	       stream->delay_max / TICKS_PER_US,
+	       sqrt(variance > 0 ? variance : 0) / TICKS_PER_US);
+	if (stream->syt_ticks)
+		printf(", %.1f blocks/s",
+		       stream->syt_blocks * TICKS_PER_US * 1e6 / stream->syt_ticks);
+	putchar('\n');
+}
+
+static double seconds_since(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) * 1e-9;
+}
+
+static void print_report(const struct timespec *start)
+{
+	double secs = seconds_since(start);
+	unsigned int i;
+
+	for (i = 0; i < n_streams; ++i)
+		print_stream(&streams[i], secs > 0 ? secs : 1);
+	fflush(stdout);
+}
+
+static void stop_signal(int signum)
+{
+	stop = true;
+}
+
+static void analyze(void)
+{
+	struct sigaction sa;
+	struct pollfd *pfds;
+	size_t event_size;
+	union fw_cdev_event *event;
+	struct timespec start, last_report;
+	unsigned int i;
+	int ready;
+	ssize_t r;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	event_size = sizeof(struct fw_cdev_event_iso_interrupt) +
+		     (size_t)buffer_packets * HEADER_SIZE;
+	event = malloc(event_size);
+	pfds = calloc(n_streams, sizeof(*pfds));
+	if (!event || !pfds) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n_streams; ++i) {
+		pfds[i].fd = streams[i].dev.fd;
+		pfds[i].events = POLLIN;
+		start_stream(&streams[i]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	last_report = start;
+
+	while (!stop) {
+		if (duration && seconds_since(&start) >= duration)
+			break;
+		if (report_interval && seconds_since(&last_report) >= report_interval) {
+			print_report(&start);
+			clock_gettime(CLOCK_MONOTONIC, &last_report);
+		}
+		ready = poll(pfds, n_streams, 1000);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll failed");
+			exit(EXIT_FAILURE);
+		}
+		for (i = 0; i < n_streams && ready > 0; ++i) {
+			if (!(pfds[i].revents & POLLIN))
+				continue;
+			--ready;
+			r = read(pfds[i].fd, event, event_size);
+			if (r < 0 && errno == EINTR)
+				continue;
+			if (r < (ssize_t)sizeof(struct fw_cdev_event_common)) {
+				fputs("short read\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+			if (event->common.type == FW_CDEV_EVENT_ISO_INTERRUPT)
+				handle_event(&streams[i], &event->iso_interrupt);
+		}
+	}
+
+	print_report(&start);
+	for (i = 0; i < n_streams; ++i)
+		stop_stream(&streams[i]);
+	free(pfds);
+	free(event);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int i;
+
+	parse_parameters(argc, argv);
+	for (i = 0; i < n_streams; ++i)
+		open_stream(&streams[i]);
+	init_descriptors();
+	analyze();
+	return 0;
+}
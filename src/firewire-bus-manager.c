@@ -0,0 +1,1385 @@
+/*
+ * firewire-bus-manager.c - bus management tasks
+ *
+ * licensed under the terms of version 2 of the GNU General Public License
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/timerfd.h>
+#include <linux/firewire-cdev.h>
+#include <linux/firewire-constants.h>
+#include <asm/byteorder.h>
+#include "fwutils.h"
+
+#ifndef FW_CDEV_IOC_SEND_PHY_PACKET
+#error kernel headers too old
+#endif
+
+#define ptr_to_u64(p) ((uintptr_t)(p))
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof *(a))
+
+#define STATE_CLEAR_ADDR	0xfffff0000000uLL
+#define STATE_SET_ADDR		0xfffff0000004uLL
+#define SPLIT_TIMEOUT_HI_ADDR	0xfffff0000018uLL
+#define SPLIT_TIMEOUT_LO_ADDR	0xfffff000001cuLL
+#define BUS_TIME_ADDR		0xfffff0000204uLL
+#define PRIORITY_BUDGET_ADDR	0xfffff0000218uLL
+#define BUS_MANAGER_ID_ADDR	0xfffff000021cuLL
+#define BANDWIDTH_AVAILABLE_ADDR	0xfffff0000220uLL
+#define CHANNELS_AVAILABLE_HI_ADDR	0xfffff0000224uLL
+#define CHANNELS_AVAILABLE_LO_ADDR	0xfffff0000228uLL
+#define TOPOLOGY_MAP_ADDR	0xfffff0001000uLL
+
+#define STATE_CMSTR		0x00000100
+#define BANDWIDTH_AVAILABLE_INITIAL	4915
+#define BROADCAST_CHANNEL	31
+#define BUS_MANAGER_ID_NONE	0x3f
+#define BIB_CMC			0x40000000
+
+/* the default of IEEE 1394, 100 ms */
+#define SPLIT_TIMEOUT_DEFAULT	800
+#define SPLIT_TIMEOUT_MAX	(8 * 8000 - 1)
+
+/* the kernel's bus manager needs some time after a bus reset */
+#define SETTLE_TIME_MS		500
+/* look at BUS_TIME when the cycle timer's seconds have surely wrapped */
+#define ROLLOVER_MARGIN_MS	100
+/* how often to look at the IRM, with the cycle master off or on */
+#define IRM_POLL_OFF_MS		100
+#define IRM_POLL_ON_MS		1000
+#define ACTIVITY_TIME_MS	100
+/* a PHY packet is on the wire within a few cycles */
+#define PHY_PACKET_TIMEOUT_MS	100
+/* stop reconfiguring a bus that does not accept the configuration */
+#define MAX_BUS_RESETS		5
+
+typedef __u8 u8;
+typedef __u32 u32;
+typedef __u64 u64;
+
+struct node {
+	struct node *next;
+	struct fw_device dev;
+	u32 id;		/* in the generation in which it was opened */
+};
+
+struct transaction {
+	struct node *node;
+	u32 tcode;
+	u64 offset;
+	u32 value;	/* to be written, or read */
+	u32 rcode;
+};
+
+/* something in the event loop that becomes readable */
+struct watch {
+	int fd;
+	void (*handler)(void);
+};
+
+static bool verbose;
+static bool once;
+static bool check_activity;
+static const char *device_name;
+static const struct command *command;
+static const char *parameter;
+
+static struct fw_device device;	/* the local node */
+static struct fw_engine *engine;
+/* as of the last time the bus settled; device.bus may be newer */
+static struct fw_cdev_event_bus_reset bus;
+static struct node *nodes;
+
+static int epoll_fd;
+static struct watch card_watch;
+static struct watch settle_watch;
+static volatile sig_atomic_t stop;
+
+/* bus_time */
+static struct watch rollover_watch;
+static bool bus_time_active;
+static u32 bus_time_base;
+
+/* split_timeout */
+static unsigned int split_timeout;
+
+/* cycle_master */
+static struct watch irm_poll_watch;
+
+/* run */
+static unsigned int bus_resets;
+static bool reset_pending;
+
+struct topology {
+	unsigned int node_count;
+	unsigned int max_hops;
+	bool gap_count_consistent;
+	u32 gap_count;
+};
+
+/* priority_budget */
+enum node_class {
+	CLASS_SBP2,
+	CLASS_AVC,
+	CLASS_IIDC,
+	CLASS_IPV4,
+	CLASS_OTHER,
+	CLASS_COUNT
+};
+static const char *const class_names[CLASS_COUNT] = {
+	[CLASS_SBP2]  = "sbp2",
+	[CLASS_AVC]   = "avc",
+	[CLASS_IIDC]  = "iidc",
+	[CLASS_IPV4]  = "ipv4",
+	[CLASS_OTHER] = "other",
+};
+/* storage gets priority over everything else, unless configured otherwise */
+static unsigned int class_budget[CLASS_COUNT] = {
+	[CLASS_SBP2] = 8,
+};
+
+static void help(void)
+{
+	fputs("Usage: firewire-bus-manager [options] device command\n"
+	      "Commands:\n"
+	      "  bus_time                 initialize and maintain BUS_TIME\n"
+	      "  split_timeout [cycles]   make SPLIT_TIMEOUT the same on all nodes\n"
+	      "  priority_budget [file]   set PRIORITY_BUDGET by device class\n"
+	      "  cycle_master             disable the cycle master while no iso resources\n"
+	      "                           are allocated\n"
+	      "  run [file]               become bus manager, and do all of the above\n"
+	      "Options:\n"
+	      " -1, --once      do the task once, not after every bus reset\n"
+	      " -a, --activity  with cycle_master, also look for iso packets\n"
+	      " -v, --verbose   report what is done\n"
+	      " -h, --help      show this message and exit\n"
+	      " -V, --version   show version number and exit\n"
+	      "\n"
+	      "<device> is the local node (/dev/fwX or guid:<eui64>) of the bus to be managed\n"
+	      "\n"
+	      "Report bugs to <" PACKAGE_BUGREPORT ">.\n"
+	      PACKAGE_NAME " home page: <" PACKAGE_URL ">.\n",
+	      stderr);
+}
+
+static void open_device(void)
+{
+	if (fw_device_open(&device, device_name) < 0) {
+		perror(device_name);
+		exit(EXIT_FAILURE);
+	}
+	if (!fw_device_is_local(&device)) {
+		fprintf(stderr, "%s is not a local node\n", device_name);
+		exit(EXIT_FAILURE);
+	}
+	bus = device.bus;
+	engine = fw_engine_new();
+	if (!engine || fw_engine_add_device(engine, &device) < 0) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void close_device(void)
+{
+	fw_device_close(&device);
+	fw_engine_free(engine);
+	engine = NULL;
+}
+
+static void close_nodes(void)
+{
+	struct node *node, *next;
+
+	for (node = nodes; node; node = next) {
+		next = node->next;
+		fw_device_close(&node->dev);
+		free(node);
+	}
+	nodes = NULL;
+}
+
+/*
+ * Opens the device files of all nodes on our bus.  Device files appear
+ * and disappear after bus resets, so this is redone every time.
+ */
+static void open_nodes(void)
+{
+	struct dirent **ents;
+	struct node *node;
+	char *name;
+	int count, i;
+
+	close_nodes();
+	count = fw_scan_devices("/dev", &ents);
+	if (count < 0) {
+		perror("cannot read /dev");
+		exit(EXIT_FAILURE);
+	}
+	for (i = count - 1; i >= 0; --i) {
+		node = malloc(sizeof(*node));
+		if (!node) {
+			fputs("out of memory\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		if (asprintf(&name, "/dev/%s", ents[i]->d_name) < 0) {
+			perror("asprintf failed");
+			exit(EXIT_FAILURE);
+		}
+		if (fw_device_open(&node->dev, name) < 0) {
+			free(node);
+			goto next;
+		}
+		if (node->dev.card != device.card ||
+		    node->dev.bus.generation != bus.generation) {
+			fw_device_close(&node->dev);
+			free(node);
+			goto next;
+		}
+		if (fw_engine_add_device(engine, &node->dev) < 0) {
+			fputs("out of memory\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		node->id = node->dev.bus.node_id;
+		node->next = nodes;
+		nodes = node;
+	next:
+		free(name);
+	}
+	fw_free_devices(ents, count);
+}
+
+static struct node *find_node(u32 id)
+{
+	struct node *node;
+
+	for (node = nodes; node; node = node->next)
+		if (node->id == id)
+			return node;
+	return NULL;
+}
+
+static const char *rcode_name(u32 rcode)
+{
+	switch (rcode) {
+	case RCODE_COMPLETE:		return "complete";
+	case RCODE_CONFLICT_ERROR:	return "conflict error";
+	case RCODE_DATA_ERROR:		return "data error";
+	case RCODE_TYPE_ERROR:		return "type error";
+	case RCODE_ADDRESS_ERROR:	return "address error";
+	case RCODE_SEND_ERROR:		return "send error";
+	case RCODE_CANCELLED:		return "cancelled";
+	case RCODE_BUSY:		return "busy";
+	case RCODE_GENERATION:		return "bus reset";
+	case RCODE_NO_ACK:		return "no ack";
+	default:			return "unknown error";
+	}
+}
+
+static void run_engine(void)
+{
+	if (fw_engine_run(engine) < 0) {
+		perror("reading events failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void set_transaction(struct transaction *t, struct node *node,
+			    u32 tcode, u64 offset, u32 value)
+{
+	t->node = node;
+	t->tcode = tcode;
+	t->offset = offset;
+	t->value = value;
+	t->rcode = RCODE_CANCELLED;
+}
+
+static void transaction_done(struct fw_device *dev, int rcode,
+			     const void *data, unsigned int length, void *arg)
+{
+	struct transaction *t = arg;
+	u32 quadlet;
+
+	t->rcode = rcode;
+	if (rcode == RCODE_COMPLETE && length >= 4) {
+		memcpy(&quadlet, data, 4);
+		t->value = __be32_to_cpu(quadlet);
+	}
+}
+
+static void submit_transaction(struct transaction *t, const void *data, unsigned int length)
+{
+	if (fw_submit_request(engine, &t->node->dev, t->tcode, t->offset, data, length,
+			      transaction_done, t) < 0)
+		t->rcode = RCODE_SEND_ERROR;
+}
+
+/* returns the rcode, and the first quadlet of response data in *value */
+static u32 sync_request(struct node *node, u32 tcode, u64 offset,
+			u32 *data, unsigned int length, u32 *value)
+{
+	struct transaction t;
+
+	set_transaction(&t, node, tcode, offset, *value);
+	submit_transaction(&t, data, length);
+	run_engine();
+	*value = t.value;
+	return t.rcode;
+}
+
+static u32 quadlet_request(struct node *node, u32 tcode, u64 offset, u32 *value)
+{
+	u32 data = __cpu_to_be32(*value);
+
+	return sync_request(node, tcode, offset,
+			    tcode == TCODE_WRITE_QUADLET_REQUEST ? &data : NULL, 4, value);
+}
+
+static u32 read_quadlet(struct node *node, u64 offset, u32 *value)
+{
+	*value = 0;
+	return quadlet_request(node, TCODE_READ_QUADLET_REQUEST, offset, value);
+}
+
+static u32 write_quadlet(struct node *node, u64 offset, u32 value)
+{
+	return quadlet_request(node, TCODE_WRITE_QUADLET_REQUEST, offset, &value);
+}
+
+static u32 compare_swap(struct node *node, u64 offset, u32 arg, u32 data, u32 *old)
+{
+	u32 lock_data[2] = { __cpu_to_be32(arg), __cpu_to_be32(data) };
+
+	*old = 0;
+	return sync_request(node, TCODE_LOCK_COMPARE_SWAP, offset, lock_data, 8, old);
+}
+
+static unsigned int count_nodes(void)
+{
+	struct node *node;
+	unsigned int count = 0;
+
+	for (node = nodes; node; node = node->next)
+		++count;
+	return count;
+}
+
+/*
+ * Submits all requests before waiting for any response, so that the
+ * requests to all nodes are in flight at the same time.
+ */
+static void run_transactions(struct transaction *t, unsigned int count)
+{
+	unsigned int i;
+	u32 data;
+
+	for (i = 0; i < count; ++i) {
+		data = __cpu_to_be32(t[i].value);
+		submit_transaction(&t[i], t[i].tcode == TCODE_WRITE_QUADLET_REQUEST ? &data : NULL, 4);
+	}
+	run_engine();
+}
+
+static void add_watch(struct watch *watch)
+{
+	struct epoll_event event;
+
+	event.events = EPOLLIN;
+	event.data.ptr = watch;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watch->fd, &event) < 0) {
+		perror("epoll_ctl failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void init_timer(struct watch *watch, void (*handler)(void))
+{
+	watch->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (watch->fd == -1) {
+		perror("timerfd_create failed");
+		exit(EXIT_FAILURE);
+	}
+	watch->handler = handler;
+	add_watch(watch);
+}
+
+/* a time of zero disarms the timer */
+static void set_timer(struct watch *watch, u64 ns)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ns / 1000000000;
+	its.it_value.tv_nsec = ns % 1000000000;
+	if (timerfd_settime(watch->fd, 0, &its, NULL) < 0) {
+		perror("timerfd_settime failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void ack_timer(struct watch *watch)
+{
+	u64 expirations;
+
+	if (read(watch->fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+		perror("timerfd read failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void sample_cycle_timer(struct fw_cdev_get_cycle_timer2 *ct)
+{
+	ct->clk_id = CLOCK_REALTIME;
+	if (ioctl(device.fd, FW_CDEV_IOC_GET_CYCLE_TIMER2, ct) < 0) {
+		perror("GET_CYCLE_TIMER2 ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/* nanoseconds until the seconds field of the cycle timer wraps to zero */
+static u64 ns_until_rollover(u32 cycle_timer)
+{
+	u64 ticks;
+
+	ticks = ((cycle_timer >> 25) * 8000 + ((cycle_timer >> 12) & 0x1fff)) * 3072uLL +
+		(cycle_timer & 0xfff);
+	return (128 * 8000 * 3072uLL - ticks) * 1000 / 24576;
+}
+
+/*
+ * BUS_TIME belongs to the cycle master, i.e., to the root node.  Its low
+ * seven bits are the seconds of the cycle timer; the upper bits are set
+ * so that the whole value is the system time in seconds since the epoch.
+ */
+static void initialize_bus_time(void)
+{
+	struct fw_cdev_get_cycle_timer2 ct;
+	struct node *root;
+	u32 seconds, delta, value, rcode;
+
+	root = find_node(bus.root_node_id);
+	if (!root) {
+		fprintf(stderr, "cannot access the root node %x\n", bus.root_node_id);
+		bus_time_active = false;
+		return;
+	}
+
+	sample_cycle_timer(&ct);
+	seconds = ct.tv_sec;
+	delta = (seconds - (ct.cycle_timer >> 25)) & 0x7f;
+	value = delta < 64 ? seconds - delta : seconds - delta + 128;
+
+	rcode = write_quadlet(root, BUS_TIME_ADDR, value);
+	if (rcode != RCODE_COMPLETE) {
+		fprintf(stderr, "cannot write BUS_TIME: %s\n", rcode_name(rcode));
+		bus_time_active = false;
+		return;
+	}
+	if (verbose)
+		printf("BUS_TIME of node %x initialized to %u\n", root->id, value);
+	bus_time_base = value & ~0x7f;
+	set_timer(&rollover_watch, ns_until_rollover(ct.cycle_timer) +
+		  ROLLOVER_MARGIN_MS * 1000000uLL);
+}
+
+/*
+ * Called once per 128 seconds, just after the cycle timer's seconds
+ * wrapped: the upper bits of BUS_TIME must have been incremented.
+ */
+static void bus_time_rollover(void)
+{
+	struct fw_cdev_get_cycle_timer2 ct;
+	struct node *root;
+	u32 value, rcode;
+
+	ack_timer(&rollover_watch);
+	if (!bus_time_active)
+		return;
+
+	sample_cycle_timer(&ct);
+	bus_time_base += 128;
+	root = find_node(bus.root_node_id);
+	if (root) {
+		rcode = read_quadlet(root, BUS_TIME_ADDR, &value);
+		if (rcode == RCODE_COMPLETE && (value & ~0x7f) != bus_time_base) {
+			value = bus_time_base | (ct.cycle_timer >> 25);
+			rcode = write_quadlet(root, BUS_TIME_ADDR, value);
+			if (verbose && rcode == RCODE_COMPLETE)
+				printf("BUS_TIME of node %x corrected to %u\n", root->id, value);
+		}
+		if (rcode != RCODE_COMPLETE)
+			fprintf(stderr, "cannot access BUS_TIME: %s\n", rcode_name(rcode));
+	}
+	set_timer(&rollover_watch, ns_until_rollover(ct.cycle_timer) +
+		  ROLLOVER_MARGIN_MS * 1000000uLL);
+}
+
+static void bus_time_start(void)
+{
+	init_timer(&rollover_watch, bus_time_rollover);
+}
+
+static void bus_time_reset(void)
+{
+	u32 local = bus.local_node_id;
+
+	bus_time_active = local == bus.root_node_id || local == bus.bm_node_id;
+	set_timer(&rollover_watch, 0);
+	if (bus_time_active)
+		initialize_bus_time();
+	else if (verbose)
+		puts("neither cycle master nor bus manager; not touching BUS_TIME");
+}
+
+static unsigned int split_timeout_cycles(u32 hi, u32 lo)
+{
+	unsigned int cycles = (lo >> 19) & 0x1fff;
+
+	if (cycles > 7999)
+		cycles = 7999;
+	return (hi & 7) * 8000 + cycles;
+}
+
+static void split_timeout_start(void)
+{
+	char *endptr;
+	unsigned long cycles;
+
+	if (!parameter)
+		return;
+	cycles = strtoul(parameter, &endptr, 0);
+	if (*parameter == '\0' || *endptr != '\0' || cycles == 0 || cycles > SPLIT_TIMEOUT_MAX) {
+		fprintf(stderr, "invalid split timeout: `%s'\n", parameter);
+		exit(EXIT_FAILURE);
+	}
+	split_timeout = cycles;
+}
+
+/*
+ * Reads SPLIT_TIMEOUT from all nodes, and writes the largest value (or
+ * the value from the command line) to all nodes that have another one.
+ */
+static void split_timeout_reset(void)
+{
+	struct transaction *t;
+	struct node *node;
+	unsigned int n_nodes = count_nodes(), i, n, target, cycles;
+
+	t = calloc(n_nodes * 2, sizeof(*t));
+	if (n_nodes && !t) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	for (node = nodes, i = 0; node; node = node->next, ++i) {
+		set_transaction(&t[i * 2], node, TCODE_READ_QUADLET_REQUEST, SPLIT_TIMEOUT_HI_ADDR, 0);
+		set_transaction(&t[i * 2 + 1], node, TCODE_READ_QUADLET_REQUEST, SPLIT_TIMEOUT_LO_ADDR, 0);
+	}
+	run_transactions(t, n_nodes * 2);
+
+	target = split_timeout;
+	for (i = 0; i < n_nodes; ++i) {
+		if (t[i * 2].rcode != RCODE_COMPLETE || t[i * 2 + 1].rcode != RCODE_COMPLETE) {
+			if (verbose)
+				printf("node %x: cannot read SPLIT_TIMEOUT: %s\n", t[i * 2].node->id,
+				       rcode_name(t[i * 2].rcode != RCODE_COMPLETE ?
+						  t[i * 2].rcode : t[i * 2 + 1].rcode));
+			continue;
+		}
+		cycles = split_timeout_cycles(t[i * 2].value, t[i * 2 + 1].value);
+		if (verbose)
+			printf("node %x: SPLIT_TIMEOUT is %u cycles\n", t[i * 2].node->id, cycles);
+		if (!split_timeout && cycles > target)
+			target = cycles;
+	}
+	if (target < SPLIT_TIMEOUT_DEFAULT && !split_timeout)
+		target = SPLIT_TIMEOUT_DEFAULT;
+
+	/* the writes, for the nodes that are out of line */
+	for (i = 0, n = 0; i < n_nodes; ++i) {
+		if (t[i * 2].rcode != RCODE_COMPLETE || t[i * 2 + 1].rcode != RCODE_COMPLETE ||
+		    split_timeout_cycles(t[i * 2].value, t[i * 2 + 1].value) == target)
+			continue;
+		node = t[i * 2].node;
+		set_transaction(&t[n++], node, TCODE_WRITE_QUADLET_REQUEST,
+				SPLIT_TIMEOUT_HI_ADDR, target / 8000);
+		set_transaction(&t[n++], node, TCODE_WRITE_QUADLET_REQUEST,
+				SPLIT_TIMEOUT_LO_ADDR, (target % 8000) << 19);
+	}
+	run_transactions(t, n);
+
+	/* and the verification */
+	for (i = 0; i < n; ++i) {
+		if (t[i].rcode != RCODE_COMPLETE && (i % 2 == 0 || t[i - 1].rcode == RCODE_COMPLETE))
+			printf("node %x: cannot write SPLIT_TIMEOUT: %s\n",
+			       t[i].node->id, rcode_name(t[i].rcode));
+		t[i].tcode = TCODE_READ_QUADLET_REQUEST;
+	}
+	run_transactions(t, n);
+	for (i = 0; i < n; i += 2) {
+		if (t[i].rcode != RCODE_COMPLETE || t[i + 1].rcode != RCODE_COMPLETE)
+			printf("node %x: cannot verify SPLIT_TIMEOUT\n", t[i].node->id);
+		else if ((cycles = split_timeout_cycles(t[i].value, t[i + 1].value)) != target)
+			printf("node %x: SPLIT_TIMEOUT is still %u cycles\n", t[i].node->id, cycles);
+		else
+			printf("node %x: SPLIT_TIMEOUT set to %u cycles\n", t[i].node->id, target);
+	}
+	if (verbose)
+		printf("SPLIT_TIMEOUT of the bus is %u cycles\n", target);
+
+	free(t);
+}
+
+/*
+ * Looks at the specifier ID and version of every unit directory
+ * in the config ROM; the first unit that is known wins.
+ */
+static enum node_class classify_node(const struct node *node)
+{
+	const u32 *rom = node->dev.rom;
+	unsigned int length = node->dev.rom_length / 4;
+	unsigned int root, root_end, unit, unit_end, i, j;
+	u32 key, value, specifier_id, version;
+
+	if (length < 1)
+		return CLASS_OTHER;
+	root = 1 + (rom[0] >> 24);
+	if (root >= length)
+		return CLASS_OTHER;
+	root_end = root + 1 + (rom[root] >> 16);
+	if (root_end > length)
+		root_end = length;
+
+	for (i = root + 1; i < root_end; ++i) {
+		if (rom[i] >> 24 != 0xd1)
+			continue;
+		unit = i + (rom[i] & 0xffffff);
+		if (unit >= length)
+			continue;
+		unit_end = unit + 1 + (rom[unit] >> 16);
+		if (unit_end > length)
+			unit_end = length;
+		specifier_id = version = 0;
+		for (j = unit + 1; j < unit_end; ++j) {
+			key = rom[j] >> 24;
+			value = rom[j] & 0xffffff;
+			if (key == 0x12)
+				specifier_id = value;
+			else if (key == 0x13)
+				version = value;
+		}
+		if (specifier_id == 0x00609e && version == 0x010483)
+			return CLASS_SBP2;
+		if (specifier_id == 0x00a02d && (version >> 16) == 0x01)
+			return CLASS_AVC;
+		if (specifier_id == 0x00a02d && (version >> 8) == 0x0001)
+			return CLASS_IIDC;
+		if (specifier_id == 0x00005e && version == 0x000001)
+			return CLASS_IPV4;
+	}
+	return CLASS_OTHER;
+}
+
+/*
+ * The policy file has lines of the form "<class> <budget>";
+ * everything after # is a comment.
+ */
+static void priority_budget_start(void)
+{
+	FILE *f;
+	char line[256], name[32], *p;
+	unsigned int budget, line_number = 0, i;
+	int n;
+
+	if (!parameter)
+		return;
+	f = fopen(parameter, "r");
+	if (!f) {
+		perror(parameter);
+		exit(EXIT_FAILURE);
+	}
+	memset(class_budget, 0, sizeof(class_budget));
+	while (fgets(line, sizeof(line), f)) {
+		++line_number;
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		if (sscanf(line, " %31s %u %n", name, &budget, &n) < 2) {
+			if (sscanf(line, " %31s", name) < 1)
+				continue;
+			goto invalid;
+		}
+		if (line[n] != '\0' || budget > 0x3f)
+			goto invalid;
+		for (i = 0; i < CLASS_COUNT; ++i)
+			if (!strcasecmp(name, class_names[i]))
+				break;
+		if (i == CLASS_COUNT) {
+			fprintf(stderr, "%s:%u: unknown class `%s'\n", parameter, line_number, name);
+			exit(EXIT_FAILURE);
+		}
+		class_budget[i] = budget;
+	}
+	fclose(f);
+	return;
+
+invalid:
+	fprintf(stderr, "%s:%u: syntax error\n", parameter, line_number);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * PRIORITY_BUDGET has the node's maximum in pri_max (bits 13-8), and the
+ * number of priority requests it may make in pri_req (bits 5-0), which
+ * the bus manager sets.
+ */
+static void priority_budget_reset(void)
+{
+	struct transaction *t;
+	struct node *node;
+	enum node_class *classes;
+	unsigned int n_nodes = count_nodes(), i, n, budget, pri_max;
+
+	t = calloc(n_nodes, sizeof(*t));
+	classes = calloc(n_nodes, sizeof(*classes));
+	if (n_nodes && (!t || !classes)) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	for (node = nodes, i = 0; node; node = node->next, ++i) {
+		classes[i] = classify_node(node);
+		set_transaction(&t[i], node, TCODE_READ_QUADLET_REQUEST, PRIORITY_BUDGET_ADDR, 0);
+	}
+	run_transactions(t, n_nodes);
+
+	for (i = 0, n = 0; i < n_nodes; ++i) {
+		if (t[i].rcode != RCODE_COMPLETE) {
+			if (verbose)
+				printf("node %x (%s): no PRIORITY_BUDGET\n",
+				       t[i].node->id, class_names[classes[i]]);
+			continue;
+		}
+		pri_max = (t[i].value >> 8) & 0x3f;
+		budget = class_budget[classes[i]];
+		if (budget > pri_max)
+			budget = pri_max;
+		if ((t[i].value & 0x3f) == budget) {
+			if (verbose)
+				printf("node %x (%s): priority budget is %u\n",
+				       t[i].node->id, class_names[classes[i]], budget);
+			continue;
+		}
+		classes[n] = classes[i];
+		set_transaction(&t[n++], t[i].node, TCODE_WRITE_QUADLET_REQUEST,
+				PRIORITY_BUDGET_ADDR, budget);
+	}
+	run_transactions(t, n);
+
+	for (i = 0; i < n; ++i)
+		if (t[i].rcode == RCODE_COMPLETE)
+			printf("node %x (%s): priority budget set to %u\n",
+			       t[i].node->id, class_names[classes[i]], t[i].value);
+		else
+			printf("node %x (%s): cannot write PRIORITY_BUDGET: %s\n",
+			       t[i].node->id, class_names[classes[i]], rcode_name(t[i].rcode));
+
+	free(classes);
+	free(t);
+}
+
+/*
+ * Listens on all channels (except the broadcast channel, which is used for
+ * asynchronous streams) for a short time, and returns 1 if any isochronous
+ * packet arrived, 0 if none did, or -1 if it cannot listen.  A fresh file
+ * descriptor gets a fresh context, and does not steal events from the main
+ * one.
+ */
+static int iso_activity(void)
+{
+	static bool failed;
+	struct fw_cdev_create_iso_context create;
+	struct fw_cdev_set_iso_channels set_channels;
+	struct fw_cdev_iso_packet packet;
+	struct fw_cdev_queue_iso queue_iso;
+	struct fw_cdev_start_iso start_iso;
+#ifdef FW_CDEV_IOC_FLUSH_ISO
+	struct fw_cdev_flush_iso flush;
+#endif
+	union fw_cdev_event event;
+	struct pollfd pfd;
+	size_t size = getpagesize();
+	const char *what;
+	bool active = false;
+	void *buffer;
+	int iso_fd, err;
+
+	what = device_name;
+	buffer = MAP_FAILED;
+	iso_fd = open(device_name, O_RDWR);
+	if (iso_fd == -1)
+		goto error;
+	create.type = FW_CDEV_ISO_CONTEXT_RECEIVE_MULTICHANNEL;
+	create.header_size = 0;
+	create.channel = 0;
+	create.speed = 0;
+	create.closure = 0;
+	set_channels.channels = ~(1uLL << BROADCAST_CHANNEL);
+	what = "CREATE_ISO_CONTEXT ioctl failed";
+	if (ioctl(iso_fd, FW_CDEV_IOC_CREATE_ISO_CONTEXT, &create) < 0)
+		goto error;
+	set_channels.handle = create.handle;
+	what = "SET_ISO_CHANNELS ioctl failed";
+	if (ioctl(iso_fd, FW_CDEV_IOC_SET_ISO_CHANNELS, &set_channels) < 0)
+		goto error;
+	what = "mmap failed";
+	buffer = mmap(NULL, size, PROT_READ, MAP_SHARED, iso_fd, 0);
+	if (buffer == MAP_FAILED)
+		goto error;
+	packet.control = FW_CDEV_ISO_PAYLOAD_LENGTH(size) | FW_CDEV_ISO_INTERRUPT;
+	queue_iso.packets = ptr_to_u64(&packet);
+	queue_iso.data = ptr_to_u64(buffer);
+	queue_iso.size = sizeof(packet);
+	queue_iso.handle = create.handle;
+	start_iso.cycle = -1;
+	start_iso.sync = 0;
+	start_iso.tags = FW_CDEV_ISO_CONTEXT_MATCH_ALL_TAGS;
+	start_iso.handle = create.handle;
+	what = "QUEUE_ISO ioctl failed";
+	if (ioctl(iso_fd, FW_CDEV_IOC_QUEUE_ISO, &queue_iso) < 0)
+		goto error;
+	what = "START_ISO ioctl failed";
+	if (ioctl(iso_fd, FW_CDEV_IOC_START_ISO, &start_iso) < 0)
+		goto error;
+
+	pfd.fd = iso_fd;
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, ACTIVITY_TIME_MS) <= 0) {
+		/*
+		 * A partially filled buffer is reported only when flushed;
+		 * without FLUSH_ISO (before ABI version 5), only a full
+		 * page of packets counts as activity.
+		 */
+#ifdef FW_CDEV_IOC_FLUSH_ISO
+		flush.handle = create.handle;
+		ioctl(iso_fd, FW_CDEV_IOC_FLUSH_ISO, &flush);
+#endif
+	}
+	while (!active && poll(&pfd, 1, 0) > 0 &&
+	       read(iso_fd, &event, sizeof(event)) >= (ssize_t)sizeof(event.common))
+		active = event.common.type == FW_CDEV_EVENT_ISO_INTERRUPT_MULTICHANNEL &&
+			 event.iso_interrupt_mc.completed > 0;
+	munmap(buffer, size);
+	close(iso_fd);
+	failed = false;
+	return active;
+
+error:
+	err = errno;
+	if (buffer != MAP_FAILED)
+		munmap(buffer, size);
+	if (iso_fd != -1)
+		close(iso_fd);
+	/* reported once, not at every poll */
+	if (!failed)
+		fprintf(stderr, "cannot listen for isochronous packets: %s: %s\n",
+			what, strerror(err));
+	failed = true;
+	return -1;
+}
+
+/*
+ * Without allocated channels or bandwidth, nobody needs cycle start
+ * packets; the cycle master (the root) stops sending them when its cmstr
+ * bit is cleared.  The IRM is polled to notice new allocations.
+ */
+static void cycle_master_check(void)
+{
+	struct transaction t[4];
+	struct node *irm, *root;
+	bool needed, enabled = true;
+	u32 rcode;
+	int activity;
+
+	irm = find_node(bus.irm_node_id);
+	root = find_node(bus.root_node_id);
+	if (!irm || !root) {
+		if (verbose)
+			puts("cannot access the IRM or the root node");
+		return;
+	}
+	set_transaction(&t[0], irm, TCODE_READ_QUADLET_REQUEST, BANDWIDTH_AVAILABLE_ADDR, 0);
+	set_transaction(&t[1], irm, TCODE_READ_QUADLET_REQUEST, CHANNELS_AVAILABLE_HI_ADDR, 0);
+	set_transaction(&t[2], irm, TCODE_READ_QUADLET_REQUEST, CHANNELS_AVAILABLE_LO_ADDR, 0);
+	set_transaction(&t[3], root, TCODE_READ_QUADLET_REQUEST, STATE_CLEAR_ADDR, 0);
+	run_transactions(t, 4);
+	if (t[0].rcode != RCODE_COMPLETE || t[1].rcode != RCODE_COMPLETE ||
+	    t[2].rcode != RCODE_COMPLETE || t[3].rcode != RCODE_COMPLETE)
+		goto next;
+
+	/* the broadcast channel is allocated by the bus manager, not for streams */
+	needed = t[0].value < BANDWIDTH_AVAILABLE_INITIAL ||
+		 (t[1].value | 1u << (31 - BROADCAST_CHANNEL)) != 0xffffffff ||
+		 t[2].value != 0xffffffff;
+	enabled = t[3].value & STATE_CMSTR;
+	if (!needed && enabled && check_activity) {
+		activity = iso_activity();
+		/* when in doubt, assume that the cycle master is needed */
+		needed = activity != 0;
+		if (activity < 0 && verbose)
+			printf("cycle master (node %x) kept enabled\n", root->id);
+	}
+
+	if (needed != enabled) {
+		rcode = write_quadlet(root, needed ? STATE_SET_ADDR : STATE_CLEAR_ADDR, STATE_CMSTR);
+		if (rcode == RCODE_COMPLETE) {
+			printf("cycle master (node %x) %s\n", root->id, needed ? "enabled" : "disabled");
+			enabled = needed;
+		} else {
+			printf("cannot write STATE of node %x: %s\n", root->id, rcode_name(rcode));
+		}
+	}
+next:
+	if (!once)
+		set_timer(&irm_poll_watch, (enabled ? IRM_POLL_ON_MS : IRM_POLL_OFF_MS) * 1000000uLL);
+}
+
+static void irm_poll(void)
+{
+	ack_timer(&irm_poll_watch);
+	cycle_master_check();
+}
+
+static void cycle_master_start(void)
+{
+	init_timer(&irm_poll_watch, irm_poll);
+}
+
+static void phy_packet_sent(struct fw_device *dev, int rcode,
+			    const void *data, unsigned int length, void *arg)
+{
+	*(int *)arg = rcode;
+}
+
+/*
+ * Sends a PHY configuration packet, and waits until it is on the wire
+ * before the caller resets the bus.  Another bus reset in the meantime
+ * makes the packet pointless.
+ */
+static bool send_phy_config(u32 quadlet)
+{
+	u32 generation = device.bus.generation;
+	int rcode, r;
+
+	fw_engine_set_timeout(engine, PHY_PACKET_TIMEOUT_MS);
+	r = fw_submit_phy_packet(engine, &device, quadlet, ~quadlet, phy_packet_sent, &rcode);
+	if (r == 0)
+		run_engine();
+	fw_engine_set_timeout(engine, 0);
+	if (r < 0) {
+		perror("SEND_PHY_PACKET ioctl failed");
+		return false;
+	}
+	if (rcode == FW_RCODE_TIMEOUT) {
+		fputs("PHY packet not sent\n", stderr);
+		return false;
+	}
+	return rcode == RCODE_COMPLETE && device.bus.generation == generation;
+}
+
+/*
+ * The winner is whoever gets its PHY ID into the IRM's BUS_MANAGER_ID
+ * first; this may also be the kernel of the local node.
+ */
+static bool contend_for_bus_manager(void)
+{
+	struct node *irm;
+	u32 local = bus.local_node_id & 0x3f, old, rcode;
+
+	irm = find_node(bus.irm_node_id);
+	if (!irm) {
+		fprintf(stderr, "cannot access the IRM %x\n", bus.irm_node_id);
+		return false;
+	}
+	rcode = compare_swap(irm, BUS_MANAGER_ID_ADDR, BUS_MANAGER_ID_NONE, local, &old);
+	if (rcode != RCODE_COMPLETE) {
+		fprintf(stderr, "cannot access BUS_MANAGER_ID: %s\n", rcode_name(rcode));
+		return false;
+	}
+	if ((old & 0x3f) != BUS_MANAGER_ID_NONE && (old & 0x3f) != local) {
+		if (verbose)
+			printf("node %x is the bus manager\n", 0xffc0 | (old & 0x3f));
+		return false;
+	}
+	if (verbose)
+		printf("node %x is the bus manager\n", bus.local_node_id);
+	bus.bm_node_id = bus.local_node_id;
+	return true;
+}
+
+/*
+ * The self IDs are in the order of the PHY IDs, and every node comes
+ * after all of its children, so the tree can be built with a stack of
+ * subtree heights; the longest path goes through two children of a node.
+ */
+static bool read_topology(struct topology *topology)
+{
+	struct transaction t[3 + 256];
+	struct node *local;
+	int heights[64], h1, h2, h;
+	unsigned int n_heights = 0, length, self_id_count, i, port, ports, children;
+	u32 q;
+
+	local = find_node(bus.local_node_id);
+	if (!local)
+		return false;
+	for (i = 0; i < 3; ++i)
+		set_transaction(&t[i], local, TCODE_READ_QUADLET_REQUEST, TOPOLOGY_MAP_ADDR + i * 4, 0);
+	run_transactions(t, 3);
+	if (t[0].rcode != RCODE_COMPLETE || t[2].rcode != RCODE_COMPLETE)
+		return false;
+	length = t[0].value >> 16;
+	self_id_count = t[2].value & 0xffff;
+	if (self_id_count + 2 > length || self_id_count > 256 - 3)
+		return false;
+	for (i = 0; i < self_id_count; ++i)
+		set_transaction(&t[3 + i], local, TCODE_READ_QUADLET_REQUEST,
+				TOPOLOGY_MAP_ADDR + (3 + i) * 4, 0);
+	run_transactions(t + 3, self_id_count);
+
+	topology->node_count = 0;
+	topology->max_hops = 0;
+	topology->gap_count_consistent = true;
+	for (i = 0; i < self_id_count; ) {
+		if (t[3 + i].rcode != RCODE_COMPLETE)
+			return false;
+		q = t[3 + i].value;
+		if (q & 0x00800000)
+			return false;
+		if (topology->node_count == 0)
+			topology->gap_count = (q >> 16) & 0x3f;
+		else if (((q >> 16) & 0x3f) != topology->gap_count)
+			topology->gap_count_consistent = false;
+		++topology->node_count;
+
+		/* three ports in the first packet, eight in each extended one */
+		children = 0;
+		for (port = 0; port < 3; ++port)
+			children += ((q >> (6 - port * 2)) & 3) == 3;
+		while (++i < self_id_count && (t[3 + i].value & 0x00800000)) {
+			if (t[3 + i].rcode != RCODE_COMPLETE)
+				return false;
+			ports = t[3 + i].value;
+			for (port = 0; port < 8; ++port)
+				children += ((ports >> (16 - port * 2)) & 3) == 3;
+		}
+
+		if (children > n_heights)
+			return false;
+		h1 = h2 = -1;
+		while (children-- > 0) {
+			h = heights[--n_heights];
+			if (h > h1) {
+				h2 = h1;
+				h1 = h;
+			} else if (h > h2) {
+				h2 = h;
+			}
+		}
+		if ((unsigned int)(h1 + 1 + h2 + 1) > topology->max_hops)
+			topology->max_hops = h1 + 1 + h2 + 1;
+		if (n_heights >= ARRAY_SIZE(heights))
+			return false;
+		heights[n_heights++] = h1 + 1;
+	}
+	return n_heights == 1;
+}
+
+static bool cycle_master_capable(struct node *node)
+{
+	return node && node->dev.rom_length >= 12 && (node->dev.rom[2] & BIB_CMC);
+}
+
+/*
+ * Like the kernel: the root must be able to be cycle master, and the gap
+ * count is chosen for the number of hops (IEEE 1394a table E-1).  Returns
+ * false if the bus is being reset to apply a new configuration.
+ */
+static bool configure_bus(void)
+{
+	static const u8 gap_count_table[] = {
+		63, 5, 7, 8, 10, 13, 16, 18, 21, 24, 26, 29, 32, 35, 37, 40
+	};
+	struct fw_cdev_initiate_bus_reset initiate_bus_reset;
+	struct topology topology;
+	struct node *local;
+	u32 gap_count, packet = 0;
+
+	if (!read_topology(&topology)) {
+		fputs("cannot read the topology map\n", stderr);
+		return true;
+	}
+	gap_count = topology.max_hops < ARRAY_SIZE(gap_count_table) ?
+		    gap_count_table[topology.max_hops] : 63;
+	if (verbose)
+		printf("%u nodes, %u hops, gap count %u\n",
+		       topology.node_count, topology.max_hops, gap_count);
+
+	local = find_node(bus.local_node_id);
+	if (!cycle_master_capable(find_node(bus.root_node_id)) && cycle_master_capable(local)) {
+		printf("root node %x is not cycle master capable; making node %x root\n",
+		       bus.root_node_id, local->id);
+		packet |= 0x00800000 | (local->id & 0x3f) << 24;
+	}
+	if (!topology.gap_count_consistent || topology.gap_count != gap_count) {
+		printf("setting gap count to %u\n", gap_count);
+		packet |= 0x00400000 | gap_count << 16;
+	}
+	if (!packet) {
+		bus_resets = 0;
+		return true;
+	}
+	if (bus_resets >= MAX_BUS_RESETS) {
+		if (bus_resets++ == MAX_BUS_RESETS)
+			fputs("the bus does not keep its configuration; giving up\n", stderr);
+		return true;
+	}
+
+	if (!send_phy_config(packet))
+		return true;
+	initiate_bus_reset.type = FW_CDEV_SHORT_RESET;
+	if (ioctl(device.fd, FW_CDEV_IOC_INITIATE_BUS_RESET, &initiate_bus_reset) < 0) {
+		perror("INITIATE_BUS_RESET ioctl failed");
+		return true;
+	}
+	++bus_resets;
+	reset_pending = true;
+	return false;
+}
+
+static void run_start(void)
+{
+	priority_budget_start();
+	bus_time_start();
+	cycle_master_start();
+}
+
+/*
+ * All duties of the bus manager, in the order in which they depend on
+ * each other: the topology first, because it may cause another reset.
+ */
+static void run_reset(void)
+{
+	reset_pending = false;
+	if (!contend_for_bus_manager()) {
+		bus_time_active = false;
+		set_timer(&rollover_watch, 0);
+		set_timer(&irm_poll_watch, 0);
+		return;
+	}
+	if (!configure_bus())
+		return;
+	split_timeout_reset();
+	priority_budget_reset();
+	bus_time_reset();
+	cycle_master_check();
+}
+
+static const struct command {
+	const char *name;
+	void (*start)(void);
+	void (*bus_reset)(void);
+	bool has_parameter;
+} commands[] = {
+	{ "bus_time", bus_time_start, bus_time_reset },
+	{ "split_timeout", split_timeout_start, split_timeout_reset, .has_parameter = true },
+	{ "priority_budget", priority_budget_start, priority_budget_reset, .has_parameter = true },
+	{ "cycle_master", cycle_master_start, cycle_master_check },
+	{ "run", run_start, run_reset, .has_parameter = true },
+};
+
+/* the engine reads the events of all nodes, also while waiting for responses */
+static void card_event(void)
+{
+	if (fw_engine_dispatch(engine, 0) < 0) {
+		perror("reading events failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void bus_reset(struct fw_device *dev, void *arg)
+{
+	if (dev != &device)
+		return;
+	if (verbose)
+		printf("bus reset, generation %u\n", dev->bus.generation);
+	set_timer(&settle_watch, SETTLE_TIME_MS * 1000000uLL);
+}
+
+/*
+ * A node that has gone away stays in the list until the bus has settled,
+ * so that the transactions that refer to it remain valid; requests to it
+ * fail.
+ */
+static void device_removed(struct fw_device *dev, void *arg)
+{
+	if (dev == &device) {
+		fprintf(stderr, "%s has gone away\n", device_name);
+		exit(EXIT_FAILURE);
+	}
+	fw_device_close(dev);
+}
+
+/* the bus has been quiet for a while after a reset */
+static void bus_settled(void)
+{
+	ack_timer(&settle_watch);
+	if (fw_device_update(&device) < 0) {
+		perror("GET_INFO ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	bus = device.bus;
+	open_nodes();
+	command->bus_reset();
+}
+
+static void stop_signal(int signum)
+{
+	stop = true;
+}
+
+static void run(void)
+{
+	struct sigaction sa;
+	struct epoll_event event;
+	struct watch *watch;
+	int r;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		perror("epoll_create1 failed");
+		exit(EXIT_FAILURE);
+	}
+	card_watch.fd = device.fd;
+	card_watch.handler = card_event;
+	add_watch(&card_watch);
+	init_timer(&settle_watch, bus_settled);
+	fw_engine_set_reset_handler(engine, bus_reset, NULL);
+	fw_engine_set_removal_handler(engine, device_removed, NULL);
+
+	command->start();
+	open_nodes();
+	command->bus_reset();
+	fflush(stdout);
+
+	while (!stop && (!once || reset_pending)) {
+		r = epoll_wait(epoll_fd, &event, 1, -1);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait failed");
+			exit(EXIT_FAILURE);
+		}
+		if (r > 0) {
+			watch = event.data.ptr;
+			watch->handler();
+			fflush(stdout);
+		}
+	}
+	close_nodes();
+	close(epoll_fd);
+}
+
+static void parse_parameters(int argc, char *argv[])
+{
+	static const char short_options[] = "1avhV";
+	static const struct option long_options[] = {
+		{ "once", 0, NULL, '1' },
+		{ "activity", 0, NULL, 'a' },
+		{ "verbose", 0, NULL, 'v' },
+		{ "help", 0, NULL, 'h' },
+		{ "version", 0, NULL, 'V' },
+		{}
+	};
+	int c;
+	unsigned int i;
+
+	while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+		switch (c) {
+		case '1':
+			once = true;
+			break;
+		case 'a':
+			check_activity = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			help();
+			exit(EXIT_SUCCESS);
+		case 'V':
+			puts("firewire-bus-manager version " PACKAGE_VERSION);
+			exit(EXIT_SUCCESS);
+		default:
+		syntax_error:
+			help();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc)
+		goto syntax_error;
+	device_name = fw_resolve_device_name(argv[optind++]);
+
+	if (optind >= argc)
+		goto syntax_error;
+	for (i = 0; i < ARRAY_SIZE(commands); ++i)
+		if (!strcasecmp(argv[optind], commands[i].name)) {
+			command = &commands[i];
+			break;
+		}
+	if (!command) {
+		fprintf(stderr, "unknown command: `%s'\n", argv[optind]);
+		goto syntax_error;
+	}
+	++optind;
+
+	if (command->has_parameter && optind < argc)
+		parameter = argv[optind++];
+
+	if (optind < argc) {
+		fprintf(stderr, "superfluous parameter: `%s'\n", argv[optind]);
+		goto syntax_error;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	parse_parameters(argc, argv);
+	open_device();
+	run();
+	close_device();
+	return 0;
+}
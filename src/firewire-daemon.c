@@ -0,0 +1,1145 @@
+/*
+ * firewire-daemon.c - shares the FireWire device files among many clients
+ *
+ * licensed under the terms of the GNU General Public License, version 2
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <linux/firewire-cdev.h>
+#include <linux/firewire-constants.h>
+#include "fwutils.h"
+
+#ifndef FW_CDEV_IOC_SEND_PHY_PACKET
+#error kernel headers too old
+#endif
+
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define FCP_COMMAND_ADDR	0xfffff0000b00uLL
+#define FCP_RESPONSE_ADDR	0xfffff0000d00uLL
+#define FCP_REGION_SIZE		0x200
+
+/* as long as firewire-request and firewire-phy-command wait */
+#define FCP_TIMEOUT_MS		2345
+#define PHY_TIMEOUT_MS		100
+#define MAX_SELF_IDS		3
+
+#define MAX_MESSAGE		(sizeof(struct fw_daemon_request) + FW_DAEMON_MAX_DATA)
+/* a client that does not read its replies gets no more requests done */
+#define OUTPUT_LIMIT		(16 * MAX_MESSAGE)
+
+typedef __u8 u8;
+typedef __u32 u32;
+typedef __u64 u64;
+
+struct operation;
+
+struct device {
+	struct fw_device dev;
+	struct device *next;
+	unsigned int number;		/* N of /dev/fwN */
+	unsigned int max_payload;
+	bool fcp_allocated;
+	/* one FCP transaction at a time, so that a response can be matched */
+	struct operation *fcp_head, *fcp_tail;
+};
+
+struct client {
+	struct client *next;
+	int fd;				/* -1 after the client has hung up */
+	unsigned int operations;	/* not yet completed */
+	u8 *in;
+	unsigned int in_length;
+	u8 *out;
+	size_t out_length, out_size;
+};
+
+struct chunk {
+	struct operation *op;
+	unsigned int offset;
+	unsigned int length;
+	unsigned int received;
+	int rcode;
+};
+
+struct operation {
+	struct operation *next;		/* in an FCP queue, or among the PHY waiters */
+	struct client *client;
+	struct device *device;
+	struct fw_daemon_request request;
+	unsigned int pending;		/* requests submitted to the engine */
+	bool done;			/* the reply has been sent */
+	bool sent;			/* FCP: the command, PHY: the packet */
+	bool received;			/* FCP, PHY: the response */
+	u64 deadline;			/* FCP, PHY: in microseconds, or 0 */
+	u32 rcode;
+	u32 value;
+	struct chunk *chunks;		/* READ, WRITE */
+	unsigned int chunk_count;
+	u8 *data;
+	unsigned int length;
+};
+
+static const char *socket_path = FW_DAEMON_SOCKET;
+static bool verbose;
+static volatile sig_atomic_t stop;
+
+static struct fw_engine *engine;
+static struct device *devices;
+static struct client *clients;
+static struct operation *phy_waiters;
+static int listen_fd = -1;
+
+static void help(void)
+{
+	fputs("Usage: firewire-daemon [options]\n"
+	      "Options:\n"
+	      " -s, --socket=path  listen on this socket instead of " FW_DAEMON_SOCKET "\n"
+	      " -v, --verbose      report devices, bus resets, and clients\n"
+	      " -h, --help         show this message and exit\n"
+	      " -V, --version      show version number and exit\n"
+	      "\n"
+	      "Report bugs to <" PACKAGE_BUGREPORT ">.\n"
+	      PACKAGE_NAME " home page: <" PACKAGE_URL ">.\n",
+	      stderr);
+}
+
+static void out_of_memory(void)
+{
+	fputs("out of memory\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+static u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000uLL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Clients
+ */
+
+/* frees the clients that have hung up, and whose operations have completed */
+static void reap_clients(void)
+{
+	struct client **p, *client;
+
+	for (p = &clients; (client = *p); ) {
+		if (client->fd != -1 || client->operations) {
+			p = &client->next;
+			continue;
+		}
+		*p = client->next;
+		free(client->in);
+		free(client->out);
+		free(client);
+	}
+}
+
+/* the client's operations still run, but their replies are dropped */
+static void hang_up(struct client *client)
+{
+	if (client->fd == -1)
+		return;
+	if (verbose)
+		printf("client %d: closed\n", client->fd);
+	close(client->fd);
+	client->fd = -1;
+	client->in_length = 0;
+	client->out_length = 0;
+}
+
+static void flush_output(struct client *client)
+{
+	ssize_t r;
+
+	while (client->out_length) {
+		r = send(client->fd, client->out, client->out_length,
+			 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN)
+				hang_up(client);
+			return;
+		}
+		client->out_length -= r;
+		memmove(client->out, client->out + r, client->out_length);
+	}
+}
+
+static void send_reply(struct client *client, const struct fw_daemon_reply *reply,
+		       const void *data, unsigned int length)
+{
+	size_t size = sizeof(*reply) + length;
+	u8 *out;
+
+	if (client->out_size < client->out_length + size) {
+		out = realloc(client->out, client->out_length + size);
+		if (!out)
+			out_of_memory();
+		client->out = out;
+		client->out_size = client->out_length + size;
+	}
+	memcpy(client->out + client->out_length, reply, sizeof(*reply));
+	if (length)
+		memcpy(client->out + client->out_length + sizeof(*reply), data, length);
+	client->out_length += size;
+	flush_output(client);
+}
+
+/*
+ * Operations
+ */
+
+static struct operation *new_operation(struct client *client,
+				       const struct fw_daemon_request *request)
+{
+	struct operation *op;
+
+	op = calloc(1, sizeof(*op));
+	if (!op)
+		out_of_memory();
+	op->client = client;
+	op->request = *request;
+	op->rcode = RCODE_COMPLETE;
+	++client->operations;
+	return op;
+}
+
+/* an operation is freed when it is done and the engine has no part of it */
+static void release(struct operation *op)
+{
+	if (!op->done || op->pending)
+		return;
+	--op->client->operations;
+	free(op->chunks);
+	free(op->data);
+	free(op);
+}
+
+static void start_fcp(struct device *device);
+
+static void finish(struct operation *op, int error)
+{
+	struct fw_daemon_reply reply;
+	struct operation **p;
+	struct device *device = op->device;
+	bool data;
+
+	if (op->done)
+		return;
+	op->done = true;
+
+	if (op->request.type == FW_DAEMON_PHY) {
+		for (p = &phy_waiters; *p; p = &(*p)->next)
+			if (*p == op) {
+				*p = op->next;
+				break;
+			}
+	}
+
+	if (op->client->fd != -1) {
+		data = !error && op->request.type != FW_DAEMON_WRITE;
+		reply.length = sizeof(reply) + (data ? op->length : 0);
+		reply.serial = op->request.serial;
+		reply.error = error;
+		reply.rcode = op->rcode;
+		reply.value = op->value;
+		send_reply(op->client, &reply, op->data, data ? op->length : 0);
+	}
+
+	if (op->request.type == FW_DAEMON_FCP && device && device->fcp_head == op) {
+		device->fcp_head = op->next;
+		if (!device->fcp_head)
+			device->fcp_tail = NULL;
+		release(op);
+		start_fcp(device);
+		return;
+	}
+	release(op);
+}
+
+static void finish_rcode(struct operation *op, u32 rcode)
+{
+	op->rcode = rcode;
+	finish(op, 0);
+}
+
+static void set_data(struct operation *op, const void *data, unsigned int length)
+{
+	free(op->data);
+	op->data = malloc(length ? length : 1);
+	if (!op->data)
+		out_of_memory();
+	memcpy(op->data, data, length);
+	op->length = length;
+}
+
+/*
+ * Devices
+ */
+
+static struct device *open_device(unsigned int number)
+{
+	struct device *device;
+	char *name;
+	int r;
+
+	device = calloc(1, sizeof(*device));
+	if (!device)
+		out_of_memory();
+	if (asprintf(&name, "/dev/fw%u", number) < 0)
+		out_of_memory();
+	r = fw_device_open(&device->dev, name);
+	free(name);
+	if (r < 0 || fw_engine_add_device(engine, &device->dev) < 0) {
+		if (r == 0)
+			fw_device_close(&device->dev);
+		free(device);
+		return NULL;
+	}
+	device->number = number;
+	device->max_payload = fw_device_max_payload(&device->dev);
+	if (fw_device_is_local(&device->dev) && fw_device_receive_phy_packets(&device->dev) < 0)
+		perror("RECEIVE_PHY_PACKETS ioctl failed");
+	device->next = devices;
+	devices = device;
+	if (verbose)
+		printf("fw%u: card %u, node %04x%s\n", number, device->dev.card,
+		       device->dev.bus.node_id, fw_device_is_local(&device->dev) ? ", local" : "");
+	return device;
+}
+
+/* opens the device files that are not yet open */
+static void open_devices(void)
+{
+	struct dirent **ents;
+	struct device *device;
+	int count, i, number;
+
+	count = fw_scan_devices("/dev", &ents);
+	if (count < 0)
+		return;
+	for (i = 0; i < count; ++i) {
+		number = fw_device_number(ents[i]->d_name);
+		for (device = devices; device; device = device->next)
+			if (device->number == number)
+				break;
+		if (!device && number >= 0)
+			open_device(number);
+	}
+	fw_free_devices(ents, count);
+}
+
+static struct device *find_local_node(u32 card)
+{
+	struct device *device;
+
+	for (device = devices; device; device = device->next)
+		if (fw_device_is_local(&device->dev) &&
+		    (card == FW_DAEMON_ANY_CARD || device->dev.card == card))
+			return device;
+	return NULL;
+}
+
+/*
+ * Device files that appeared since the start are opened when they are
+ * first asked for; returns NULL and errno if there is no such device.
+ */
+static struct device *find_device(u32 number)
+{
+	struct device *device;
+	u32 card;
+
+	if (number & FW_DAEMON_CARD(0)) {
+		card = number == FW_DAEMON_ANY_CARD ? number : number & ~FW_DAEMON_CARD(0);
+		device = find_local_node(card);
+		if (!device) {
+			open_devices();
+			device = find_local_node(card);
+		}
+		if (!device)
+			errno = ENODEV;
+		return device;
+	}
+	for (device = devices; device; device = device->next)
+		if (device->number == number)
+			return device;
+	device = open_device(number);
+	if (!device && errno == ENOENT)
+		errno = ENODEV;
+	return device;
+}
+
+static void close_device(struct device *device)
+{
+	struct device **p;
+
+	for (p = &devices; *p; p = &(*p)->next)
+		if (*p == device) {
+			*p = device->next;
+			break;
+		}
+	fw_device_close(&device->dev);
+	free(device);
+}
+
+static void device_removed(struct fw_device *dev, void *arg)
+{
+	struct device *device = container_of(dev, struct device, dev);
+	struct operation *op, *next;
+
+	if (verbose)
+		printf("fw%u: gone\n", device->number);
+
+	/* the engine has already cancelled the submitted requests */
+	while (device->fcp_head)
+		finish(device->fcp_head, ENODEV);
+	for (op = phy_waiters; op; op = next) {
+		next = op->next;
+		if (op->device == device)
+			finish(op, ENODEV);
+	}
+	close_device(device);
+}
+
+/* the target aborts all outstanding FCP commands at a bus reset */
+static void device_reset(struct fw_device *dev, void *arg)
+{
+	struct device *device = container_of(dev, struct device, dev);
+	struct operation *op, *next;
+
+	if (verbose)
+		printf("fw%u: bus reset, generation %u, node %04x\n", device->number,
+		       dev->bus.generation, dev->bus.node_id);
+	device->max_payload = fw_device_max_payload(dev);
+
+	op = device->fcp_head;
+	if (op && op->sent)
+		finish_rcode(op, RCODE_GENERATION);
+	for (op = phy_waiters; op; op = next) {
+		next = op->next;
+		if (op->device == device)
+			finish_rcode(op, RCODE_GENERATION);
+	}
+}
+
+static void send_response(struct device *device, u32 handle, u32 rcode)
+{
+	struct fw_cdev_send_response send_response;
+
+	send_response.rcode = rcode;
+	send_response.length = 0;
+	send_response.data = 0;
+	send_response.handle = handle;
+	if (ioctl(device->dev.fd, FW_CDEV_IOC_SEND_RESPONSE, &send_response) < 0)
+		perror("SEND_RESPONSE ioctl failed");
+}
+
+static void fcp_response(const struct fw_cdev_event_request2 *request)
+{
+	struct device *device;
+	struct operation *op;
+
+	if ((request->tcode != TCODE_WRITE_QUADLET_REQUEST &&
+	     request->tcode != TCODE_WRITE_BLOCK_REQUEST) ||
+	    request->offset != FCP_RESPONSE_ADDR)
+		return;
+	for (device = devices; device; device = device->next) {
+		op = device->fcp_head;
+		if (op && op->deadline && !op->received &&
+		    device->dev.card == request->card &&
+		    (device->dev.bus.node_id & 0x3f) == (request->source_node_id & 0x3f) &&
+		    device->dev.bus.generation == request->generation)
+			break;
+	}
+	if (!device)
+		return;
+	set_data(op, request->data, request->length);
+	op->received = true;
+	if (op->sent)
+		finish(op, 0);
+}
+
+static void phy_packet_received(struct device *device, u32 quadlet)
+{
+	struct operation *op;
+
+	/* a response goes to the oldest packet that waits for it */
+	for (op = phy_waiters; op; op = op->next)
+		if (op->device == device && !op->received &&
+		    (quadlet & op->request.mask) == op->request.bits)
+			break;
+	if (!op)
+		return;
+	memcpy(op->data + op->length, &quadlet, 4);
+	op->length += 4;
+	/* self-ID packets with more to come */
+	if ((quadlet & 0xc0000000) == 0x80000000 &&
+	    (quadlet & 1) && op->length < MAX_SELF_IDS * 4)
+		return;
+	op->received = true;
+	if (op->sent)
+		finish(op, 0);
+}
+
+static void device_event(struct fw_device *dev, const union fw_cdev_event *event, void *arg)
+{
+	struct device *device = container_of(dev, struct device, dev);
+
+	switch (event->common.type) {
+	case FW_CDEV_EVENT_REQUEST2:
+		/* only the FCP response region is allocated */
+		send_response(device, event->request2.handle, RCODE_COMPLETE);
+		fcp_response(&event->request2);
+		break;
+	case FW_CDEV_EVENT_REQUEST:
+		send_response(device, event->request.handle, RCODE_COMPLETE);
+		break;
+	case FW_CDEV_EVENT_PHY_PACKET_RECEIVED:
+		if (event->phy_packet.length >= 4)
+			phy_packet_received(device, event->phy_packet.data[0]);
+		break;
+	}
+}
+
+/*
+ * Requests
+ */
+
+static void bus_info(struct operation *op)
+{
+	const struct fw_device *dev = &op->device->dev;
+	struct fw_daemon_bus_info info = {
+		.card = dev->card,
+		.generation = dev->bus.generation,
+		.node_id = dev->bus.node_id,
+		.local_node_id = dev->bus.local_node_id,
+		.bm_node_id = dev->bus.bm_node_id,
+		.irm_node_id = dev->bus.irm_node_id,
+		.root_node_id = dev->bus.root_node_id,
+		.max_payload = op->device->max_payload,
+	};
+
+	set_data(op, &info, sizeof(info));
+	finish(op, 0);
+}
+
+/* the data ends at the first error or short response */
+static void transfer_done(struct operation *op)
+{
+	const struct chunk *chunk;
+	unsigned int i, done = 0;
+
+	for (i = 0; i < op->chunk_count; ++i) {
+		chunk = &op->chunks[i];
+		if (chunk->rcode != RCODE_COMPLETE) {
+			op->rcode = chunk->rcode;
+			break;
+		}
+		done += chunk->received;
+		if (chunk->received < chunk->length)
+			break;
+	}
+	op->value = done;
+	op->length = done;
+	finish(op, 0);
+}
+
+static void chunk_done(struct fw_device *dev, int rcode,
+		       const void *data, unsigned int length, void *arg);
+
+static void submit_chunk(struct operation *op, unsigned int i)
+{
+	struct chunk *chunk = &op->chunks[i];
+	bool reading = op->request.type == FW_DAEMON_READ;
+	u64 address = op->request.offset + chunk->offset;
+	u32 tcode;
+
+	if (chunk->length == 4 && !(address & 3))
+		tcode = reading ? TCODE_READ_QUADLET_REQUEST : TCODE_WRITE_QUADLET_REQUEST;
+	else
+		tcode = reading ? TCODE_READ_BLOCK_REQUEST : TCODE_WRITE_BLOCK_REQUEST;
+	if (fw_submit_request(engine, &op->device->dev, tcode, address,
+			      reading ? NULL : op->data + chunk->offset,
+			      chunk->length, chunk_done, chunk) < 0)
+		chunk->rcode = RCODE_SEND_ERROR;
+	else
+		++op->pending;
+}
+
+static void chunk_done(struct fw_device *dev, int rcode,
+		       const void *data, unsigned int length, void *arg)
+{
+	struct chunk *chunk = arg;
+	struct operation *op = chunk->op;
+	unsigned int next = chunk - op->chunks + 1;
+
+	chunk->rcode = rcode;
+	if (op->request.type == FW_DAEMON_READ) {
+		if (length > chunk->length)
+			length = chunk->length;
+		memcpy(op->data + chunk->offset, data, length);
+		chunk->received = length;
+	} else {
+		chunk->received = chunk->length;
+	}
+	--op->pending;
+	if (op->done) {
+		release(op);
+		return;
+	}
+	if (op->request.type == FW_DAEMON_WRITE && rcode == RCODE_COMPLETE &&
+	    next < op->chunk_count)
+		submit_chunk(op, next);
+	if (!op->pending)
+		transfer_done(op);
+}
+
+/*
+ * All parts of a read are submitted at once, and sent as fast as the node
+ * allows.  The parts of a write are sent one after the other, and a failed
+ * one ends the write, so that the node never gets data after a gap.
+ */
+static void transfer(struct operation *op, const void *payload, unsigned int length)
+{
+	struct device *device = op->device;
+	bool reading = op->request.type == FW_DAEMON_READ;
+	unsigned int i, offset, part;
+	struct chunk *chunk;
+
+	if (reading) {
+		op->data = malloc(length ? length : 1);
+		if (!op->data)
+			out_of_memory();
+	} else {
+		/* the later parts are sent after the client's buffer has been reused */
+		set_data(op, payload, length);
+	}
+	/* an empty transfer is still one request */
+	op->chunk_count = length ? (length + device->max_payload - 1) / device->max_payload : 1;
+	op->chunks = calloc(op->chunk_count, sizeof(*op->chunks));
+	if (!op->chunks)
+		out_of_memory();
+
+	for (i = 0, offset = 0; i < op->chunk_count; ++i, offset += part) {
+		part = length - offset < device->max_payload ? length - offset : device->max_payload;
+		chunk = &op->chunks[i];
+		chunk->op = op;
+		chunk->offset = offset;
+		chunk->length = part;
+	}
+	for (i = 0; i < (reading ? op->chunk_count : 1); ++i)
+		submit_chunk(op, i);
+	if (!op->pending)
+		transfer_done(op);
+}
+
+static void read_request(struct operation *op)
+{
+	if (op->request.read_length > FW_DAEMON_MAX_DATA) {
+		finish(op, EINVAL);
+		return;
+	}
+	transfer(op, NULL, op->request.read_length);
+}
+
+static void lock_done(struct fw_device *dev, int rcode,
+		      const void *data, unsigned int length, void *arg)
+{
+	struct operation *op = arg;
+
+	--op->pending;
+	if (op->done) {
+		release(op);
+		return;
+	}
+	set_data(op, data, rcode == RCODE_COMPLETE ? length : 0);
+	finish_rcode(op, rcode);
+}
+
+static void lock_request(struct operation *op, const void *payload, unsigned int length)
+{
+	if (op->request.tcode < TCODE_LOCK_MASK_SWAP ||
+	    op->request.tcode > TCODE_LOCK_VENDOR_DEPENDENT ||
+	    (length != 4 && length != 8 && length != 16)) {
+		finish(op, EINVAL);
+		return;
+	}
+	if (fw_submit_request(engine, &op->device->dev, op->request.tcode, op->request.offset,
+			      payload, length, lock_done, op) < 0) {
+		finish(op, errno);
+		return;
+	}
+	++op->pending;
+}
+
+static bool allocate_fcp_region(struct device *device)
+{
+	struct fw_cdev_allocate allocate;
+	struct device *d;
+
+	/* responses arrive on every device file of the card that asked for them */
+	for (d = devices; d; d = d->next)
+		if (d->fcp_allocated && d->dev.card == device->dev.card)
+			return true;
+	allocate.offset = FCP_RESPONSE_ADDR;
+	allocate.closure = 0;
+	allocate.length = FCP_REGION_SIZE;
+	allocate.region_end = allocate.offset + allocate.length;
+	if (ioctl(device->dev.fd, FW_CDEV_IOC_ALLOCATE, &allocate) < 0)
+		return false;
+	device->fcp_allocated = true;
+	return true;
+}
+
+static void fcp_command_done(struct fw_device *dev, int rcode,
+			     const void *data, unsigned int length, void *arg)
+{
+	struct operation *op = arg;
+
+	--op->pending;
+	if (op->done) {
+		release(op);
+		return;
+	}
+	if (rcode != RCODE_COMPLETE) {
+		finish_rcode(op, rcode);
+		return;
+	}
+	op->sent = true;
+	if (op->received)
+		finish(op, 0);
+}
+
+static void start_fcp(struct device *device)
+{
+	struct operation *op = device->fcp_head;
+
+	if (!op)
+		return;
+	if (!device->dev.engine) {
+		finish(op, ENODEV);
+		return;
+	}
+	if (!allocate_fcp_region(device)) {
+		finish(op, errno);
+		return;
+	}
+	if (fw_submit_request(engine, &device->dev,
+			      op->length == 4 ? TCODE_WRITE_QUADLET_REQUEST
+					      : TCODE_WRITE_BLOCK_REQUEST,
+			      FCP_COMMAND_ADDR, op->data, op->length, fcp_command_done, op) < 0) {
+		finish(op, errno);
+		return;
+	}
+	++op->pending;
+	op->length = 0;
+	op->deadline = now_us() + FCP_TIMEOUT_MS * 1000uLL;
+}
+
+static void fcp_request(struct operation *op, const void *payload, unsigned int length)
+{
+	struct device *device = op->device;
+
+	if (!length || length > FCP_REGION_SIZE) {
+		finish(op, EINVAL);
+		return;
+	}
+	set_data(op, payload, length);
+	if (device->fcp_tail)
+		device->fcp_tail->next = op;
+	else
+		device->fcp_head = op;
+	device->fcp_tail = op;
+	if (device->fcp_head == op)
+		start_fcp(device);
+}
+
+static void phy_packet_sent(struct fw_device *dev, int rcode,
+			    const void *data, unsigned int length, void *arg)
+{
+	struct operation *op = arg;
+
+	--op->pending;
+	if (op->done) {
+		release(op);
+		return;
+	}
+	if (rcode == RCODE_CANCELLED || rcode == RCODE_SEND_ERROR) {
+		finish_rcode(op, rcode);
+		return;
+	}
+	if (length >= 4)
+		op->value = *(const u32 *)data;
+	op->sent = true;
+	if (!op->request.mask || op->received)
+		finish(op, 0);
+}
+
+static void phy_request(struct operation *op, const u32 *quadlets, unsigned int length)
+{
+	struct operation **p;
+	struct device *local;
+
+	if (length != 8) {
+		finish(op, EINVAL);
+		return;
+	}
+	local = fw_device_is_local(&op->device->dev) ? op->device
+						      : find_device(FW_DAEMON_CARD(op->device->dev.card));
+	if (!local) {
+		finish(op, ENODEV);
+		return;
+	}
+	op->device = local;
+	op->data = malloc(MAX_SELF_IDS * 4);
+	if (!op->data)
+		out_of_memory();
+	if (fw_submit_phy_packet(engine, &local->dev, quadlets[0], quadlets[1],
+				 phy_packet_sent, op) < 0) {
+		finish(op, errno);
+		return;
+	}
+	++op->pending;
+	if (op->request.mask) {
+		op->deadline = now_us() + PHY_TIMEOUT_MS * 1000uLL;
+		for (p = &phy_waiters; *p; p = &(*p)->next)
+			;
+		*p = op;
+	}
+}
+
+static void handle_request(struct client *client, const struct fw_daemon_request *request)
+{
+	unsigned int length = request->length - sizeof(*request);
+	struct operation *op;
+
+	op = new_operation(client, request);
+	op->device = find_device(request->device);
+	if (!op->device) {
+		finish(op, errno);
+		return;
+	}
+	switch (request->type) {
+	case FW_DAEMON_BUS_INFO:
+		bus_info(op);
+		break;
+	case FW_DAEMON_READ:
+		read_request(op);
+		break;
+	case FW_DAEMON_WRITE:
+		transfer(op, request->data, length);
+		break;
+	case FW_DAEMON_LOCK:
+		lock_request(op, request->data, length);
+		break;
+	case FW_DAEMON_FCP:
+		fcp_request(op, request->data, length);
+		break;
+	case FW_DAEMON_PHY:
+		phy_request(op, request->data, length);
+		break;
+	default:
+		finish(op, EINVAL);
+		break;
+	}
+}
+
+/* each message is moved to the start of the buffer, so that it is aligned */
+static void client_input(struct client *client)
+{
+	struct fw_daemon_request *request = (struct fw_daemon_request *)client->in;
+	unsigned int length;
+	ssize_t r;
+
+	r = read(client->fd, client->in + client->in_length, MAX_MESSAGE - client->in_length);
+	if (r <= 0) {
+		if (r == 0 || (errno != EINTR && errno != EAGAIN))
+			hang_up(client);
+		return;
+	}
+	client->in_length += r;
+
+	while (client->fd != -1 && client->in_length >= sizeof(*request)) {
+		length = request->length;
+		if (length < sizeof(*request) || length > MAX_MESSAGE) {
+			fprintf(stderr, "client %d: invalid message\n", client->fd);
+			hang_up(client);
+			return;
+		}
+		if (length > client->in_length)
+			break;
+		handle_request(client, request);
+		if (client->fd == -1)
+			return;
+		client->in_length -= length;
+		memmove(client->in, client->in + length, client->in_length);
+	}
+}
+
+static void accept_client(void)
+{
+	struct client *client;
+	int fd;
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		if (errno != EAGAIN && errno != EINTR && errno != ECONNABORTED)
+			perror("accept failed");
+		return;
+	}
+	client = calloc(1, sizeof(*client));
+	if (!client || !(client->in = malloc(MAX_MESSAGE)))
+		out_of_memory();
+	client->fd = fd;
+	client->next = clients;
+	clients = client;
+	if (verbose)
+		printf("client %d: connected\n", fd);
+}
+
+/*
+ * Main loop
+ */
+
+/* the milliseconds until the next FCP or PHY response is overdue */
+static int next_timeout(void)
+{
+	struct device *device;
+	struct operation *op;
+	u64 next = 0, now;
+
+	for (device = devices; device; device = device->next) {
+		op = device->fcp_head;
+		if (op && op->deadline && (!next || op->deadline < next))
+			next = op->deadline;
+	}
+	for (op = phy_waiters; op; op = op->next)
+		if (op->deadline && (!next || op->deadline < next))
+			next = op->deadline;
+	if (!next)
+		return -1;
+	now = now_us();
+	return next > now ? (next - now + 999) / 1000 : 0;
+}
+
+static void expire_operations(void)
+{
+	struct device *device;
+	struct operation *op, *next;
+	u64 now = now_us();
+
+	for (device = devices; device; device = device->next) {
+		op = device->fcp_head;
+		if (op && op->deadline && op->deadline <= now)
+			finish_rcode(op, FW_RCODE_TIMEOUT);
+	}
+	for (op = phy_waiters; op; op = next) {
+		next = op->next;
+		if (op->deadline && op->deadline <= now)
+			finish_rcode(op, FW_RCODE_TIMEOUT);
+	}
+}
+
+static void open_socket(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(socket_path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", socket_path);
+		exit(EXIT_FAILURE);
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socket_path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		perror("socket failed");
+		exit(EXIT_FAILURE);
+	}
+	/* a socket that nobody listens on is left over from a crash */
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		fprintf(stderr, "%s: another daemon is running\n", socket_path);
+		exit(EXIT_FAILURE);
+	}
+	unlink(socket_path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    chmod(socket_path, 0660) < 0 || listen(fd, 16) < 0) {
+		perror(socket_path);
+		exit(EXIT_FAILURE);
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	listen_fd = fd;
+}
+
+static void stop_signal(int signum)
+{
+	stop = true;
+}
+
+static void run(void)
+{
+	struct sigaction sa;
+	struct client *client;
+	struct device *device;
+	struct pollfd *pfds = NULL;
+	unsigned int count, n;
+	bool device_ready;
+	int r;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!stop) {
+		reap_clients();
+		count = 1;
+		for (client = clients; client; client = client->next)
+			++count;
+		for (device = devices; device; device = device->next)
+			++count;
+		pfds = realloc(pfds, count * sizeof(*pfds));
+		if (!pfds)
+			out_of_memory();
+
+		pfds[0].fd = listen_fd;
+		pfds[0].events = POLLIN;
+		n = 1;
+		for (client = clients; client; client = client->next) {
+			pfds[n].fd = client->fd;
+			pfds[n].events = client->out_length < OUTPUT_LIMIT ? POLLIN : 0;
+			if (client->out_length)
+				pfds[n].events |= POLLOUT;
+			++n;
+		}
+		for (device = devices; device; device = device->next) {
+			pfds[n].fd = device->dev.fd;
+			pfds[n].events = POLLIN;
+			++n;
+		}
+
+		fflush(stdout);
+		r = poll(pfds, count, next_timeout());
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll failed");
+			exit(EXIT_FAILURE);
+		}
+
+		/* clients are freed only by reap_clients(), so the order still holds */
+		n = 1;
+		for (client = clients; client; client = client->next) {
+			if (client->fd != -1 && (pfds[n].revents & POLLOUT))
+				flush_output(client);
+			if (client->fd != -1 && (pfds[n].revents & (POLLIN | POLLHUP | POLLERR)))
+				client_input(client);
+			++n;
+		}
+		device_ready = false;
+		for (; n < count; ++n)
+			if (pfds[n].revents)
+				device_ready = true;
+		if (device_ready && fw_engine_dispatch(engine, 0) < 0) {
+			perror("reading events failed");
+			exit(EXIT_FAILURE);
+		}
+		expire_operations();
+		if (pfds[0].revents & POLLIN)
+			accept_client();
+	}
+	free(pfds);
+}
+
+static void parse_parameters(int argc, char *argv[])
+{
+	static const char short_options[] = "s:vhV";
+	static const struct option long_options[] = {
+		{ "socket", 1, NULL, 's' },
+		{ "verbose", 0, NULL, 'v' },
+		{ "help", 0, NULL, 'h' },
+		{ "version", 0, NULL, 'V' },
+		{}
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+		switch (c) {
+		case 's':
+			socket_path = optarg;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			help();
+			exit(EXIT_SUCCESS);
+		case 'V':
+			puts("firewire-daemon version " PACKAGE_VERSION);
+			exit(EXIT_SUCCESS);
+		default:
+		syntax_error:
+			help();
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (optind < argc) {
+		fprintf(stderr, "superfluous parameter: `%s'\n", argv[optind]);
+		goto syntax_error;
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	struct device *device;
+
+	parse_parameters(argc, argv);
+
+	engine = fw_engine_new();
+	if (!engine)
+		out_of_memory();
+	/* a request that was not sent because of a bus reset is sent again */
+	fw_engine_set_retry_on_reset(engine, true);
+	fw_engine_set_reset_handler(engine, device_reset, NULL);
+	fw_engine_set_removal_handler(engine, device_removed, NULL);
+	fw_engine_set_event_handler(engine, device_event, NULL);
+	open_devices();
+	if (!devices)
+		fputs("no fw devices found; waiting for clients anyway\n", stderr);
+
+	open_socket();
+	run();
+
+	unlink(socket_path);
+	close(listen_fd);
+	while ((device = devices))
+		close_device(device);
+	fw_engine_free(engine);
+	return 0;
+}
@@ -0,0 +1,1133 @@
+/*
+ * firewire-iso-recv.c - capture isochronous streams
+ *
+ * licensed under the terms of version 2 of the GNU General Public License
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <linux/firewire-cdev.h>
+#include <asm/byteorder.h>
+#include "fwutils.h"
+
+#define ptr_to_u64(p) ((uintptr_t)(p))
+
+/* iso packet header and timestamp quadlets */
+#define HEADER_SIZE		8
+/* --monitor also gets the first two payload quadlets, i.e., the CIP header */
+#define MONITOR_HEADER_SIZE	16
+#define MONITOR_IRQ_INTERVAL	1024
+#define SIZE_BUCKETS		18
+#define CYCLES_PER_WRAP		(8 * 8000)
+
+typedef __u8 u8;
+typedef __u16 u16;
+typedef __u32 u32;
+typedef __u64 u64;
+
+struct output {
+	int fd;
+	struct iovec *iov;
+	unsigned int n_iov;
+};
+
+struct channel {
+	struct output *output;
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long dropped_cycles;
+	int last_cycle;
+
+	/* collected by --scan */
+	unsigned int max_length;
+	unsigned long long empty_packets;
+	unsigned long long cip_packets;
+	u32 cip[2];
+	u8 tags_seen;
+	u16 sy_seen;
+};
+
+static const char *device_name;
+static const char *output_name;
+static u64 channel_mask;
+static bool multichannel;
+static bool scan;
+static bool monitor;
+static u64 busy_channels;
+static unsigned int tags = FW_CDEV_ISO_CONTEXT_MATCH_ALL_TAGS;
+static unsigned int max_payload = 2048;
+static unsigned int buffer_packets = 4096;
+static unsigned int irq_interval;
+static unsigned int header_size = HEADER_SIZE;
+static unsigned long long max_packets;
+static unsigned int duration;
+static bool with_headers;
+static bool verbose;
+
+static struct fw_device device;
+static u32 iso_handle;
+static u8 *buffer;
+static size_t buffer_size;
+static struct fw_cdev_iso_packet *descriptors;
+static unsigned int ring_head;
+static volatile sig_atomic_t stop;
+
+/* multichannel reception: the buffer is a ring of chunks */
+static unsigned int chunk_size;
+static unsigned int n_chunks;
+static unsigned int ring_size;
+static unsigned int read_pos;
+static unsigned int requeue_chunk;
+static u8 *bounce;
+static bool bounce_used;
+
+static struct output *outputs[64];
+static unsigned int n_outputs;
+static struct channel channels[64];
+static u32 *header_pool;
+static unsigned int header_pool_used;
+
+static struct {
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long truncated;
+	unsigned long long dropped_cycles;
+	struct timespec start;
+	struct timespec last_report;
+	unsigned long long last_report_bytes;
+} stats;
+
+/* --monitor counters, reset every second */
+static struct {
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long empty_packets;
+	unsigned long long missed_cycles;
+	unsigned int min_length;
+	unsigned int max_length;
+	unsigned long long sizes[SIZE_BUCKETS];
+	int last_cycle;
+} interval;
+
+static void help(void)
+{
+	fputs("Usage: firewire-iso-recv [options] device channels [file]\n"
+	      "       firewire-iso-recv --scan [options] device [channels]\n"
+	      "       firewire-iso-recv --monitor [options] device channel\n"
+	      "Options:\n"
+	      " -c, --count=packets   stop after this many packets\n"
+	      " -d, --duration=secs   stop after this many seconds\n"
+	      " -t, --tags=mask       accept only these tag values (bit mask, default 0xf)\n"
+	      " -s, --size=bytes      maximum payload size per packet (default 2048)\n"
+	      " -n, --packets=count   number of packets in the DMA buffer (default 4096)\n"
+	      " -i, --interrupt=count packets per interrupt (default 64, monitor 1024)\n"
+	      " -m, --multichannel    use a multichannel context even for one channel\n"
+	      " -S, --scan            report the traffic on the channels (default: all)\n"
+	      " -M, --monitor         print packet statistics every second, no payloads\n"
+	      " -H, --headers         write the iso packet header before each payload\n"
+	      " -v, --verbose         report throughput every second\n"
+	      " -h, --help            show this message and exit\n"
+	      " -V, --version         show version number and exit\n"
+	      "\n"
+	      "<channels> is a list of channels or ranges, like 0,2,4-7\n"
+	      "With several channels, <file> can contain %d for the channel number.\n"
+	      "\n"
+	      "Report bugs to <" PACKAGE_BUGREPORT ">.\n"
+	      PACKAGE_NAME " home page: <" PACKAGE_URL ">.\n",
+	      stderr);
+}
+
+static unsigned long parse_number(const char *s, const char *what,
+				  unsigned long min, unsigned long max)
+{
+	char *endptr;
+	unsigned long long n;
+
+	errno = 0;
+	n = strtoull(s, &endptr, 0);
+	if (*s == '\0' || *endptr != '\0' || errno) {
+		fprintf(stderr, "invalid %s: `%s'\n", what, s);
+		exit(EXIT_FAILURE);
+	}
+	if (n < min || n > max) {
+		fprintf(stderr, "%s out of range\n", what);
+		exit(EXIT_FAILURE);
+	}
+	return n;
+}
+
+static void parse_channels(const char *s)
+{
+	const char *p = s;
+	char *endptr;
+	long first, last;
+
+	for (;;) {
+		first = strtol(p, &endptr, 10);
+		if (endptr == p)
+			goto invalid;
+		last = first;
+		if (*endptr == '-') {
+			p = endptr + 1;
+			last = strtol(p, &endptr, 10);
+			if (endptr == p)
+				goto invalid;
+		}
+		if (first < 0 || last > 63 || first > last) {
+			fputs("channel out of range\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		for (; first <= last; ++first)
+			channel_mask |= 1uLL << first;
+		if (*endptr == '\0')
+			return;
+		if (*endptr != ',')
+			goto invalid;
+		p = endptr + 1;
+	}
+
+invalid:
+	fprintf(stderr, "invalid channel list: `%s'\n", s);
+	exit(EXIT_FAILURE);
+}
+
+static void parse_parameters(int argc, char *argv[])
+{
+	static const char short_options[] = "c:d:t:s:n:i:mSMHvhV";
+	static const struct option long_options[] = {
+		{ "count", 1, NULL, 'c' },
+		{ "duration", 1, NULL, 'd' },
+		{ "tags", 1, NULL, 't' },
+		{ "size", 1, NULL, 's' },
+		{ "packets", 1, NULL, 'n' },
+		{ "interrupt", 1, NULL, 'i' },
+		{ "multichannel", 0, NULL, 'm' },
+		{ "scan", 0, NULL, 'S' },
+		{ "monitor", 0, NULL, 'M' },
+		{ "headers", 0, NULL, 'H' },
+		{ "verbose", 0, NULL, 'v' },
+		{ "help", 0, NULL, 'h' },
+		{ "version", 0, NULL, 'V' },
+		{}
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+		switch (c) {
+		case 'c':
+			max_packets = parse_number(optarg, "packet count", 1, ULONG_MAX);
+			break;
+		case 'd':
+			duration = parse_number(optarg, "duration", 1, UINT_MAX);
+			break;
+		case 't':
+			tags = parse_number(optarg, "tag mask", 1, 15);
+			break;
+		case 's':
+			max_payload = parse_number(optarg, "payload size", 4, 0xfffc);
+			max_payload = (max_payload + 3) & ~3;
+			break;
+		case 'n':
+			buffer_packets = parse_number(optarg, "packet count", 2, 1 << 20);
+			break;
+		case 'i':
+			irq_interval = parse_number(optarg, "interrupt interval", 1, 1 << 20);
+			break;
+		case 'm':
+			multichannel = true;
+			break;
+		case 'S':
+			scan = true;
+			break;
+		case 'M':
+			monitor = true;
+			break;
+		case 'H':
+			with_headers = true;
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			help();
+			exit(EXIT_SUCCESS);
+		case 'V':
+			puts("firewire-iso-recv version " PACKAGE_VERSION);
+			exit(EXIT_SUCCESS);
+		default:
+		syntax_error:
+			help();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc)
+		goto syntax_error;
+	device_name = fw_resolve_device_name(argv[optind++]);
+
+	if (optind < argc)
+		parse_channels(argv[optind++]);
+	else if (scan)
+		channel_mask = ~0uLL;
+	else
+		goto syntax_error;
+	if ((channel_mask & (channel_mask - 1)) || scan)
+		multichannel = true;
+
+	if (optind < argc && !scan && !monitor)
+		output_name = argv[optind++];
+
+	if (optind < argc) {
+		fprintf(stderr, "superfluous parameter: `%s'\n", argv[optind]);
+		goto syntax_error;
+	}
+
+	if (scan && !duration)
+		duration = 1;
+	if (monitor) {
+		if (scan || multichannel) {
+			fputs("--monitor works only with a single channel\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		/* the payload goes nowhere, so truncate it as much as possible */
+		header_size = MONITOR_HEADER_SIZE;
+		max_payload = 4;
+		if (!irq_interval)
+			irq_interval = MONITOR_IRQ_INTERVAL;
+	}
+	if (!irq_interval)
+		irq_interval = 64;
+	if (irq_interval > buffer_packets / 2)
+		irq_interval = buffer_packets / 2;
+}
+
+static void open_device(void)
+{
+	if (fw_device_open(&device, device_name) < 0) {
+		perror(device_name);
+		exit(EXIT_FAILURE);
+	}
+	if (device.version < (multichannel ? 4 : 2)) {
+		fputs("this kernel is too old\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	/*
+	 * Before ABI version 5, the kernel silently drops the headers that do
+	 * not fit into the one page it collects per interrupt.  (Multichannel
+	 * contexts have no headers.)
+	 */
+	if (!multichannel && device.version < 5 && irq_interval * header_size > getpagesize())
+		irq_interval = getpagesize() / header_size;
+}
+
+static struct output *new_output(const char *name)
+{
+	struct output *output;
+
+	output = malloc(sizeof(*output));
+	if (output)
+		output->iov = calloc(IOV_MAX, sizeof(*output->iov));
+	if (!output || !output->iov) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	output->n_iov = 0;
+
+	if (!name || !strcmp(name, "-")) {
+		output->fd = STDOUT_FILENO;
+	} else {
+		output->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (output->fd == -1) {
+			perror(name);
+			exit(EXIT_FAILURE);
+		}
+	}
+	outputs[n_outputs++] = output;
+	return output;
+}
+
+static bool is_name_template(const char *name)
+{
+	const char *p;
+
+	if (!name || !(p = strchr(name, '%')))
+		return false;
+	p += strspn(p + 1, "-0123456789") + 1;
+	if (!strchr("dux", *p) || strchr(p, '%')) {
+		fprintf(stderr, "invalid file name template: `%s'\n", name);
+		exit(EXIT_FAILURE);
+	}
+	return true;
+}
+
+/*
+ * A file name containing a conversion gets one file per channel;
+ * otherwise, all channels share one file.
+ */
+static void open_outputs(void)
+{
+	struct output *shared = NULL;
+	bool per_channel = is_name_template(output_name);
+	char *name;
+	unsigned int ch;
+
+	header_pool = malloc(IOV_MAX * sizeof(*header_pool));
+	if (!header_pool) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	for (ch = 0; ch < 64; ++ch) {
+		if (!(channel_mask & (1uLL << ch)))
+			continue;
+		channels[ch].last_cycle = -1;
+		if (per_channel) {
+			if (asprintf(&name, output_name, ch) < 0) {
+				perror("asprintf failed");
+				exit(EXIT_FAILURE);
+			}
+			channels[ch].output = new_output(name);
+			free(name);
+		} else {
+			if (!shared)
+				shared = new_output(output_name);
+			channels[ch].output = shared;
+		}
+	}
+}
+
+static void close_outputs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_outputs; ++i) {
+		if (outputs[i]->fd != STDOUT_FILENO)
+			close(outputs[i]->fd);
+		free(outputs[i]->iov);
+		free(outputs[i]);
+	}
+	free(header_pool);
+}
+
+static void map_buffer(void)
+{
+	buffer_size = (buffer_size + getpagesize() - 1) & ~(size_t)(getpagesize() - 1);
+	buffer = mmap(NULL, buffer_size, PROT_READ, MAP_SHARED, device.fd, 0);
+	if (buffer == MAP_FAILED) {
+		perror("mmap failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void create_context(void)
+{
+	struct fw_cdev_create_iso_context create;
+	unsigned int i;
+
+	create.type = FW_CDEV_ISO_CONTEXT_RECEIVE;
+	create.header_size = header_size;
+	create.channel = __builtin_ctzll(channel_mask);
+	create.speed = 0;
+	create.closure = 0;
+	if (ioctl(device.fd, FW_CDEV_IOC_CREATE_ISO_CONTEXT, &create) < 0) {
+		perror("CREATE_ISO_CONTEXT ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	iso_handle = create.handle;
+
+	buffer_size = (size_t)buffer_packets * max_payload;
+	map_buffer();
+
+	/*
+	 * Every packet slot has a fixed place in the buffer, so the
+	 * descriptors never change and can be requeued as they are.
+	 */
+	descriptors = calloc(buffer_packets, sizeof(*descriptors));
+	if (!descriptors) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < buffer_packets; ++i) {
+		descriptors[i].control = FW_CDEV_ISO_HEADER_LENGTH(header_size) |
+					 FW_CDEV_ISO_PAYLOAD_LENGTH(max_payload);
+		if ((i + 1) % irq_interval == 0 || i == buffer_packets - 1)
+			descriptors[i].control |= FW_CDEV_ISO_INTERRUPT;
+	}
+}
+
+/*
+ * A failed SET_ISO_CHANNELS does not tell which channels are in use,
+ * so try the requested channels one at a time.
+ */
+static u64 find_busy_channels(u64 mask)
+{
+	struct fw_cdev_set_iso_channels set_channels;
+	u64 busy = 0;
+	unsigned int ch;
+
+	set_channels.handle = iso_handle;
+	for (ch = 0; ch < 64; ++ch) {
+		if (!(mask & (1uLL << ch)))
+			continue;
+		set_channels.channels = 1uLL << ch;
+		if (ioctl(device.fd, FW_CDEV_IOC_SET_ISO_CHANNELS, &set_channels) < 0 &&
+		    errno == EBUSY)
+			busy |= 1uLL << ch;
+	}
+	return busy;
+}
+
+static void create_multichannel_context(void)
+{
+	struct fw_cdev_create_iso_context create;
+	struct fw_cdev_set_iso_channels set_channels;
+	u64 busy;
+	unsigned int i;
+
+	create.type = FW_CDEV_ISO_CONTEXT_RECEIVE_MULTICHANNEL;
+	create.header_size = 0;
+	create.channel = 0;
+	create.speed = 0;
+	create.closure = 0;
+	if (ioctl(device.fd, FW_CDEV_IOC_CREATE_ISO_CONTEXT, &create) < 0) {
+		perror("CREATE_ISO_CONTEXT ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	iso_handle = create.handle;
+
+	set_channels.channels = channel_mask;
+	set_channels.handle = iso_handle;
+	if (ioctl(device.fd, FW_CDEV_IOC_SET_ISO_CHANNELS, &set_channels) < 0) {
+		if (errno != EBUSY) {
+			perror("SET_ISO_CHANNELS ioctl failed");
+			exit(EXIT_FAILURE);
+		}
+		busy = find_busy_channels(channel_mask);
+		if (!scan || !(channel_mask & ~busy)) {
+			fprintf(stderr, "channels %#llx are already in use\n",
+				(unsigned long long)(busy ? busy : channel_mask));
+			exit(EXIT_FAILURE);
+		}
+		/* scan what can be scanned; the other channels are in use anyway */
+		busy_channels = busy;
+		channel_mask &= ~busy;
+		set_channels.channels = channel_mask;
+		if (ioctl(device.fd, FW_CDEV_IOC_SET_ISO_CHANNELS, &set_channels) < 0) {
+			perror("SET_ISO_CHANNELS ioctl failed");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/* each chunk holds irq_interval packets plus their headers and trailers */
+	chunk_size = irq_interval * (max_payload + 8);
+	n_chunks = buffer_packets / irq_interval;
+	if (n_chunks < 3)
+		n_chunks = 3;
+	ring_size = n_chunks * chunk_size;
+	buffer_size = ring_size;
+	map_buffer();
+
+	descriptors = calloc(n_chunks, sizeof(*descriptors));
+	bounce = malloc(max_payload + 0x10000);
+	if (!descriptors || !bounce) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n_chunks; ++i)
+		descriptors[i].control = FW_CDEV_ISO_PAYLOAD_LENGTH(chunk_size) |
+					 FW_CDEV_ISO_INTERRUPT;
+}
+
+static void queue(unsigned int first, unsigned int count,
+		  unsigned int entries, unsigned int entry_size)
+{
+	struct fw_cdev_queue_iso queue_iso;
+	unsigned int n;
+
+	while (count > 0) {
+		n = entries - first;
+		if (n > count)
+			n = count;
+		queue_iso.packets = ptr_to_u64(&descriptors[first]);
+		queue_iso.data = ptr_to_u64(buffer + (size_t)first * entry_size);
+		queue_iso.size = n * sizeof(*descriptors);
+		queue_iso.handle = iso_handle;
+		if (ioctl(device.fd, FW_CDEV_IOC_QUEUE_ISO, &queue_iso) < 0) {
+			perror("QUEUE_ISO ioctl failed");
+			exit(EXIT_FAILURE);
+		}
+		if (queue_iso.size != 0) {
+			fputs("DMA queue is full; use fewer packets\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		first = (first + n) % entries;
+		count -= n;
+	}
+}
+
+static void write_iov(int out_fd, struct iovec *v, unsigned int count)
+{
+	ssize_t r;
+
+	while (count > 0) {
+		r = writev(out_fd, v, count);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("write failed");
+			exit(EXIT_FAILURE);
+		}
+		while (count > 0 && (size_t)r >= v->iov_len) {
+			r -= v->iov_len;
+			++v;
+			--count;
+		}
+		if (count > 0) {
+			v->iov_base = (u8 *)v->iov_base + r;
+			v->iov_len -= r;
+		}
+	}
+}
+
+static void flush_outputs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < n_outputs; ++i) {
+		write_iov(outputs[i]->fd, outputs[i]->iov, outputs[i]->n_iov);
+		outputs[i]->n_iov = 0;
+	}
+	header_pool_used = 0;
+	bounce_used = false;
+}
+
+static void add_iov(struct output *output, void *base, size_t length)
+{
+	output->iov[output->n_iov].iov_base = base;
+	output->iov[output->n_iov].iov_len = length;
+	++output->n_iov;
+}
+
+/*
+ * Queues one packet for writing.  The payload is not copied; it is written
+ * from where it is, so it must stay there until the next flush_outputs().
+ */
+static void output_packet(unsigned int ch, u32 header, u32 timestamp,
+			  void *payload, u32 length)
+{
+	struct channel *channel = &channels[ch];
+	struct output *output = channel->output;
+	int cycle, gap;
+
+	cycle = ((timestamp >> 13) & 7) * 8000 + (timestamp & 0x1fff);
+	if (channel->last_cycle >= 0) {
+		gap = (cycle - channel->last_cycle + CYCLES_PER_WRAP) % CYCLES_PER_WRAP;
+		if (gap > 1) {
+			channel->dropped_cycles += gap - 1;
+			stats.dropped_cycles += gap - 1;
+		}
+	}
+	channel->last_cycle = cycle;
+	++channel->packets;
+	channel->bytes += length;
+	++stats.packets;
+	stats.bytes += length;
+
+	if (output->n_iov + 2 > IOV_MAX || header_pool_used >= IOV_MAX)
+		flush_outputs();
+	if (with_headers) {
+		header_pool[header_pool_used] = __cpu_to_be32(header);
+		add_iov(output, &header_pool[header_pool_used++], 4);
+	}
+	if (length > 0)
+		add_iov(output, payload, length);
+}
+
+static bool reached_max_packets(void)
+{
+	if (max_packets && stats.packets >= max_packets) {
+		stop = true;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * Writes the payloads of all packets reported by one interrupt directly
+ * from the DMA buffer, and then gives their slots back to the controller.
+ */
+static void handle_packets(const u32 *headers, unsigned int count)
+{
+	unsigned int i, slot;
+	u32 header, length;
+
+	slot = ring_head;
+	for (i = 0; i < count && !reached_max_packets(); ++i) {
+		header = __be32_to_cpu(headers[i * 2]);
+		length = header >> 16;
+		if (length > max_payload) {
+			length = max_payload;
+			++stats.truncated;
+		}
+		output_packet((header >> 8) & 0x3f, header,
+			      __be32_to_cpu(headers[i * 2 + 1]),
+			      buffer + (size_t)slot * max_payload, length);
+		slot = (slot + 1) % buffer_packets;
+	}
+	flush_outputs();
+
+	if (!stop)
+		queue(ring_head, count, buffer_packets, max_payload);
+	ring_head = slot;
+}
+
+static u32 ring_quadlet(unsigned int offset)
+{
+	return __le32_to_cpu(*(u32 *)(buffer + offset % ring_size));
+}
+
+static u32 ring_payload_quadlet(unsigned int offset)
+{
+	return __be32_to_cpu(*(u32 *)(buffer + offset % ring_size));
+}
+
+/*
+ * Records what a channel carries, looking only at the packet header and
+ * at the first two payload quadlets, which would be the CIP header.
+ */
+static void scan_packet(unsigned int packet_offset, u32 header, u32 length)
+{
+	struct channel *channel = &channels[(header >> 8) & 0x3f];
+	u32 cip0, cip1;
+
+	++channel->packets;
+	channel->bytes += length;
+	++stats.packets;
+	stats.bytes += length;
+	if (length > channel->max_length)
+		channel->max_length = length;
+	channel->tags_seen |= 1 << ((header >> 14) & 3);
+	channel->sy_seen |= 1 << (header & 0xf);
+
+	if (length >= 8) {
+		cip0 = ring_payload_quadlet(packet_offset + 4);
+		cip1 = ring_payload_quadlet(packet_offset + 8);
+		if ((cip0 & 0xc0000000) == 0 && (cip1 & 0xc0000000) == 0x80000000) {
+			++channel->cip_packets;
+			channel->cip[0] = cip0;
+			channel->cip[1] = cip1;
+			if (length == 8)
+				++channel->empty_packets;
+			return;
+		}
+	}
+	if (length == 0)
+		++channel->empty_packets;
+}
+
+/*
+ * Gives back all chunks that have been read completely, except the one
+ * just before the read position; this keeps the controller from filling
+ * the ring completely, so that a full ring cannot look like an empty one.
+ */
+static void requeue_chunks(void)
+{
+	unsigned int read_chunk = read_pos / chunk_size;
+	unsigned int count = 0;
+
+	while ((read_chunk - requeue_chunk + n_chunks) % n_chunks >= 2 + count)
+		++count;
+	if (count > 0 && !stop) {
+		queue(requeue_chunk, count, n_chunks, chunk_size);
+		requeue_chunk = (requeue_chunk + count) % n_chunks;
+	}
+}
+
+/*
+ * Splits the packets between the read position and the completed offset
+ * to their channels.  The only payload that gets copied is one that wraps
+ * around the end of the ring.
+ */
+static void handle_multichannel(u32 completed)
+{
+	unsigned int avail, size, offset;
+	u32 header, length;
+	void *payload;
+
+	avail = (completed % ring_size - read_pos + ring_size) % ring_size;
+	while (avail >= 8 && !reached_max_packets()) {
+		header = ring_quadlet(read_pos);
+		length = header >> 16;
+		size = ((length + 3) & ~3) + 8;
+		if (size > avail)
+			break;
+
+		if (scan) {
+			scan_packet(read_pos, header, length);
+			goto next_packet;
+		}
+
+		offset = (read_pos + 4) % ring_size;
+		if (offset + length <= ring_size) {
+			payload = buffer + offset;
+		} else {
+			if (bounce_used)
+				flush_outputs();
+			memcpy(bounce, buffer + offset, ring_size - offset);
+			memcpy(bounce + ring_size - offset, buffer,
+			       length - (ring_size - offset));
+			payload = bounce;
+			bounce_used = true;
+		}
+		output_packet((header >> 8) & 0x3f, header,
+			      ring_quadlet(read_pos + size - 4), payload, length);
+
+	next_packet:
+		read_pos = (read_pos + size) % ring_size;
+		avail -= size;
+	}
+	flush_outputs();
+	requeue_chunks();
+}
+
+static double seconds_since(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) * 1e-9;
+}
+
+static void report_throughput(void)
+{
+	double secs = seconds_since(&stats.last_report);
+
+	if (secs < 1.0)
+		return;
+	fprintf(stderr, "%llu packets, %.1f kB/s, %llu dropped cycles\n",
+		stats.packets,
+		(stats.bytes - stats.last_report_bytes) / secs / 1000.0,
+		stats.dropped_cycles);
+	clock_gettime(CLOCK_MONOTONIC, &stats.last_report);
+	stats.last_report_bytes = stats.bytes;
+}
+
+static unsigned int size_bucket(u32 length)
+{
+	unsigned int bucket = 0;
+
+	/* bucket n holds lengths from 2^(n-1) to 2^n - 1 */
+	while (length && bucket < SIZE_BUCKETS - 1) {
+		length >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+/*
+ * Counts the packets reported by one interrupt.  With --monitor, the DMA
+ * buffer contains nothing useful; everything needed is in the headers.
+ */
+static void monitor_packets(const u32 *headers, unsigned int count)
+{
+	const u32 *h;
+	u32 header, timestamp, length;
+	int cycle, gap;
+
+	for (h = headers; h < headers + count * (MONITOR_HEADER_SIZE / 4);
+	     h += MONITOR_HEADER_SIZE / 4) {
+		header = __be32_to_cpu(h[0]);
+		timestamp = __be32_to_cpu(h[1]);
+		length = header >> 16;
+
+		cycle = ((timestamp >> 13) & 7) * 8000 + (timestamp & 0x1fff);
+		if (interval.last_cycle >= 0) {
+			gap = (cycle - interval.last_cycle + CYCLES_PER_WRAP) % CYCLES_PER_WRAP;
+			if (gap > 1) {
+				interval.missed_cycles += gap - 1;
+				stats.dropped_cycles += gap - 1;
+			}
+		}
+		interval.last_cycle = cycle;
+
+		++interval.packets;
+		interval.bytes += length;
+		++stats.packets;
+		stats.bytes += length;
+		if (length < interval.min_length)
+			interval.min_length = length;
+		if (length > interval.max_length)
+			interval.max_length = length;
+		++interval.sizes[size_bucket(length)];
+
+		/* no payload, or only a CIP header */
+		if (length == 0 ||
+		    (length == 8 && (__be32_to_cpu(h[2]) & 0xc0000000) == 0 &&
+		     (__be32_to_cpu(h[3]) & 0xc0000000) == 0x80000000))
+			++interval.empty_packets;
+	}
+}
+
+static void handle_monitor(const u32 *headers, unsigned int count)
+{
+	monitor_packets(headers, count);
+	reached_max_packets();
+	if (!stop)
+		queue(ring_head, count, buffer_packets, max_payload);
+	ring_head = (ring_head + count) % buffer_packets;
+}
+
+static void reset_interval(void)
+{
+	int last_cycle = interval.last_cycle;
+
+	memset(&interval, 0, sizeof(interval));
+	interval.min_length = UINT_MAX;
+	interval.last_cycle = last_cycle;
+}
+
+static void report_monitor(void)
+{
+	double secs = seconds_since(&stats.last_report);
+	unsigned int i;
+
+	if (secs < 1.0)
+		return;
+	printf("%.1f packets/s, %.1f kB/s, %llu empty, %llu missed cycles",
+	       interval.packets / secs, interval.bytes / secs / 1000.0,
+	       interval.empty_packets, interval.missed_cycles);
+	if (interval.packets) {
+		printf(", size min %u avg %.1f max %u, sizes",
+		       interval.min_length, (double)interval.bytes / interval.packets,
+		       interval.max_length);
+		for (i = 0; i < SIZE_BUCKETS; ++i)
+			if (interval.sizes[i])
+				printf(" <%u:%llu", 1u << i, interval.sizes[i]);
+	}
+	putchar('\n');
+	fflush(stdout);
+	clock_gettime(CLOCK_MONOTONIC, &stats.last_report);
+	reset_interval();
+}
+
+static void print_summary(void)
+{
+	double secs = seconds_since(&stats.start);
+	unsigned int ch;
+
+	fprintf(stderr, "packets: %llu, bytes: %llu, dropped cycles: %llu\n",
+		stats.packets, stats.bytes, stats.dropped_cycles);
+	if (stats.truncated && !monitor)
+		fprintf(stderr, "truncated packets: %llu\n", stats.truncated);
+	fprintf(stderr, "time: %.3f s, throughput: %.1f kB/s\n",
+		secs, secs > 0 ? stats.bytes / secs / 1000.0 : 0.0);
+	if (!multichannel)
+		return;
+	for (ch = 0; ch < 64; ++ch)
+		if (channel_mask & (1uLL << ch))
+			fprintf(stderr, "channel %2u: packets: %llu, bytes: %llu, dropped cycles: %llu\n",
+				ch, channels[ch].packets, channels[ch].bytes,
+				channels[ch].dropped_cycles);
+}
+
+static void print_bits(const char *name, unsigned int bits)
+{
+	unsigned int i;
+	const char *separator = "";
+
+	printf(", %s ", name);
+	for (i = 0; bits; ++i, bits >>= 1)
+		if (bits & 1) {
+			printf("%s%u", separator, i);
+			separator = ",";
+		}
+}
+
+static void print_scan(void)
+{
+	double secs = seconds_since(&stats.start);
+	struct channel *channel;
+	unsigned int ch;
+	bool any = false;
+
+	for (ch = 0; ch < 64; ++ch) {
+		channel = &channels[ch];
+		if (!channel->packets)
+			continue;
+		any = true;
+		printf("channel %2u: %.1f packets/s, %.1f bytes/cycle, max %u bytes",
+		       ch, channel->packets / secs, channel->bytes / (secs * 8000),
+		       channel->max_length);
+		print_bits("tag", channel->tags_seen);
+		print_bits("sy", channel->sy_seen);
+		if (channel->empty_packets)
+			printf(", %llu empty", channel->empty_packets);
+		if (channel->cip_packets)
+			printf(", CIP sid %u dbs %u fmt 0x%02x fdf 0x%02x",
+			       (channel->cip[0] >> 24) & 0x3f,
+			       (channel->cip[0] >> 16) & 0xff,
+			       (channel->cip[1] >> 24) & 0x3f,
+			       (channel->cip[1] >> 16) & 0xff);
+		else
+			fputs(", no CIP", stdout);
+		putchar('\n');
+	}
+	if (!any)
+		puts("no isochronous traffic");
+	for (ch = 0; ch < 64; ++ch)
+		if (busy_channels & (1uLL << ch))
+			printf("channel %2u: in use by another context\n", ch);
+}
+
+static void stop_signal(int signum)
+{
+	stop = true;
+}
+
+/* available since ABI version 5; older kernels just report later */
+static void flush_iso(void)
+{
+#ifdef FW_CDEV_IOC_FLUSH_ISO
+	struct fw_cdev_flush_iso flush;
+
+	flush.handle = iso_handle;
+	ioctl(device.fd, FW_CDEV_IOC_FLUSH_ISO, &flush);
+#endif
+}
+
+static void receive(void)
+{
+	struct fw_cdev_start_iso start_iso;
+	struct fw_cdev_stop_iso stop_iso;
+	struct sigaction sa;
+	struct pollfd pfd;
+	size_t event_size;
+	union fw_cdev_event *event;
+	int ready;
+	ssize_t r;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	event_size = sizeof(struct fw_cdev_event_iso_interrupt) +
+		     (size_t)buffer_packets * header_size;
+	event = malloc(event_size);
+	if (!event) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if (multichannel) {
+		queue(0, n_chunks - 1, n_chunks, chunk_size);
+		requeue_chunk = n_chunks - 1;
+	} else {
+		queue(0, buffer_packets, buffer_packets, max_payload);
+	}
+
+	start_iso.cycle = -1;
+	start_iso.sync = 0;
+	start_iso.tags = tags;
+	start_iso.handle = iso_handle;
+	if (ioctl(device.fd, FW_CDEV_IOC_START_ISO, &start_iso) < 0) {
+		perror("START_ISO ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stats.start);
+	stats.last_report = stats.start;
+	interval.last_cycle = -1;
+	reset_interval();
+
+	pfd.fd = device.fd;
+	pfd.events = POLLIN;
+	while (!stop) {
+		if (duration && seconds_since(&stats.start) >= duration)
+			break;
+		if (monitor)
+			report_monitor();
+		else if (verbose)
+			report_throughput();
+		ready = poll(&pfd, 1, multichannel ? 100 : 1000);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll failed");
+			exit(EXIT_FAILURE);
+		}
+		if (!ready) {
+			/* a slow channel would not fill a chunk for a long time */
+			if (multichannel)
+				flush_iso();
+			continue;
+		}
+		r = read(device.fd, event, event_size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < (ssize_t)sizeof(struct fw_cdev_event_common)) {
+			fputs("short read\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		if (event->common.type == FW_CDEV_EVENT_ISO_INTERRUPT && monitor)
+			handle_monitor(event->iso_interrupt.header,
+				       event->iso_interrupt.header_length / header_size);
+		else if (event->common.type == FW_CDEV_EVENT_ISO_INTERRUPT)
+			handle_packets(event->iso_interrupt.header,
+				       event->iso_interrupt.header_length / header_size);
+		else if (event->common.type == FW_CDEV_EVENT_ISO_INTERRUPT_MULTICHANNEL)
+			handle_multichannel(event->iso_interrupt_mc.completed);
+	}
+
+	/* pick up the packets in the partially filled chunk */
+	if (multichannel && !reached_max_packets()) {
+		flush_iso();
+		while (poll(&pfd, 1, 0) > 0 &&
+		       read(device.fd, event, event_size) >= (ssize_t)sizeof(struct fw_cdev_event_common))
+			if (event->common.type == FW_CDEV_EVENT_ISO_INTERRUPT_MULTICHANNEL)
+				handle_multichannel(event->iso_interrupt_mc.completed);
+	}
+
+	stop_iso.handle = iso_handle;
+	if (ioctl(device.fd, FW_CDEV_IOC_STOP_ISO, &stop_iso) < 0) {
+		perror("STOP_ISO ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	free(event);
+}
+
+int main(int argc, char *argv[])
+{
+	parse_parameters(argc, argv);
+	open_device();
+	if (!monitor)
+		open_outputs();
+	if (multichannel)
+		create_multichannel_context();
+	else
+		create_context();
+	receive();
+	if (scan)
+		print_scan();
+	else
+		print_summary();
+	munmap(buffer, buffer_size);
+	fw_device_close(&device);
+	if (!monitor)
+		close_outputs();
+	return 0;
+}
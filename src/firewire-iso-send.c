@@ -0,0 +1,667 @@
+/*
+ * firewire-iso-send.c - transmit isochronous streams
+ *
+ * licensed under the terms of version 2 of the GNU General Public License
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/firewire-cdev.h>
+#include <linux/firewire-constants.h>
+#include <asm/byteorder.h>
+#include "fwutils.h"
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof *(a))
+
+#define ptr_to_u64(p) ((uintptr_t)(p))
+
+#define CYCLES_PER_SECOND	8000
+#define CYCLES_PER_WRAP		(8 * CYCLES_PER_SECOND)
+/* the cycle match of START_ISO has two bits of seconds */
+#define START_CYCLES		(4 * CYCLES_PER_SECOND)
+
+#define EVT_UNDERRUN		0x04
+
+typedef __u8 u8;
+typedef __u32 u32;
+typedef __u64 u64;
+
+static const struct speed {
+	const char *name;
+	u32 code;
+	unsigned int max_payload;
+} speeds[] = {
+	{ "S100", SCODE_100, 1024 },
+	{ "S200", SCODE_200, 2048 },
+	{ "S400", SCODE_400, 4096 },
+	{ "S800", SCODE_800, 8192 },
+	{ "S1600", SCODE_1600, 16384 },
+	{ "S3200", SCODE_3200, 32768 },
+};
+
+static const char *device_name;
+static const char *input_name;
+static unsigned int channel;
+static const struct speed *speed = &speeds[2];
+static unsigned int payload = 1024;
+static unsigned long long rate;
+static int start_cycle = -1;
+static int start_offset = -1;
+static unsigned int tag;
+static unsigned int sy;
+static bool pattern;
+static unsigned long long max_packets;
+static unsigned int duration;
+static unsigned int queue_cycles = 4000;
+static unsigned int irq_interval = 64;
+static bool verbose;
+
+static struct fw_device device;
+static int in_fd = -1;
+static u32 iso_handle;
+static u8 *buffer;
+static size_t buffer_size;
+static volatile sig_atomic_t stop;
+
+/*
+ * The buffer is a ring of payload slots, one for every cycle in the queue,
+ * so it cannot overflow even if no cycle is skipped.  Slots are filled,
+ * queued, and freed in ring order.
+ */
+static unsigned int n_slots;
+static unsigned int queue_slot;
+static unsigned int ready_slots;
+static unsigned int last_length;
+static unsigned int inflight_slots;
+static bool end_of_data;
+
+/* which of the queued cycles carry a packet, in queue order */
+static u8 *cycle_has_packet;
+static unsigned int cycle_head;
+static unsigned int queued_cycles;
+static unsigned long long total_cycles;
+static unsigned long long pace;
+
+static struct fw_cdev_iso_packet *batch;
+
+static struct {
+	unsigned long long packets;
+	unsigned long long bytes;
+	unsigned long long produced;
+	unsigned long long late_cycles;
+	unsigned long long underruns;
+	int last_cycle;
+	struct timespec start;
+} stats = { .last_cycle = -1 };
+
+static void help(void)
+{
+	fputs("Usage: firewire-iso-send [options] device channel [file]\n"
+	      "Options:\n"
+	      " -s, --speed=speed     S100|S200|S400|S800|S1600|S3200 (default S400)\n"
+	      " -p, --payload=bytes   payload size per packet (default 1024)\n"
+	      " -r, --rate=bytes/s    data rate; cycles are skipped to achieve it\n"
+	      " -S, --start=cycle     start at this cycle (0..32767), or +cycles from now\n"
+	      " -t, --tag=tag         tag field of the packets (default 0)\n"
+	      " -y, --sy=sy           sy field of the packets (default 0)\n"
+	      " -P, --pattern         send a test pattern instead of a file\n"
+	      " -c, --count=packets   stop after this many packets\n"
+	      " -d, --duration=secs   stop after this many seconds\n"
+	      " -q, --queue=cycles    number of queued cycles (default 4000)\n"
+	      " -i, --interrupt=count cycles per interrupt (default 64)\n"
+	      " -v, --verbose         report progress every second\n"
+	      " -h, --help            show this message and exit\n"
+	      " -V, --version         show version number and exit\n"
+	      "\n"
+	      "Report bugs to <" PACKAGE_BUGREPORT ">.\n"
+	      PACKAGE_NAME " home page: <" PACKAGE_URL ">.\n",
+	      stderr);
+}
+
+static unsigned long long parse_number(const char *s, const char *what,
+				       unsigned long long min, unsigned long long max)
+{
+	char *endptr;
+	unsigned long long n;
+
+	errno = 0;
+	n = strtoull(s, &endptr, 0);
+	if (*s == '\0' || *endptr != '\0' || errno) {
+		fprintf(stderr, "invalid %s: `%s'\n", what, s);
+		exit(EXIT_FAILURE);
+	}
+	if (n < min || n > max) {
+		fprintf(stderr, "%s out of range\n", what);
+		exit(EXIT_FAILURE);
+	}
+	return n;
+}
+
+static void parse_speed(const char *s)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(speeds); ++i)
+		if (!strcasecmp(s, speeds[i].name) ||
+		    !strcmp(s, speeds[i].name + 1)) {
+			speed = &speeds[i];
+			return;
+		}
+	fprintf(stderr, "invalid speed: `%s'\n", s);
+	exit(EXIT_FAILURE);
+}
+
+static void parse_parameters(int argc, char *argv[])
+{
+	static const char short_options[] = "s:p:r:S:t:y:Pc:d:q:i:vhV";
+	static const struct option long_options[] = {
+		{ "speed", 1, NULL, 's' },
+		{ "payload", 1, NULL, 'p' },
+		{ "rate", 1, NULL, 'r' },
+		{ "start", 1, NULL, 'S' },
+		{ "tag", 1, NULL, 't' },
+		{ "sy", 1, NULL, 'y' },
+		{ "pattern", 0, NULL, 'P' },
+		{ "count", 1, NULL, 'c' },
+		{ "duration", 1, NULL, 'd' },
+		{ "queue", 1, NULL, 'q' },
+		{ "interrupt", 1, NULL, 'i' },
+		{ "verbose", 0, NULL, 'v' },
+		{ "help", 0, NULL, 'h' },
+		{ "version", 0, NULL, 'V' },
+		{}
+	};
+	int c;
+
+	while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
+		switch (c) {
+		case 's':
+			parse_speed(optarg);
+			break;
+		case 'p':
+			payload = parse_number(optarg, "payload size", 4, 0xfffc);
+			payload = (payload + 3) & ~3;
+			break;
+		case 'r':
+			rate = parse_number(optarg, "data rate", 1, ULLONG_MAX / CYCLES_PER_SECOND);
+			break;
+		case 'S':
+			if (optarg[0] == '+')
+				start_offset = parse_number(optarg + 1, "start cycle", 1, START_CYCLES - 1);
+			else
+				start_cycle = parse_number(optarg, "start cycle", 0, START_CYCLES - 1);
+			break;
+		case 't':
+			tag = parse_number(optarg, "tag", 0, 3);
+			break;
+		case 'y':
+			sy = parse_number(optarg, "sy", 0, 15);
+			break;
+		case 'P':
+			pattern = true;
+			break;
+		case 'c':
+			max_packets = parse_number(optarg, "packet count", 1, ULLONG_MAX);
+			break;
+		case 'd':
+			duration = parse_number(optarg, "duration", 1, UINT_MAX);
+			break;
+		case 'q':
+			queue_cycles = parse_number(optarg, "queue length", 16, 1 << 20);
+			break;
+		case 'i':
+			irq_interval = parse_number(optarg, "interrupt interval", 1, 1 << 20);
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'h':
+			help();
+			exit(EXIT_SUCCESS);
+		case 'V':
+			puts("firewire-iso-send version " PACKAGE_VERSION);
+			exit(EXIT_SUCCESS);
+		default:
+		syntax_error:
+			help();
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (optind >= argc)
+		goto syntax_error;
+	device_name = fw_resolve_device_name(argv[optind++]);
+
+	if (optind >= argc)
+		goto syntax_error;
+	channel = parse_number(argv[optind++], "channel", 0, 63);
+
+	if (optind < argc)
+		input_name = argv[optind++];
+
+	if (optind < argc) {
+		fprintf(stderr, "superfluous parameter: `%s'\n", argv[optind]);
+		goto syntax_error;
+	}
+
+	if (payload > speed->max_payload) {
+		fprintf(stderr, "payload size too big for %s\n", speed->name);
+		exit(EXIT_FAILURE);
+	}
+	if (rate > (unsigned long long)payload * CYCLES_PER_SECOND) {
+		fputs("data rate too high for this payload size\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if (pattern && input_name) {
+		fputs("cannot send both a file and a test pattern\n", stderr);
+		goto syntax_error;
+	}
+	if (irq_interval > queue_cycles / 4)
+		irq_interval = queue_cycles / 4;
+}
+
+static void open_device(void)
+{
+	if (fw_device_open(&device, device_name) < 0) {
+		perror(device_name);
+		exit(EXIT_FAILURE);
+	}
+	if (device.version < 3) {
+		fputs("this kernel is too old\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void open_input(void)
+{
+	if (pattern)
+		return;
+	if (!input_name || !strcmp(input_name, "-")) {
+		in_fd = STDIN_FILENO;
+		return;
+	}
+	in_fd = open(input_name, O_RDONLY);
+	if (in_fd == -1) {
+		perror(input_name);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void create_context(void)
+{
+	struct fw_cdev_create_iso_context create;
+
+	create.type = FW_CDEV_ISO_CONTEXT_TRANSMIT;
+	create.header_size = 0;
+	create.channel = channel;
+	create.speed = speed->code;
+	create.closure = 0;
+	if (ioctl(device.fd, FW_CDEV_IOC_CREATE_ISO_CONTEXT, &create) < 0) {
+		perror("CREATE_ISO_CONTEXT ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	iso_handle = create.handle;
+
+	n_slots = queue_cycles;
+	buffer_size = (size_t)n_slots * payload;
+	buffer_size = (buffer_size + getpagesize() - 1) & ~(size_t)(getpagesize() - 1);
+	buffer = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE, MAP_SHARED, device.fd, 0);
+	if (buffer == MAP_FAILED) {
+		perror("mmap failed");
+		exit(EXIT_FAILURE);
+	}
+
+	cycle_has_packet = malloc(queue_cycles);
+	batch = malloc(queue_cycles * sizeof(*batch));
+	if (!cycle_has_packet || !batch) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void fill_pattern(unsigned int slot, unsigned int count)
+{
+	u32 *p = (u32 *)(buffer + (size_t)slot * payload);
+	unsigned int i, q;
+
+	/* each quadlet holds the packet number and the quadlet index */
+	for (i = 0; i < count; ++i)
+		for (q = 0; q < payload / 4; ++q)
+			*p++ = __cpu_to_be32((u32)(stats.produced + i) << 12 | (q & 0xfff));
+}
+
+/*
+ * Reads as many packets as fit into the free slots up to the end of the
+ * ring directly into the DMA buffer.
+ */
+static void produce(void)
+{
+	unsigned int first, count;
+	size_t want, got;
+	ssize_t r;
+
+	if (ready_slots || end_of_data)
+		return;
+	first = queue_slot;
+	count = n_slots - inflight_slots;
+	if (count > n_slots - first)
+		count = n_slots - first;
+	if (max_packets && count > max_packets - stats.produced)
+		count = max_packets - stats.produced;
+	if (count == 0)
+		return;
+
+	if (pattern) {
+		fill_pattern(first, count);
+		got = (size_t)count * payload;
+	} else {
+		want = (size_t)count * payload;
+		for (got = 0; got < want; got += r) {
+			r = read(in_fd, buffer + (size_t)first * payload + got, want - got);
+			if (r < 0) {
+				if (errno == EINTR)
+					continue;
+				perror(input_name ? input_name : "stdin");
+				exit(EXIT_FAILURE);
+			}
+			if (r == 0) {
+				end_of_data = true;
+				break;
+			}
+		}
+	}
+
+	ready_slots = (got + payload - 1) / payload;
+	last_length = got % payload ? got % payload : payload;
+	stats.produced += ready_slots;
+	if (max_packets && stats.produced >= max_packets)
+		end_of_data = true;
+}
+
+/* Bresenham-like pacing: a cycle is due to send when the rate is behind. */
+static bool packet_due(void)
+{
+	return !rate || pace + rate >= (unsigned long long)payload * CYCLES_PER_SECOND;
+}
+
+static void advance_pace(bool has_packet)
+{
+	pace += rate;
+	if (rate && has_packet)
+		pace -= (unsigned long long)payload * CYCLES_PER_SECOND;
+}
+
+static void queue_batch(unsigned int count, unsigned int data_slot)
+{
+	struct fw_cdev_queue_iso queue_iso;
+
+	queue_iso.packets = ptr_to_u64(batch);
+	queue_iso.data = ptr_to_u64(buffer + (size_t)data_slot * payload);
+	queue_iso.size = count * sizeof(*batch);
+	queue_iso.handle = iso_handle;
+	if (ioctl(device.fd, FW_CDEV_IOC_QUEUE_ISO, &queue_iso) < 0) {
+		perror("QUEUE_ISO ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	if (queue_iso.size != 0) {
+		fputs("DMA queue is full; use a shorter queue\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ * Tops up the queue to queue_cycles.  A skipped cycle costs only a
+ * descriptor, so the queue always covers the same amount of time.
+ */
+static void refill(void)
+{
+	unsigned int count = 0, data_slot = queue_slot;
+	unsigned int length;
+	bool has_packet;
+	u32 control;
+
+	if (stop)
+		return;
+	produce();
+	while (queued_cycles < queue_cycles) {
+		has_packet = packet_due();
+		if (has_packet && !ready_slots)
+			break;
+		advance_pace(has_packet);
+
+		++total_cycles;
+		control = total_cycles % irq_interval == 0 ? FW_CDEV_ISO_INTERRUPT : 0;
+		if (has_packet) {
+			length = ready_slots == 1 ? last_length : payload;
+			control |= FW_CDEV_ISO_PAYLOAD_LENGTH(length) |
+				   FW_CDEV_ISO_TAG(tag) | FW_CDEV_ISO_SY(sy);
+			/* the last packet must report its completion */
+			if (ready_slots == 1 && end_of_data)
+				control |= FW_CDEV_ISO_INTERRUPT;
+			--ready_slots;
+			++inflight_slots;
+			queue_slot = (queue_slot + 1) % n_slots;
+		} else {
+			control |= FW_CDEV_ISO_SKIP;
+		}
+		batch[count++].control = control;
+		cycle_has_packet[(cycle_head + queued_cycles++) % queue_cycles] = has_packet;
+
+		if (has_packet && queue_slot == 0) {
+			/* the data of one QUEUE_ISO must be contiguous */
+			queue_batch(count, data_slot);
+			count = 0;
+			data_slot = 0;
+		}
+		if (!ready_slots) {
+			produce();
+			if (!ready_slots && end_of_data)
+				break;
+		}
+	}
+	if (count > 0)
+		queue_batch(count, data_slot);
+}
+
+static int cycle_of_timestamp(u32 timestamp)
+{
+	return ((timestamp >> 13) & 7) * CYCLES_PER_SECOND + (timestamp & 0x1fff);
+}
+
+/*
+ * Accounts for the cycles reported by one interrupt: every queued cycle
+ * takes exactly one bus cycle, so any gap between consecutive timestamps
+ * means that the controller ran late.
+ */
+static void handle_completions(const u32 *headers, unsigned int count)
+{
+	unsigned int i;
+	u32 header;
+	int cycle, gap;
+
+	for (i = 0; i < count && queued_cycles > 0; ++i) {
+		header = __be32_to_cpu(headers[i]);
+		cycle = cycle_of_timestamp(header);
+		if (stats.last_cycle >= 0) {
+			gap = (cycle - stats.last_cycle + CYCLES_PER_WRAP) % CYCLES_PER_WRAP;
+			if (gap > 1)
+				stats.late_cycles += gap - 1;
+		} else if (start_cycle >= 0) {
+			gap = (cycle - start_cycle + START_CYCLES) % START_CYCLES;
+			if (gap < START_CYCLES / 2)
+				stats.late_cycles += gap;
+		}
+		stats.last_cycle = cycle;
+		if (((header >> 16) & 0x1f) == EVT_UNDERRUN)
+			++stats.underruns;
+
+		if (cycle_has_packet[cycle_head]) {
+			--inflight_slots;
+			++stats.packets;
+		}
+		cycle_head = (cycle_head + 1) % queue_cycles;
+		--queued_cycles;
+	}
+}
+
+static u32 current_cycle(void)
+{
+	struct fw_cdev_get_cycle_timer2 cycle_timer;
+	u32 seconds, count;
+
+	cycle_timer.clk_id = CLOCK_MONOTONIC;
+	if (ioctl(device.fd, FW_CDEV_IOC_GET_CYCLE_TIMER2, &cycle_timer) < 0) {
+		perror("GET_CYCLE_TIMER2 ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	seconds = cycle_timer.cycle_timer >> 25;
+	count = (cycle_timer.cycle_timer >> 12) & 0x1fff;
+	return (seconds % 4) * CYCLES_PER_SECOND + count;
+}
+
+static double seconds_since(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) * 1e-9;
+}
+
+static void print_summary(void)
+{
+	double secs = seconds_since(&stats.start);
+
+	stats.bytes = stats.packets * payload;
+	if (stats.packets && end_of_data && queued_cycles == 0)
+		stats.bytes -= payload - last_length;
+	fprintf(stderr, "packets: %llu, bytes: %llu, late cycles: %llu",
+		stats.packets, stats.bytes, stats.late_cycles);
+	if (stats.underruns)
+		fprintf(stderr, ", underruns: %llu", stats.underruns);
+	fprintf(stderr, "\ntime: %.3f s, throughput: %.1f kB/s\n",
+		secs, secs > 0 ? stats.bytes / secs / 1000.0 : 0.0);
+}
+
+static void stop_signal(int signum)
+{
+	stop = true;
+}
+
+static void transmit(void)
+{
+	struct fw_cdev_start_iso start_iso;
+	struct fw_cdev_stop_iso stop_iso;
+	struct sigaction sa;
+	struct pollfd pfd;
+	size_t event_size;
+	union fw_cdev_event *event;
+	struct timespec last_report;
+	unsigned long long last_packets = 0;
+	int ready;
+	ssize_t r;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	event_size = sizeof(struct fw_cdev_event_iso_interrupt) + queue_cycles * 4;
+	event = malloc(event_size);
+	if (!event) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	refill();
+	if (queued_cycles == 0) {
+		fputs("no data to send\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	if (start_offset >= 0)
+		start_cycle = (current_cycle() + start_offset) % START_CYCLES;
+	start_iso.cycle = start_cycle < 0 ? -1 :
+		(start_cycle / CYCLES_PER_SECOND) << 13 | start_cycle % CYCLES_PER_SECOND;
+	start_iso.sync = 0;
+	start_iso.tags = 0;
+	start_iso.handle = iso_handle;
+	if (ioctl(device.fd, FW_CDEV_IOC_START_ISO, &start_iso) < 0) {
+		perror("START_ISO ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stats.start);
+	last_report = stats.start;
+
+	pfd.fd = device.fd;
+	pfd.events = POLLIN;
+	while (!stop && queued_cycles > 0) {
+		if (duration && seconds_since(&stats.start) >= duration)
+			break;
+		if (verbose && seconds_since(&last_report) >= 1.0) {
+			fprintf(stderr, "%llu packets, %.1f kB/s, %llu late cycles\n",
+				stats.packets,
+				(stats.packets - last_packets) * payload /
+				seconds_since(&last_report) / 1000.0,
+				stats.late_cycles);
+			clock_gettime(CLOCK_MONOTONIC, &last_report);
+			last_packets = stats.packets;
+		}
+		ready = poll(&pfd, 1, 1000);
+		if (ready < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll failed");
+			exit(EXIT_FAILURE);
+		}
+		if (!ready)
+			continue;
+		r = read(device.fd, event, event_size);
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < (ssize_t)sizeof(struct fw_cdev_event_common)) {
+			fputs("short read\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		if (event->common.type == FW_CDEV_EVENT_ISO_INTERRUPT) {
+			handle_completions(event->iso_interrupt.header,
+					   event->iso_interrupt.header_length / 4);
+			refill();
+		}
+	}
+
+	stop_iso.handle = iso_handle;
+	if (ioctl(device.fd, FW_CDEV_IOC_STOP_ISO, &stop_iso) < 0) {
+		perror("STOP_ISO ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	free(event);
+}
+
+int main(int argc, char *argv[])
+{
+	parse_parameters(argc, argv);
+	open_device();
+	open_input();
+	create_context();
+	transmit();
+	print_summary();
+	munmap(buffer, buffer_size);
+	fw_device_close(&device);
+	if (in_fd > STDIN_FILENO)
+		close(in_fd);
+	return 0;
+}
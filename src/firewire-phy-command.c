@@ -22,6 +22,7 @@
 #include <sys/ioctl.h>
 #include <linux/firewire-cdev.h>
 #include <linux/firewire-constants.h>
+#include "fwutils.h"
 
 #ifndef FW_CDEV_IOC_SEND_PHY_PACKET
 #error kernel headers too old
@@ -29,27 +30,28 @@
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof *(a))
 
-#define ptr_to_u64(p) ((uintptr_t)(p))
-
 typedef __u8 u8;
 typedef __u32 u32;
 typedef __u64 u64;
 
-struct node {
-	struct node *next;
-	char *name;
-	int fd;
-	u32 card;
-	u32 id;
-	u32 generation;
-	bool is_local;
+#define SYSFS_DEVICES	"/sys/bus/firewire/devices"
+
+/* the response to a PHY packet that is waited for */
+struct reply {
+	u32 mask;
+	u32 bits;
+	bool pending;
+	u32 quadlet;
+	unsigned int self_id_count;
 };
 
-static struct node *nodes;
-static struct node *local_node;
+static struct fw_device *local_node;
 static u32 param_node_id;
 static u32 ping_time;
 static u32 self_ids[3];
+static bool use_daemon;
+static int daemon_sock = -1;
+static u32 daemon_bus = FW_DAEMON_ANY_CARD;
 
 static void help(void)
 {
@@ -64,6 +66,8 @@ static void help(void)
 	      "  reset\n"
 	      "Options:\n"
 	      " -b, --bus=node  bus to send packet on\n"
+	      " -d, --daemon    send the packet through firewire-daemon\n"
+	      " -t, --timing    print where the time went to stderr\n"
 	      " -h, --help      show this message and exit\n"
 	      " -V, --version   show version number and exit\n"
 	      "\n"
@@ -72,171 +76,295 @@ static void help(void)
 	      stderr);
 }
 
-static int fw_filter(const struct dirent *dirent)
+/* returns -1 if the kernel does not tell */
+static int sysfs_is_local(const char *dev)
 {
-	unsigned int i;
+	char *path;
+	FILE *f;
+	int c;
 
-	if (dirent->d_name[0] != 'f' ||
-	    dirent->d_name[1] != 'w')
-		return false;
-	i = 2;
-	do {
-		if (!isdigit(dirent->d_name[i]))
-			return false;
-	} while (dirent->d_name[++i]);
-	return true;
+	if (asprintf(&path, SYSFS_DEVICES "/%s/is_local", dev) < 0)
+		return -1;
+	f = fopen(path, "r");
+	free(path);
+	if (!f)
+		return -1;
+	c = fgetc(f);
+	fclose(f);
+	return c == '1' ? 1 : c == '0' ? 0 : -1;
+}
+
+/* all nodes of one card are children of the controller's device */
+static char *sysfs_card_path(const char *dev)
+{
+	char *path, *card_path;
+
+	if (asprintf(&path, SYSFS_DEVICES "/%s/..", dev) < 0)
+		return NULL;
+	card_path = realpath(path, NULL);
+	free(path);
+	return card_path;
+}
+
+/* the fwN part of /dev/fwN, if it has one */
+static const char *dev_base_name(const char *name)
+{
+	struct dirent dirent;
+
+	if (strncmp(name, "/dev/", 5) || strlen(name + 5) >= sizeof(dirent.d_name))
+		return NULL;
+	strcpy(dirent.d_name, name + 5);
+	return fw_device_filter(&dirent) ? name + 5 : NULL;
+}
+
+static void close_node(struct fw_device *node)
+{
+	fw_device_close(node);
+	free(node);
+}
+
+static void close_local_node(void)
+{
+	if (!local_node)
+		return;
+	close_node(local_node);
+	local_node = NULL;
 }
 
-static void open_all_nodes(void)
+/* returns NULL if the device is not a local node */
+static struct fw_device *open_local_node(const char *dev, bool *eacces)
+{
+	struct fw_device *node;
+	char *name;
+	int r;
+
+	node = malloc(sizeof(*node));
+	if (!node) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if (asprintf(&name, "/dev/%s", dev) < 0) {
+		perror("asprintf failed");
+		exit(EXIT_FAILURE);
+	}
+	r = fw_device_open(node, name);
+	free(name);
+	if (r < 0) {
+		if (errno == EACCES)
+			*eacces = true;
+		free(node);
+		return NULL;
+	}
+	if (!fw_device_is_local(node)) {
+		close_node(node);
+		return NULL;
+	}
+	return node;
+}
+
+/*
+ * Looks through the nodes in sysfs, and opens only the local node of the
+ * wanted card (or the first one).  Without sysfs, or if it does not say
+ * which nodes are local, the device files themselves must be asked.
+ */
+static void select_local_node(int bus_card, const char *card_path)
 {
 	struct dirent **ents;
+	struct fw_device *node = NULL;
+	bool eacces = false, from_sysfs = true;
+	char *path;
 	int count, i;
-	struct node *node;
-	struct fw_cdev_get_info get_info;
-	struct fw_cdev_event_bus_reset bus_reset;
-	bool eacces = false;
 
-	count = scandir("/dev", &ents, fw_filter, versionsort);
+	count = fw_scan_devices(SYSFS_DEVICES, &ents);
+	if (count < 0) {
+		from_sysfs = false;
+		count = fw_scan_devices("/dev", &ents);
+	}
 	if (count < 0) {
 		perror("cannot read /dev");
 		exit(EXIT_FAILURE);
 	}
 
-	for (i = count - 1; i >= 0; --i) {
-		node = malloc(sizeof(*node));
-		if (!node) {
-			fputs("out of memory\n", stderr);
-			exit(EXIT_FAILURE);
-		}
-
-		if (asprintf(&node->name, "/dev/%s", ents[i]->d_name) < 0) {
-			perror("asprintf failed");
-			exit(EXIT_FAILURE);
-		}
-		node->fd = open(node->name, O_RDWR);
-		if (node->fd == -1) {
-			if (errno == EACCES)
-				eacces = true;
-			free(node->name);
-			free(node);
-			continue;
+	for (i = 0; i < count; ++i) {
+		if (node || (from_sysfs && sysfs_is_local(ents[i]->d_name) == 0))
+			goto next;
+		if (card_path && from_sysfs) {
+			path = sysfs_card_path(ents[i]->d_name);
+			if (!path || strcmp(path, card_path)) {
+				free(path);
+				goto next;
+			}
+			free(path);
 		}
-
-		get_info.version = 4;
-		get_info.rom_length = 0;
-		get_info.rom = 0;
-		get_info.bus_reset = ptr_to_u64(&bus_reset);
-		get_info.bus_reset_closure = 0;
-		if (ioctl(node->fd, FW_CDEV_IOC_GET_INFO, &get_info) < 0) {
-			close(node->fd);
-			free(node->name);
-			free(node);
-			continue;
+		node = open_local_node(ents[i]->d_name, &eacces);
+		if (node && bus_card != -1 && node->card != bus_card) {
+			close_node(node);
+			node = NULL;
 		}
-		node->card = get_info.card;
-		node->id = bus_reset.node_id;
-		node->generation = bus_reset.generation;
-		node->is_local = bus_reset.node_id == bus_reset.local_node_id;
-
-		node->next = nodes;
-		nodes = node;
+	next:
 		free(ents[i]);
 	}
 	free(ents);
 
-	if (!nodes) {
-		if (eacces) {
-			errno = EACCES;
-			perror("/dev/fw*");
-		} else {
-			fputs("no fw devices found\n", stderr);
+	if (node) {
+		close_local_node();
+		local_node = node;
+		return;
+	}
+	if (eacces) {
+		errno = EACCES;
+		perror("/dev/fw*");
+	} else if (!count) {
+		fputs("no fw devices found\n", stderr);
+	} else if (bus_card == -1 && !card_path) {
+		fputs("local node not found\n", stderr);
+	} else if (bus_card == -1) {
+		fprintf(stderr, "local node for %s not found\n", card_path);
+	} else {
+		fprintf(stderr, "local node for card %d not found\n", bus_card);
+	}
+	exit(EXIT_FAILURE);
+}
+
+/* returns the card index, and the node ID in *id */
+static u32 get_node_card(const char *name, u32 *id)
+{
+	struct fw_device dev;
+
+	if (fw_device_open(&dev, name) < 0) {
+		if (errno == ENOTTY || errno == EINVAL)
+			fprintf(stderr, "%s: not a fw device\n", name);
+		else
+			perror(name);
+		exit(EXIT_FAILURE);
+	}
+	fw_device_close(&dev);
+	if (id)
+		*id = dev.bus.node_id;
+	return dev.card;
+}
+
+/* exits if the daemon could not do the request at all */
+static struct fw_daemon_reply *daemon_call(struct fw_daemon_request *request,
+					   const void *data, unsigned int length)
+{
+	struct fw_daemon_reply *reply;
+
+	if (daemon_sock == -1) {
+		daemon_sock = fw_daemon_connect();
+		if (daemon_sock < 0) {
+			perror("cannot connect to firewire-daemon");
+			exit(EXIT_FAILURE);
 		}
+	}
+	reply = fw_daemon_call(daemon_sock, request, data, length);
+	if (!reply) {
+		perror("firewire-daemon");
+		exit(EXIT_FAILURE);
+	}
+	if (reply->error) {
+		fprintf(stderr, "firewire-daemon: %s\n", strerror(reply->error));
 		exit(EXIT_FAILURE);
 	}
+	return reply;
 }
 
-static void close_all_nodes(void)
+static void daemon_bus_info(u32 device, struct fw_daemon_bus_info *info)
 {
-	struct node *node, *next;
+	struct fw_daemon_request request = {
+		.type = FW_DAEMON_BUS_INFO,
+		.device = device,
+	};
+	struct fw_daemon_reply *reply;
 
-	for (node = nodes; node; node = next) {
-		close(node->fd);
-		free(node->name);
-		next = node->next;
-		free(node);
+	reply = daemon_call(&request, NULL, 0);
+	memcpy(info, reply->data, sizeof(*info));
+	free(reply);
+}
+
+/* the daemon sends PHY packets through the local node of the device's card */
+static u32 daemon_device(const char *name)
+{
+	int number;
+
+	number = fw_device_number(name);
+	if (number < 0) {
+		fprintf(stderr, "%s: not a /dev/fwN device\n", name);
+		exit(EXIT_FAILURE);
 	}
+	return number;
 }
 
-static void find_local_node(const char *bus_name)
+static void daemon_find_bus(const char *bus_name)
 {
-	int bus_card;
+	struct fw_daemon_bus_info info;
 	char *endptr;
-	int fd;
-	struct fw_cdev_get_info get_info;
-	struct node *node;
-
-	if (bus_name) {
-		bus_card = strtol(bus_name, &endptr, 0);
-		if (!*endptr) {
-			if (bus_card < 0) {
-				fputs("invalid bus number\n", stderr);
-				exit(EXIT_FAILURE);
-			}
-		} else {
-			bus_card = -1;
-			for (node = nodes; node; node = node->next)
-				if (!strcmp(node->name, bus_name)) {
-					bus_card = node->card;
-					break;
-				}
-			if (bus_card < 0) {
-				fd = open(bus_name, O_RDWR);
-				if (fd == -1) {
-					perror(bus_name);
-					exit(EXIT_FAILURE);
-				}
-				get_info.version = 4;
-				get_info.rom_length = 0;
-				get_info.rom = 0;
-				get_info.bus_reset = 0;
-				get_info.bus_reset_closure = 0;
-				if (ioctl(fd, FW_CDEV_IOC_GET_INFO, &get_info) < 0) {
-					fprintf(stderr, "%s: not a fw device\n", bus_name);
-					exit(EXIT_FAILURE);
-				}
-				close(fd);
-				bus_card = get_info.card;
-			}
+	int bus_card;
+
+	if (!bus_name)
+		return;
+	bus_name = fw_resolve_device_name(bus_name);
+	bus_card = strtol(bus_name, &endptr, 0);
+	if (!*endptr) {
+		if (bus_card < 0) {
+			fputs("invalid bus number\n", stderr);
+			exit(EXIT_FAILURE);
 		}
+		daemon_bus = FW_DAEMON_CARD(bus_card);
 	} else {
-		bus_card = -1;
+		daemon_bus = daemon_device(bus_name);
+	}
+	/* fails early if there is no such bus */
+	daemon_bus_info(daemon_bus, &info);
+}
+
+static void find_local_node(const char *bus_name)
+{
+	int bus_card;
+	char *endptr, *card_path;
+	const char *dev;
+
+	if (use_daemon) {
+		daemon_find_bus(bus_name);
+		return;
+	}
+	if (!bus_name) {
+		if (!local_node)
+			select_local_node(-1, NULL);
+		return;
 	}
 
-	for (node = nodes; node; node = node->next) {
-		if (node->is_local &&
-		    (bus_card == -1 || node->card == bus_card)) {
-			local_node = node;
-			return;
+	bus_name = fw_resolve_device_name(bus_name);
+	bus_card = strtol(bus_name, &endptr, 0);
+	if (!*endptr) {
+		if (bus_card < 0) {
+			fputs("invalid bus number\n", stderr);
+			exit(EXIT_FAILURE);
 		}
+		if (!local_node || local_node->card != bus_card)
+			select_local_node(bus_card, NULL);
+		return;
 	}
 
-	if (bus_card == -1)
-		fputs("local node not found\n", stderr);
-	else
-		fprintf(stderr, "local node for card %d not found\n", bus_card);
-	exit(EXIT_FAILURE);
+	if (local_node && !strcmp(local_node->name, bus_name))
+		return;
+	dev = dev_base_name(bus_name);
+	card_path = dev ? sysfs_card_path(dev) : NULL;
+	if (card_path) {
+		select_local_node(-1, card_path);
+		free(card_path);
+	} else {
+		select_local_node(get_node_card(bus_name, NULL), NULL);
+	}
 }
 
 static void find_param_node(const char *name)
 {
 	int id;
 	char *endptr;
-	struct node *node;
-	int fd;
-	struct fw_cdev_get_info get_info;
-	struct fw_cdev_event_bus_reset bus_reset;
-	char card_str[16];
+	u32 node_id, card;
 
+	name = fw_resolve_device_name(name);
 	id = strtol(name, &endptr, 0);
 	if (!*endptr) {
 		if (id < 0 || id > 63) {
@@ -247,107 +375,138 @@ static void find_param_node(const char *name)
 		return;
 	}
 
-	for (node = nodes; node; node = node->next)
-		if (!strcmp(node->name, name)) {
-			param_node_id = node->id & 0x3f;
-			sprintf(card_str, "%u", node->card);
-			find_local_node(card_str);
-			return;
-		}
+	if (use_daemon) {
+		struct fw_daemon_bus_info info;
 
-	fd = open(name, O_RDWR);
-	if (fd == -1) {
-		perror(name);
+		daemon_bus_info(daemon_device(name), &info);
+		param_node_id = info.node_id & 0x3f;
+		daemon_bus = FW_DAEMON_CARD(info.card);
+		return;
+	}
+
+	/* the node ID is known only to the node's own device file */
+	card = get_node_card(name, &node_id);
+	param_node_id = node_id & 0x3f;
+	if (!local_node || local_node->card != card)
+		select_local_node(card, NULL);
+}
+
+static void packet_sent(struct fw_device *dev, int rcode,
+			const void *data, unsigned int length, void *arg)
+{
+	bool *sent = arg;
+
+	*sent = true;
+	if (length >= 4)
+		ping_time = *(const u32 *)data;
+}
+
+static void packet_received(struct fw_device *dev,
+			    const union fw_cdev_event *event, void *arg)
+{
+	struct reply *reply = arg;
+	u32 quadlet;
+
+	if (event->common.type != FW_CDEV_EVENT_PHY_PACKET_RECEIVED || !reply->pending)
+		return;
+	quadlet = event->phy_packet.data[0];
+	if ((quadlet & reply->mask) != reply->bits)
+		return;
+	reply->quadlet = quadlet;
+	if ((quadlet & 0xc0000000) == 0x80000000) {
+		self_ids[reply->self_id_count++] = quadlet;
+		if (reply->self_id_count >= ARRAY_SIZE(self_ids) || !(quadlet & 1))
+			reply->pending = false;
+	} else {
+		reply->pending = false;
+	}
+}
+
+static void bus_reset(struct fw_device *dev, void *arg)
+{
+	fputs("bus reset\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+/* the daemon collects the matching packets, and reports a bus reset as an rcode */
+static u32 daemon_send_packet(u32 quadlet0, u32 quadlet1, u32 response_mask, u32 response_bits)
+{
+	struct fw_daemon_request request = {
+		.type = FW_DAEMON_PHY,
+		.device = daemon_bus,
+		.mask = response_mask,
+		.bits = response_bits,
+	};
+	u32 quadlets[2] = { quadlet0, quadlet1 };
+	struct fw_daemon_reply *reply;
+	unsigned int count, i;
+	u32 quadlet = 0;
+
+	reply = daemon_call(&request, quadlets, sizeof(quadlets));
+	if (reply->rcode == FW_RCODE_TIMEOUT) {
+		fputs("timeout\n", stderr);
 		exit(EXIT_FAILURE);
 	}
-	get_info.version = 4;
-	get_info.rom_length = 0;
-	get_info.rom = 0;
-	get_info.bus_reset = ptr_to_u64(&bus_reset);
-	get_info.bus_reset_closure = 0;
-	if (ioctl(fd, FW_CDEV_IOC_GET_INFO, &get_info) < 0) {
-		fprintf(stderr, "%s: not a fw device\n", name);
+	if (reply->rcode == RCODE_GENERATION) {
+		fputs("bus reset\n", stderr);
 		exit(EXIT_FAILURE);
 	}
-	close(fd);
-	param_node_id = bus_reset.node_id & 0x3f;
-	sprintf(card_str, "%u", get_info.card);
-	find_local_node(card_str);
+	ping_time = reply->value;
+	count = (reply->length - sizeof(*reply)) / 4;
+	for (i = 0; i < count; ++i) {
+		quadlet = reply->data[i];
+		if ((quadlet & 0xc0000000) == 0x80000000 && i < ARRAY_SIZE(self_ids))
+			self_ids[i] = quadlet;
+	}
+	free(reply);
+	return quadlet;
 }
 
 static u32 _send_packet(u32 quadlet0, u32 quadlet1, u32 response_mask, u32 response_bits)
 {
-	struct fw_cdev_receive_phy_packets receive_phy_packets;
-	struct fw_cdev_send_phy_packet send_phy_packet;
-	struct pollfd pollfd;
-	int poll_result;
-	ssize_t bytes;
-	union fw_cdev_event event;
-	bool wait_for_sent = true;
-	bool wait_for_response = response_mask != 0;
-	unsigned int self_id_index = 0;
-	u32 response = 0;
-
-	if (wait_for_response) {
-		receive_phy_packets.closure = 0;
-		if (ioctl(local_node->fd, FW_CDEV_IOC_RECEIVE_PHY_PACKETS, &receive_phy_packets) < 0) {
-			perror("RECEIVE_PHY_PACKETS ioctl failed");
-			exit(EXIT_FAILURE);
-		}
+	struct fw_engine *engine;
+	struct reply reply = {
+		.mask = response_mask,
+		.bits = response_bits,
+		.pending = response_mask != 0,
+	};
+	bool sent = false;
+	int ready;
+
+	if (use_daemon)
+		return daemon_send_packet(quadlet0, quadlet1, response_mask, response_bits);
+	engine = fw_engine_new();
+	if (!engine || fw_engine_add_device(engine, local_node) < 0) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
 	}
+	fw_engine_set_event_handler(engine, packet_received, &reply);
+	fw_engine_set_reset_handler(engine, bus_reset, NULL);
 
-	send_phy_packet.closure = 0;
-	send_phy_packet.data[0] = quadlet0;
-	send_phy_packet.data[1] = quadlet1;
-	send_phy_packet.generation = local_node->generation;
-	if (ioctl(local_node->fd, FW_CDEV_IOC_SEND_PHY_PACKET, &send_phy_packet) < 0) {
+	if (reply.pending && fw_device_receive_phy_packets(local_node) < 0) {
+		perror("RECEIVE_PHY_PACKETS ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+	if (fw_submit_phy_packet(engine, local_node, quadlet0, quadlet1,
+				 packet_sent, &sent) < 0) {
 		perror("SEND_PHY_PACKET ioctl failed");
 		exit(EXIT_FAILURE);
 	}
 
-	pollfd.fd = local_node->fd;
-	pollfd.events = POLLIN;
-	while (wait_for_sent || wait_for_response) {
-		poll_result = poll(&pollfd, 1, 100);
-		if (poll_result < 0) {
-			perror("poll failed");
+	while (!sent || reply.pending) {
+		ready = fw_engine_dispatch(engine, 100);
+		if (ready < 0) {
+			perror("reading events failed");
 			exit(EXIT_FAILURE);
 		}
-		if (poll_result == 0) {
+		if (ready == 0) {
 			fputs("timeout\n", stderr);
 			exit(EXIT_FAILURE);
 		}
-		bytes = read(local_node->fd, &event, sizeof(event));
-		if (bytes < sizeof(struct fw_cdev_event_common)) {
-			fputs("short read\n", stderr);
-			exit(EXIT_FAILURE);
-		}
-		switch (event.common.type) {
-		case FW_CDEV_EVENT_BUS_RESET:
-			fputs("bus reset\n", stderr);
-			exit(EXIT_FAILURE);
-		case FW_CDEV_EVENT_PHY_PACKET_SENT:
-			wait_for_sent = false;
-			if (event.phy_packet.length >= 4)
-				ping_time = event.phy_packet.data[0];
-			break;
-		case FW_CDEV_EVENT_PHY_PACKET_RECEIVED:
-			if ((event.phy_packet.data[0] & response_mask) == response_bits) {
-				response = event.phy_packet.data[0];
-				if ((response & 0xc0000000) == 0x80000000) {
-					self_ids[self_id_index++] = response;
-					if (self_id_index >= ARRAY_SIZE(self_ids) ||
-					    !(response & 1))
-						wait_for_response = false;
-				} else {
-					wait_for_response = false;
-				}
-			}
-			break;
-		}
 	}
 
-	return response;
+	fw_engine_free(engine);
+	return reply.quadlet;
 }
 
 static u32 send_packet(u32 quadlet, u32 response_mask, u32 response_bits)
@@ -436,6 +595,7 @@ static void command_ping(char *args[])
 		[7] = "-3..-10W",
 	};
 	unsigned int i;
+	u64 t;
 
 	if (!args[0]) {
 		fputs("missing destination node\n", stderr);
@@ -453,6 +613,7 @@ syntax_error:
 	send_packet((0 << 18) | (param_node_id << 24),
 		    0xff000000,
 		    (2 << 30) | (param_node_id << 24));
+	t = fw_timing_begin();
 	printf("time: %u ticks (%llu ns)",
 	       ping_time, (ping_time * 1000000uLL + 12288u) / 24576u);
 	printf(", selfID: phy %u %s gc=%u %s %s%s%s [",
@@ -481,6 +642,7 @@ syntax_error:
 		}
 	}
 	puts("]");
+	fw_timing_end(FW_TIMING_PRINT, t);
 }
 
 static void command_read(char *args[])
@@ -489,6 +651,7 @@ static void command_read(char *args[])
 	char *endptr;
 	u32 packet;
 	u32 response;
+	u64 t;
 
 	if (!args[0]) {
 		fputs("missing destination node\n", stderr);
@@ -568,7 +731,9 @@ syntax_error:
 	packet |= (reg & 7) << 8;
 	packet |= param_node_id << 24;
 	response = send_packet(packet, 0xffffff00, packet | (2 << 18));
+	t = fw_timing_begin();
 	printf("value: 0x%02x\n", response & 0xff);
+	fw_timing_end(FW_TIMING_PRINT, t);
 }
 
 static void command_remote_cmd(char *args[], u32 cmd)
@@ -645,12 +810,22 @@ static void command_enable(char *args[])
 	command_remote_cmd(args, 5);
 }
 
+static u32 local_node_id(void)
+{
+	struct fw_daemon_bus_info info;
+
+	if (!use_daemon)
+		return local_node->bus.node_id;
+	daemon_bus_info(daemon_bus, &info);
+	return info.local_node_id;
+}
+
 static void command_resume(char *args[])
 {
 	if (args[0])
 		command_remote_cmd(args, 6);
 	else
-		send_packet((0xf << 18) | (local_node->id << 24), 0, 0);
+		send_packet((0xf << 18) | ((local_node_id() & 0x3f) << 24), 0, 0);
 }
 
 static void command_standby(char *args[])
@@ -725,6 +900,10 @@ static void command_reset(char *args[])
 		help();
 		exit(EXIT_FAILURE);
 	}
+	if (use_daemon) {
+		fputs("reset is not possible with --daemon\n", stderr);
+		exit(EXIT_FAILURE);
+	}
 
 	initiate_bus_reset.type = FW_CDEV_SHORT_RESET;
 	if (ioctl(local_node->fd, FW_CDEV_IOC_INITIATE_BUS_RESET, &initiate_bus_reset) < 0) {
@@ -735,9 +914,11 @@ static void command_reset(char *args[])
 
 int main(int argc, char *argv[])
 {
-	static const char short_options[] = "b:hV";
+	static const char short_options[] = "b:dthV";
 	static const struct option long_options[] = {
 		{ "bus", 1, NULL, 'b' },
+		{ "daemon", 0, NULL, 'd' },
+		{ "timing", 0, NULL, 't' },
 		{ "help", 0, NULL, 'h' },
 		{ "version", 0, NULL, 'V' },
 		{}
@@ -772,6 +953,12 @@ int main(int argc, char *argv[])
 		case 'b':
 			bus_name = optarg;
 			break;
+		case 'd':
+			use_daemon = true;
+			break;
+		case 't':
+			fw_timing_enable();
+			break;
 		case 'h':
 			help();
 			return 0;
@@ -791,10 +978,11 @@ int main(int argc, char *argv[])
 	}
 	for (i = 0; i < ARRAY_SIZE(commands); ++i)
 		if (!strcmp(commands[i].name, argv[optind])) {
-			open_all_nodes();
 			find_local_node(bus_name);
 			commands[i].fn(argv + optind + 1);
-			close_all_nodes();
+			close_local_node();
+			if (daemon_sock != -1)
+				close(daemon_sock);
 			return 0;
 		}
 
@@ -13,28 +13,52 @@
 #include <stdint.h>
 #include <string.h>
 #include <ctype.h>
+#include <errno.h>
 #include <dirent.h>
 #include <getopt.h>
 #include <unistd.h>
 #include <poll.h>
 #include <fcntl.h>
+#include <math.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <linux/firewire-cdev.h>
 #include <linux/firewire-constants.h>
 #include <asm/byteorder.h>
+#include "fwutils.h"
 
 #define FCP_COMMAND_ADDR	0xfffff0000b00uLL
 #define FCP_RESPONSE_ADDR	0xfffff0000d00uLL
+#define NODE_IDS_ADDR		0xfffff0000008uLL
+#define CYCLE_TIME_ADDR		0xfffff0000200uLL
+#define BANDWIDTH_AVAILABLE_ADDR	0xfffff0000220uLL
+#define CHANNELS_AVAILABLE_HI_ADDR	0xfffff0000224uLL
+#define CHANNELS_AVAILABLE_LO_ADDR	0xfffff0000228uLL
+#define TOPOLOGY_MAP_ADDR	0xfffff0001000uLL
+#define SPEED_MAP_ADDR		0xfffff0002000uLL
+
+#define BANDWIDTH_AVAILABLE_INITIAL	4915
+#define IRM_ATTEMPTS		8
+#define UPDATE_ATTEMPTS		32
+#define UPDATE_MAX_DELAY	65536	/* microseconds */
+#define LATENCY_BUCKETS		24	/* powers of two, in microseconds */
+#define CYCLE_TIMER_TICKS	(128 * 8000 * 3072uLL)
+#define MAP_CHUNK		512	/* bytes; the largest payload at S100 */
+#define MAP_ATTEMPTS		3
+#define MAX_NODES		63
+#define TOPOLOGY_CACHE_MAGIC	0x46575432	/* "FWT2"; change with struct topology */
 
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof *(a))
 
-#define ptr_to_u64(p) ((uintptr_t)(p))
-
 typedef __u8 u8;
+typedef __u16 u16;
 typedef __u32 u32;
 typedef __u64 u64;
+typedef __s64 s64;
 
 typedef void (*command_func)(void);
 
@@ -43,6 +67,61 @@ struct data {
 	u8 *data;
 };
 
+/* the response to a single request */
+struct response {
+	int rcode;
+	unsigned int length;
+	u32 data[4];
+};
+
+/* one request of a transfer that is split into several */
+struct chunk {
+	u8 *buf;		/* where to put read data, or NULL */
+	unsigned int length;
+	unsigned int received;
+	int rcode;
+};
+
+enum transfer_type {
+	TRANSFER_READ,
+	TRANSFER_WRITE,
+	TRANSFER_BROADCAST,
+};
+
+/* the decoded topology and speed maps, as stored in the cache */
+struct topology {
+	u32 magic;
+	u32 card;
+	u64 guid;		/* of the local node, as card indexes are reused */
+	u32 generation;		/* of the bus */
+	u32 map_generation;	/* of the topology map */
+	u32 map_node_id;	/* whose maps these are */
+	unsigned int node_count;
+	bool from_speed_map;
+	struct phy {
+		u8 parent;	/* 0x3f for the root */
+		u8 speed;
+		u8 gap_count;
+		bool link_active;
+		bool contender;
+		u8 port_count;
+		u8 ports[3 + 3 * 8];
+	} phys[MAX_NODES];
+	u8 speed[MAX_NODES][MAX_NODES];
+};
+
+struct benchmark_result {
+	unsigned long long operations;
+	unsigned long long transactions;
+	unsigned long long retries;
+	unsigned long long busy;
+	unsigned long long errors;
+	u64 latency_sum;
+	u64 latency_min;
+	u64 latency_max;
+	unsigned long long latency[LATENCY_BUCKETS];
+};
+
 static bool verbose;
 static const char *device_name;
 static u64 address;
@@ -50,364 +129,1767 @@ static unsigned int register_length;
 static unsigned int read_length;
 static struct data data;
 static struct data data2;
-static int fd;
-static u32 card_index;
-static u32 node_id;
-static u32 generation;
+static u64 iso_channels;
+static u32 iso_bandwidth;
+static u32 lock_tcode;
+static unsigned int benchmark_duration;
+static unsigned int benchmark_jobs = 1;
+static unsigned long sample_count = 1000;
+static unsigned long sample_rate = 1000;
+static struct fw_device device;
+static struct fw_engine *engine;
+static struct fw_device *irm;
+static unsigned int max_payload;
+static bool use_daemon;
+static int daemon_sock = -1;
+static u32 daemon_device;
+
+/* the daemon needs only the device number; the device file stays closed */
+static void connect_daemon(void)
+{
+	int number;
+
+	number = fw_device_number(device_name);
+	if (number < 0) {
+		fprintf(stderr, "%s: not a /dev/fwN device\n", device_name);
+		exit(EXIT_FAILURE);
+	}
+	daemon_device = number;
+	daemon_sock = fw_daemon_connect();
+	if (daemon_sock < 0) {
+		perror("cannot connect to firewire-daemon");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void open_device(void)
+{
+	device_name = fw_resolve_device_name(device_name);
+	if (use_daemon) {
+		connect_daemon();
+		return;
+	}
+	if (fw_device_open(&device, device_name) < 0) {
+		perror(device_name);
+		exit(EXIT_FAILURE);
+	}
+	engine = fw_engine_new();
+	if (!engine || fw_engine_add_device(engine, &device) < 0) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	/* a request that was not sent because of a bus reset is sent again */
+	fw_engine_set_retry_on_reset(engine, true);
+	max_payload = fw_device_max_payload(&device);
+}
+
+static void close_device(void)
+{
+	if (use_daemon) {
+		close(daemon_sock);
+		daemon_sock = -1;
+		return;
+	}
+	fw_device_close(&device);
+	fw_engine_free(engine);
+	engine = NULL;
+}
+
+static void submit_request(struct fw_device *dev, u32 tcode, u64 offset,
+			   const void *payload, unsigned int length,
+			   fw_response_func func, void *arg)
+{
+	if (fw_submit_request(engine, dev, tcode, offset, payload, length, func, arg) < 0) {
+		perror("SEND_REQUEST ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void run_engine(void)
+{
+	if (fw_engine_run(engine) < 0) {
+		perror("reading events failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void response_done(struct fw_device *dev, int rcode,
+			  const void *payload, unsigned int length, void *arg)
+{
+	struct response *response = arg;
+
+	response->rcode = rcode;
+	response->length = length < sizeof(response->data) ? length : sizeof(response->data);
+	memcpy(response->data, payload, response->length);
+}
+
+/* exits if the daemon could not do the request at all */
+static struct fw_daemon_reply *daemon_call(struct fw_daemon_request *request,
+					   const void *payload, unsigned int length)
+{
+	struct fw_daemon_reply *reply;
+
+	request->device = daemon_device;
+	reply = fw_daemon_call(daemon_sock, request, payload, length);
+	if (!reply) {
+		perror("firewire-daemon");
+		exit(EXIT_FAILURE);
+	}
+	if (reply->error) {
+		fprintf(stderr, "firewire-daemon: %s\n", strerror(reply->error));
+		exit(EXIT_FAILURE);
+	}
+	return reply;
+}
+
+static void daemon_send_request(u32 tcode, u64 offset,
+				const void *payload, unsigned int length,
+				struct response *response)
+{
+	struct fw_daemon_request request = { .offset = offset };
+	struct fw_daemon_reply *reply;
+	unsigned int reply_length;
+
+	switch (tcode) {
+	case TCODE_READ_QUADLET_REQUEST:
+	case TCODE_READ_BLOCK_REQUEST:
+		request.type = FW_DAEMON_READ;
+		request.read_length = length;
+		length = 0;
+		break;
+	case TCODE_WRITE_QUADLET_REQUEST:
+	case TCODE_WRITE_BLOCK_REQUEST:
+		request.type = FW_DAEMON_WRITE;
+		break;
+	default:
+		request.type = FW_DAEMON_LOCK;
+		request.tcode = tcode;
+		break;
+	}
+	reply = daemon_call(&request, payload, length);
+	reply_length = reply->length - sizeof(*reply);
+	response->rcode = reply->rcode;
+	response->length = reply_length < sizeof(response->data) ? reply_length
+								 : sizeof(response->data);
+	memcpy(response->data, reply->data, response->length);
+	free(reply);
+}
+
+/* sends one request, and waits for its response */
+static void send_request(struct fw_device *dev, u32 tcode, u64 offset,
+			 const void *payload, unsigned int length,
+			 struct response *response)
+{
+	if (use_daemon) {
+		daemon_send_request(tcode, offset, payload, length, response);
+		return;
+	}
+	submit_request(dev, tcode, offset, payload, length, response_done, response);
+	run_engine();
+}
+
+static void chunk_done(struct fw_device *dev, int rcode,
+		       const void *payload, unsigned int length, void *arg)
+{
+	struct chunk *chunk = arg;
+
+	chunk->rcode = rcode;
+	chunk->received = length < chunk->length ? length : chunk->length;
+	if (rcode == RCODE_COMPLETE && chunk->buf)
+		memcpy(chunk->buf, payload, chunk->received);
+}
+
+/*
+ * The daemon splits the transfer itself, and reports the part before the
+ * first error as one chunk, and the error as another one.
+ */
+static struct chunk *daemon_transfer(enum transfer_type type, u64 offset,
+				     u8 *buf, unsigned int length, unsigned int *count)
+{
+	struct fw_daemon_request request = { .offset = offset };
+	struct fw_daemon_reply *reply;
+	struct chunk *chunks;
+
+	if (type == TRANSFER_READ) {
+		request.type = FW_DAEMON_READ;
+		request.read_length = length;
+		reply = daemon_call(&request, NULL, 0);
+		memcpy(buf, reply->data, reply->value);
+	} else {
+		request.type = FW_DAEMON_WRITE;
+		reply = daemon_call(&request, buf, length);
+	}
+	chunks = calloc(2, sizeof(*chunks));
+	if (!chunks) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	chunks[0].length = reply->rcode == RCODE_COMPLETE ? length : reply->value;
+	chunks[0].received = reply->value;
+	chunks[0].rcode = RCODE_COMPLETE;
+	chunks[1].rcode = reply->rcode;
+	*count = reply->rcode == RCODE_COMPLETE ? 1 : 2;
+	free(reply);
+	return chunks;
+}
+
+/*
+ * Splits a transfer into requests of at most limit bytes.  The requests of
+ * a read are sent all at once; the engine keeps as many of them in flight
+ * as the kernel allows.  The requests of a write are sent one after the
+ * other, and the first failed one is the last chunk, so that the target
+ * never gets data after a gap.  Returns the chunks in the order of their
+ * offsets.
+ */
+static struct chunk *transfer(struct fw_device *dev, enum transfer_type type,
+			      u64 offset, u8 *buf, unsigned int length,
+			      unsigned int limit, unsigned int *count)
+{
+	struct chunk *chunks;
+	unsigned int i, done, tcode;
+	bool quadlet;
+
+	if (use_daemon)
+		return daemon_transfer(type, offset, buf, length, count);
+	*count = length ? (length + limit - 1) / limit : 1;
+	chunks = calloc(*count, sizeof(*chunks));
+	if (!chunks) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	done = 0;
+	for (i = 0; i < *count; ++i) {
+		chunks[i].length = length - done < limit ? length - done : limit;
+		quadlet = chunks[i].length == 4 && !((offset + done) & 3);
+		if (type == TRANSFER_READ) {
+			chunks[i].buf = buf + done;
+			tcode = quadlet ? TCODE_READ_QUADLET_REQUEST : TCODE_READ_BLOCK_REQUEST;
+			submit_request(dev, tcode, offset + done, NULL, chunks[i].length,
+				       chunk_done, &chunks[i]);
+		} else {
+			tcode = quadlet ? TCODE_WRITE_QUADLET_REQUEST : TCODE_WRITE_BLOCK_REQUEST;
+			if (type == TRANSFER_WRITE)
+				submit_request(dev, tcode, offset + done, buf + done,
+					       chunks[i].length, chunk_done, &chunks[i]);
+			else if (fw_submit_broadcast_request(engine, dev, tcode, offset + done,
+							     buf + done, chunks[i].length,
+							     chunk_done, &chunks[i]) < 0) {
+				perror("SEND_BROADCAST_REQUEST ioctl failed");
+				exit(EXIT_FAILURE);
+			}
+			run_engine();
+			if (chunks[i].rcode != RCODE_COMPLETE) {
+				*count = i + 1;
+				return chunks;
+			}
+		}
+		done += chunks[i].length;
+	}
+	if (type == TRANSFER_READ)
+		run_engine();
+	return chunks;
+}
+
+static void print_rcode(u32 rcode)
+{
+	const char *s;
+
+	switch (rcode) {
+	case RCODE_CONFLICT_ERROR:	s = "conflict error";	break;
+	case RCODE_DATA_ERROR:		s = "data error";	break;
+	case RCODE_TYPE_ERROR:		s = "type error";	break;
+	case RCODE_ADDRESS_ERROR:	s = "address error";	break;
+	case RCODE_SEND_ERROR:		s = "send error";	break;
+	case RCODE_CANCELLED:		s = "error: cancelled";	break;
+	case RCODE_BUSY:		s = "error: busy";	break;
+	case RCODE_GENERATION:		s = "error: bus reset";	break;
+	case RCODE_NO_ACK:		s = "error: no ack";	break;
+	default:			s = "unknown error";	break;
+	}
+	fprintf(stderr, "%s\n", s);
+}
+
+static void print_data(const char *prefix, const void *p, unsigned int length, bool allow_value)
+{
+	const u8 *data = p;
+	unsigned int line, col;
+	u64 t = fw_timing_begin();
+
+	if (allow_value) {
+		const u32 *data = p;
+		if (length == 4) {
+			printf("%s%08x\n", prefix, __be32_to_cpu(*data));
+			fw_timing_end(FW_TIMING_PRINT, t);
+			return;
+		}
+		if (length == 8) {
+			printf("%s%08x%08x\n", prefix, __be32_to_cpu(data[0]), __be32_to_cpu(data[1]));
+			fw_timing_end(FW_TIMING_PRINT, t);
+			return;
+		}
+	}
+
+	for (line = 0; line < ((length + 15) & ~15); line += 16) {
+		printf("%s%03x:", prefix, line);
+		for (col = line; col < line + 16 && col < length; ++col)
+			printf(" %02x", data[col]);
+		printf("%*s", 1 + (line + 16 - col) * 3, "");
+		for (col = line; col < line + 16 && col < length; ++col)
+			if (data[col] >= 32 && data[col] < 127)
+				putchar(data[col]);
+			else
+				putchar('.');
+		putchar('\n');
+	}
+	fw_timing_end(FW_TIMING_PRINT, t);
+}
+
+/*
+ * The local node's cycle_time and node_ids registers are known without
+ * asking the bus; the cycle timer then comes with the system time at
+ * which it was read.  Without GET_CYCLE_TIMER2 (before 2.6.34), the
+ * cycle_time register is read with a transaction.
+ */
+static bool read_local_register(void)
+{
+#ifdef FW_CDEV_IOC_GET_CYCLE_TIMER2
+	struct fw_cdev_get_cycle_timer2 ct;
+#endif
+	u32 value;
+
+	if (device.bus.node_id != device.bus.local_node_id || read_length != 4)
+		return false;
+	if (address == NODE_IDS_ADDR) {
+		value = device.bus.node_id << 16;
+#ifdef FW_CDEV_IOC_GET_CYCLE_TIMER2
+	} else if (address == CYCLE_TIME_ADDR) {
+		ct.clk_id = CLOCK_REALTIME;
+		if (ioctl(device.fd, FW_CDEV_IOC_GET_CYCLE_TIMER2, &ct) < 0)
+			return false;
+		value = ct.cycle_timer;
+		if (verbose)
+			printf("time: %lld.%09d\n", (long long)ct.tv_sec, ct.tv_nsec);
+#endif
+	} else {
+		return false;
+	}
+	printf("result: %08x\n", value);
+	return true;
+}
+
+/*
+ * Longer reads are split into requests that the node can handle.  The data
+ * ends at the first error or short response.
+ */
+static void do_read(void)
+{
+	struct chunk *chunks;
+	unsigned int count, done, i;
+	int rcode = RCODE_COMPLETE;
+	u8 *buf;
+
+	if (!use_daemon && read_local_register())
+		return;
+
+	buf = malloc(read_length ? read_length : 1);
+	if (!buf) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if (verbose && !use_daemon && read_length > max_payload)
+		printf("reading in requests of %u bytes\n", max_payload);
+	chunks = transfer(&device, TRANSFER_READ, address, buf, read_length, max_payload, &count);
+	done = 0;
+	for (i = 0; i < count; ++i) {
+		if (chunks[i].rcode != RCODE_COMPLETE) {
+			rcode = chunks[i].rcode;
+			if (done)
+				fprintf(stderr, "at offset %x: ", done);
+			print_rcode(rcode);
+			break;
+		}
+		done += chunks[i].received;
+		if (chunks[i].received < chunks[i].length)
+			break;
+	}
+	if (done || rcode == RCODE_COMPLETE)
+		print_data("result: ", buf, done, done == read_length);
+	free(chunks);
+	free(buf);
+}
+
+/*
+ * Longer writes are split into requests that the node can handle, and stop
+ * at the first error.
+ */
+static void do_write_request(enum transfer_type type)
+{
+	struct chunk *chunks;
+	unsigned int count, done, i, limit;
+
+	/* broadcasts go out at S100 */
+	limit = type == TRANSFER_BROADCAST ? 512 : max_payload;
+	if (verbose && !use_daemon && data.length > limit)
+		printf("writing in requests of %u bytes\n", limit);
+	chunks = transfer(&device, type, address, data.data, data.length, limit, &count);
+	done = 0;
+	for (i = 0; i < count; ++i) {
+		if (chunks[i].rcode != RCODE_COMPLETE) {
+			if (done)
+				fprintf(stderr, "at offset %x: ", done);
+			print_rcode(chunks[i].rcode);
+			break;
+		}
+		done += chunks[i].length;
+	}
+	free(chunks);
+}
+
+static void do_write(void)
+{
+	do_write_request(TRANSFER_WRITE);
+}
+
+static void do_broadcast(void)
+{
+	do_write_request(TRANSFER_BROADCAST);
+}
+
+/* returns the request payload for a lock transaction */
+static u8 *lock_request_data(u32 tcode, unsigned int *length)
+{
+	bool has_data2;
+	u8 *buf;
+
+	has_data2 = tcode != TCODE_LOCK_FETCH_ADD && tcode != TCODE_LOCK_LITTLE_ADD;
+	if ((data.length != 4 && data.length != 8) ||
+	    (has_data2 && (data2.length != 4 && data2.length != 8))) {
+		fputs("data size must be 32 or 64 bits\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if (has_data2 && data.length != data2.length) {
+		fputs("both data blocks must have the same size\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if (has_data2) {
+		buf = malloc(data.length * 2);
+		if (!buf) {
+			fputs("out of memory\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		memcpy(buf, data.data, data.length);
+		memcpy(buf + data.length, data2.data, data2.length);
+	} else
+		buf = data.data;
+	*length = has_data2 ? data.length * 2 : data.length;
+	return buf;
+}
+
+static void do_lock_request(u32 tcode)
+{
+	u8 *buf;
+	unsigned int length;
+	struct response response;
+
+	buf = lock_request_data(tcode, &length);
+	send_request(&device, tcode, address, buf, length, &response);
+	if (response.rcode != RCODE_COMPLETE)
+		print_rcode(response.rcode);
+	else
+		print_data("old: ", response.data, response.length, true);
+}
+
+static void do_mask_swap(void)
+{
+	do_lock_request(TCODE_LOCK_MASK_SWAP);
+}
+
+static void do_compare_swap(void)
+{
+	do_lock_request(TCODE_LOCK_COMPARE_SWAP);
+}
+
+static void do_add_big(void)
+{
+	do_lock_request(TCODE_LOCK_FETCH_ADD);
+}
+
+static void do_add_little(void)
+{
+	do_lock_request(TCODE_LOCK_LITTLE_ADD);
+}
+
+static void do_bounded_add(void)
+{
+	do_lock_request(TCODE_LOCK_BOUNDED_ADD);
+}
+
+static void do_wrap_add(void)
+{
+	do_lock_request(TCODE_LOCK_WRAP_ADD);
+}
+
+static u64 get_value(const u8 *p, unsigned int length)
+{
+	u64 value = 0;
+	unsigned int i;
+
+	for (i = 0; i < length; ++i)
+		value = value << 8 | p[i];
+	return value;
+}
+
+static void put_value(u8 *p, unsigned int length, u64 value)
+{
+	unsigned int i;
+
+	for (i = length; i > 0; --i) {
+		p[i - 1] = value;
+		value >>= 8;
+	}
+}
+
+/*
+ * Read-modify-write with compare_swap.  A failed compare_swap returns
+ * the current value, which is the expected value for the next attempt,
+ * so the register is read only once.
+ */
+static void do_update(void)
+{
+	unsigned int length = data.length;
+	u64 mask, value, old, new, result;
+	unsigned int retries = 0, delay = 1000;
+	struct response response;
+	u8 buf[16];
+
+	if ((length != 4 && length != 8) || data2.length != length) {
+		fputs("mask and value must both have 32 or 64 bits\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	mask = get_value(data.data, length);
+	value = get_value(data2.data, length);
+
+	send_request(&device, length == 4 ? TCODE_READ_QUADLET_REQUEST : TCODE_READ_BLOCK_REQUEST,
+		     address, NULL, length, &response);
+	if (response.rcode != RCODE_COMPLETE) {
+		print_rcode(response.rcode);
+		exit(EXIT_FAILURE);
+	}
+	if (response.length != length) {
+		fputs("wrong response length\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	old = get_value((u8 *)response.data, length);
+
+	for (;;) {
+		new = (old & ~mask) | (value & mask);
+		if (new == old)
+			break;
+		put_value(buf, length, old);
+		put_value(buf + length, length, new);
+		send_request(&device, TCODE_LOCK_COMPARE_SWAP, address, buf, length * 2, &response);
+		if (response.rcode == RCODE_COMPLETE) {
+			if (response.length != length) {
+				fputs("wrong response length\n", stderr);
+				exit(EXIT_FAILURE);
+			}
+			result = get_value((u8 *)response.data, length);
+			if (result == old)
+				break;
+			/* somebody else changed it; try again with the current value */
+			old = result;
+		} else if (response.rcode != RCODE_BUSY) {
+			print_rcode(response.rcode);
+			exit(EXIT_FAILURE);
+		}
+		if (++retries >= UPDATE_ATTEMPTS) {
+			fprintf(stderr, "giving up after %u retries\n", retries);
+			exit(EXIT_FAILURE);
+		}
+		usleep(delay);
+		delay = delay * 2 > UPDATE_MAX_DELAY ? UPDATE_MAX_DELAY : delay * 2;
+	}
+
+	put_value(buf, length, old);
+	print_data("old: ", buf, length, true);
+	put_value(buf, length, new);
+	print_data("new: ", buf, length, true);
+	printf("retries: %u\n", retries);
+}
+
+static u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000uLL + ts.tv_nsec / 1000;
+}
+
+static void record_latency(struct benchmark_result *result, u64 latency)
+{
+	unsigned int bucket = 0;
+
+	result->latency_sum += latency;
+	if (latency < result->latency_min)
+		result->latency_min = latency;
+	if (latency > result->latency_max)
+		result->latency_max = latency;
+	while (bucket < LATENCY_BUCKETS - 1 && latency >= (1uLL << bucket))
+		++bucket;
+	++result->latency[bucket];
+}
+
+/*
+ * One benchmark process: sends lock requests back to back until the time
+ * is up.  For compare_swap, an operation is the addition of data2 to the
+ * register, which needs another attempt whenever another node was faster.
+ */
+static void benchmark_job(struct benchmark_result *result)
+{
+	struct response response;
+	unsigned int length, data_length = data.length;
+	u64 expected = 0, increment = 0, start, end;
+	u8 *buf;
+
+	buf = lock_request_data(lock_tcode, &length);
+	if (lock_tcode == TCODE_LOCK_COMPARE_SWAP) {
+		expected = get_value(data.data, data_length);
+		increment = get_value(data2.data, data_length);
+	}
+	result->latency_min = UINT64_MAX;
+
+	end = now_us() + benchmark_duration * 1000000uLL;
+	while ((start = now_us()) < end) {
+		for (;;) {
+			if (lock_tcode == TCODE_LOCK_COMPARE_SWAP) {
+				put_value(buf, data_length, expected);
+				put_value(buf + data_length, data_length, expected + increment);
+			}
+			send_request(&device, lock_tcode, address, buf, length, &response);
+			++result->transactions;
+
+			if (response.rcode == RCODE_BUSY) {
+				++result->busy;
+				++result->retries;
+				continue;
+			}
+			if (response.rcode != RCODE_COMPLETE) {
+				++result->errors;
+				break;
+			}
+			if (lock_tcode == TCODE_LOCK_COMPARE_SWAP) {
+				u64 old = get_value((u8 *)response.data, data_length);
+				if (old != expected) {
+					expected = old;
+					++result->retries;
+					continue;
+				}
+				expected += increment;
+			}
+			++result->operations;
+			record_latency(result, now_us() - start);
+			break;
+		}
+	}
+}
+
+static void print_benchmark(const struct benchmark_result *r, unsigned int jobs)
+{
+	double secs = benchmark_duration;
+	unsigned int i;
+
+	printf("jobs: %u, duration: %u s\n", jobs, benchmark_duration);
+	printf("operations: %llu (%.1f/s)\n", r->operations, r->operations / secs);
+	printf("transactions: %llu, retries: %llu (%.1f%%), busy: %llu, errors: %llu\n",
+	       r->transactions, r->retries,
+	       r->transactions ? 100.0 * r->retries / r->transactions : 0.0,
+	       r->busy, r->errors);
+	if (!r->operations)
+		return;
+	printf("latency: min %llu us, avg %.1f us, max %llu us\n",
+	       (unsigned long long)r->latency_min, (double)r->latency_sum / r->operations,
+	       (unsigned long long)r->latency_max);
+	for (i = 0; i < LATENCY_BUCKETS; ++i)
+		if (r->latency[i])
+			printf("  < %8llu us: %llu\n", 1uLL << i, r->latency[i]);
+}
+
+/*
+ * Runs the lock command in several processes at once, optionally on
+ * different cards (device names separated by commas), and sums up what
+ * all of them measured.
+ */
+static void do_benchmark(void)
+{
+	struct benchmark_result *results, total;
+	char *devices, *names[64];
+	unsigned int n_names = 0, i, b;
+	int barrier[2], status;
+	pid_t pid;
+	char c;
+	u64 t;
+
+	/* check the data before the jobs complain about it */
+	lock_request_data(lock_tcode, &i);
+
+	devices = strdup(device_name);
+	if (!devices) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	for (names[n_names] = strtok(devices, ","); names[n_names] && n_names < 63;
+	     names[++n_names] = strtok(NULL, ","))
+		;
+	if (!n_names) {
+		fprintf(stderr, "invalid device name: `%s'\n", device_name);
+		exit(EXIT_FAILURE);
+	}
+
+	results = mmap(NULL, benchmark_jobs * sizeof(*results), PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (results == MAP_FAILED) {
+		perror("mmap failed");
+		exit(EXIT_FAILURE);
+	}
+	memset(results, 0, benchmark_jobs * sizeof(*results));
+	if (pipe(barrier) < 0) {
+		perror("pipe failed");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < benchmark_jobs; ++i) {
+		pid = fork();
+		if (pid < 0) {
+			perror("fork failed");
+			exit(EXIT_FAILURE);
+		}
+		if (pid == 0) {
+			close(barrier[1]);
+			device_name = names[i % n_names];
+			open_device();
+			/* start together when the parent closes its end */
+			while (read(barrier[0], &c, 1) < 0 && errno == EINTR)
+				;
+			benchmark_job(&results[i]);
+			exit(EXIT_SUCCESS);
+		}
+	}
+	close(barrier[0]);
+	close(barrier[1]);
+
+	status = 0;
+	for (i = 0; i < benchmark_jobs; ++i) {
+		int s;
+		if (wait(&s) < 0 || !WIFEXITED(s) || WEXITSTATUS(s) != EXIT_SUCCESS)
+			status = EXIT_FAILURE;
+	}
+
+	memset(&total, 0, sizeof(total));
+	total.latency_min = UINT64_MAX;
+	for (i = 0; i < benchmark_jobs; ++i) {
+		total.operations += results[i].operations;
+		total.transactions += results[i].transactions;
+		total.retries += results[i].retries;
+		total.busy += results[i].busy;
+		total.errors += results[i].errors;
+		total.latency_sum += results[i].latency_sum;
+		if (results[i].operations && results[i].latency_min < total.latency_min)
+			total.latency_min = results[i].latency_min;
+		if (results[i].latency_max > total.latency_max)
+			total.latency_max = results[i].latency_max;
+		for (b = 0; b < LATENCY_BUCKETS; ++b)
+			total.latency[b] += results[i].latency[b];
+		if (verbose)
+			printf("job %u (%s): %llu operations, %llu retries, %llu errors\n",
+			       i, names[i % n_names], results[i].operations,
+			       results[i].retries, results[i].errors);
+	}
+	t = fw_timing_begin();
+	print_benchmark(&total, benchmark_jobs);
+	fw_timing_end(FW_TIMING_PRINT, t);
+
+	munmap(results, benchmark_jobs * sizeof(*results));
+	free(devices);
+	if (status != 0)
+		exit(status);
+}
+
+#ifdef FW_CDEV_IOC_GET_CYCLE_TIMER2 /* since 2.6.34 */
+/* converts a cycle timer value into ticks of 24.576 MHz */
+static u64 cycle_timer_ticks(u32 cycle_timer)
+{
+	return ((cycle_timer >> 25) * 8000 + ((cycle_timer >> 12) & 0x1fff)) * 3072uLL +
+	       (cycle_timer & 0xfff);
+}
+
+/*
+ * Samples the local cycle timer together with CLOCK_MONOTONIC_RAW, fits
+ * a line through the samples, and reports the slope as drift, and the
+ * deviations from the line as jitter.
+ */
+static void do_cycle_timer(void)
+{
+	struct fw_cdev_get_cycle_timer2 ct;
+	struct timespec next;
+	double *x, *y, sx = 0, sy = 0, sxx = 0, sxy = 0, slope, intercept;
+	double residual, sum_squares = 0, max_residual = 0;
+	u64 first_ticks = 0, ticks, prev_ticks = 0, wraps = 0;
+	s64 first_ns = 0, ns;
+	unsigned long i, interval_ns;
+
+	x = malloc(sample_count * sizeof(*x));
+	y = malloc(sample_count * sizeof(*y));
+	if (!x || !y) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	interval_ns = 1000000000uL / sample_rate;
+	clock_gettime(CLOCK_MONOTONIC, &next);
+	for (i = 0; i < sample_count; ++i) {
+		ct.clk_id = CLOCK_MONOTONIC_RAW;
+		if (ioctl(device.fd, FW_CDEV_IOC_GET_CYCLE_TIMER2, &ct) < 0) {
+			perror("GET_CYCLE_TIMER2 ioctl failed");
+			exit(EXIT_FAILURE);
+		}
+		ns = ct.tv_sec * 1000000000LL + ct.tv_nsec;
+		ticks = cycle_timer_ticks(ct.cycle_timer);
+		if (i == 0) {
+			first_ns = ns;
+			first_ticks = ticks;
+		} else if (ticks < prev_ticks) {
+			wraps += CYCLE_TIMER_TICKS;
+		}
+		prev_ticks = ticks;
+		if (verbose)
+			printf("%lld.%09lld %08x\n", (long long)ct.tv_sec,
+			       (long long)ct.tv_nsec, ct.cycle_timer);
+
+		/* seconds since the first sample, on both clocks */
+		x[i] = (ns - first_ns) * 1e-9;
+		y[i] = (ticks + wraps - first_ticks) / 24576000.0;
+
+		next.tv_nsec += interval_ns;
+		while (next.tv_nsec >= 1000000000) {
+			next.tv_nsec -= 1000000000;
+			++next.tv_sec;
+		}
+		if (i + 1 < sample_count)
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+	}
+
+	for (i = 0; i < sample_count; ++i) {
+		sx += x[i];
+		sy += y[i];
+	}
+	sx /= sample_count;
+	sy /= sample_count;
+	for (i = 0; i < sample_count; ++i) {
+		sxx += (x[i] - sx) * (x[i] - sx);
+		sxy += (x[i] - sx) * (y[i] - sy);
+	}
+	if (sxx <= 0) {
+		fputs("the samples do not span any time\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	slope = sxy / sxx;
+	intercept = sy - slope * sx;
+	for (i = 0; i < sample_count; ++i) {
+		residual = y[i] - (intercept + slope * x[i]);
+		sum_squares += residual * residual;
+		if (fabs(residual) > max_residual)
+			max_residual = fabs(residual);
+	}
+
+	printf("samples: %lu over %.3f s\n", sample_count, x[sample_count - 1]);
+	printf("drift: %+.3f ppm\n", (slope - 1) * 1e6);
+	printf("jitter: rms %.3f us, max %.3f us\n",
+	       sqrt(sum_squares / sample_count) * 1e6, max_residual * 1e6);
+	free(x);
+	free(y);
+}
+#endif
+
+static void send_response(u32 handle, u32 rcode)
+{
+	struct fw_cdev_send_response send_response;
+
+	send_response.rcode = rcode;
+	send_response.length = 0;
+	send_response.data = 0;
+	send_response.handle = handle;
+	if (ioctl(device.fd, FW_CDEV_IOC_SEND_RESPONSE, &send_response) < 0) {
+		perror("SEND_RESPONSE ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+struct fcp {
+	int rcode;		/* of the command's write request; -1 until then */
+	bool response_received;
+};
+
+static void fcp_command_done(struct fw_device *dev, int rcode,
+			     const void *payload, unsigned int length, void *arg)
+{
+	struct fcp *fcp = arg;
+
+	fcp->rcode = rcode;
+}
+
+static void fcp_event(struct fw_device *dev, const union fw_cdev_event *event, void *arg)
+{
+	struct fcp *fcp = arg;
+
+#ifdef HAVE_CDEV_4
+	if (event->common.type == FW_CDEV_EVENT_REQUEST2) {
+		const struct fw_cdev_event_request2 *request = &event->request2;
+		send_response(request->handle, RCODE_COMPLETE);
+		if (request->card == device.card &&
+		    (request->source_node_id & 0x3f) == (device.bus.node_id & 0x3f) &&
+		    (request->tcode == TCODE_WRITE_QUADLET_REQUEST ||
+		     request->tcode == TCODE_WRITE_BLOCK_REQUEST) &&
+		    request->offset == FCP_RESPONSE_ADDR &&
+		    request->generation == device.bus.generation) {
+			print_data("response: ", request->data, request->length, false);
+			fcp->response_received = true;
+		}
+		return;
+	}
+#endif
+	if (event->common.type == FW_CDEV_EVENT_REQUEST) {
+		const struct fw_cdev_event_request *request = &event->request;
+		send_response(request->handle, RCODE_COMPLETE);
+		if ((request->tcode == TCODE_WRITE_QUADLET_REQUEST ||
+		     request->tcode == TCODE_WRITE_BLOCK_REQUEST) &&
+		    request->offset == FCP_RESPONSE_ADDR) {
+			print_data("response: ", request->data, request->length, false);
+			fcp->response_received = true;
+		}
+	}
+}
+
+/* the target aborts all outstanding commands at a bus reset */
+static void fcp_bus_reset(struct fw_device *dev, void *arg)
+{
+	fputs("bus reset\n", stderr);
+	exit(EXIT_FAILURE);
+}
+
+/* the daemon matches the response, and reports a bus reset as an rcode */
+static void daemon_fcp(void)
+{
+	struct fw_daemon_request request = { .type = FW_DAEMON_FCP };
+	struct fw_daemon_reply *reply;
+
+	reply = daemon_call(&request, data.data, data.length);
+	if (reply->rcode == FW_RCODE_TIMEOUT) {
+		fputs("timeout\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if (reply->rcode == RCODE_GENERATION) {
+		fputs("bus reset\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if (reply->rcode != RCODE_COMPLETE)
+		print_rcode(reply->rcode);
+	else
+		print_data("response: ", reply->data, reply->length - sizeof(*reply), false);
+	free(reply);
+}
+
+static void do_fcp(void)
+{
+	struct fw_cdev_allocate allocate;
+	struct fcp fcp = { .rcode = -1 };
+	int ready;
+
+	if (use_daemon) {
+		daemon_fcp();
+		return;
+	}
+
+	allocate.offset = FCP_RESPONSE_ADDR;
+	allocate.closure = 0;
+	allocate.length = 0x200;
+#ifdef HAVE_CDEV_4
+	allocate.region_end = allocate.offset + allocate.length;
+#endif
+	if (ioctl(device.fd, FW_CDEV_IOC_ALLOCATE, &allocate) < 0) {
+		perror("ALLOCATE ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+
+	fw_engine_set_event_handler(engine, fcp_event, &fcp);
+	fw_engine_set_reset_handler(engine, fcp_bus_reset, NULL);
+	submit_request(&device,
+		       data.length == 4 ? TCODE_WRITE_QUADLET_REQUEST : TCODE_WRITE_BLOCK_REQUEST,
+		       FCP_COMMAND_ADDR, data.data, data.length, fcp_command_done, &fcp);
+
+	while (fcp.rcode == -1 || !fcp.response_received) {
+		/* XXX what's a practical timeout for FCP responses? */
+		ready = fw_engine_dispatch(engine, 2345);
+		if (ready < 0) {
+			perror("reading events failed");
+			exit(EXIT_FAILURE);
+		}
+		if (!ready) {
+			fputs("timeout\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		if (fcp.rcode != -1 && fcp.rcode != RCODE_COMPLETE) {
+			print_rcode(fcp.rcode);
+			return;
+		}
+	}
+}
+
+static void do_bus_reset(u32 type)
+{
+	struct fw_cdev_initiate_bus_reset reset;
+
+	reset.type = type;
+	if (ioctl(device.fd, FW_CDEV_IOC_INITIATE_BUS_RESET, &reset) < 0) {
+		perror("INITIATE_BUS_RESET ioctl failed");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void do_reset(void)
+{
+	do_bus_reset(FW_CDEV_SHORT_RESET);
+}
+
+static void do_long_reset(void)
+{
+	do_bus_reset(FW_CDEV_LONG_RESET);
+}
+
+static bool is_node(const struct fw_device *dev, void *arg)
+{
+	return dev->card == device.card && dev->bus.node_id == *(u32 *)arg;
+}
+
+/*
+ * Finds the device file of another node on our bus, which is needed to
+ * send requests to it.  Returns NULL if there is none.
+ */
+static struct fw_device *open_node(u32 id)
+{
+	struct fw_device *dev;
+
+	if (device.bus.node_id == id)
+		return &device;
+
+	dev = malloc(sizeof(*dev));
+	if (!dev) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	if (fw_device_find(dev, is_node, &id) < 0) {
+		free(dev);
+		return NULL;
+	}
+	if (fw_engine_add_device(engine, dev) < 0) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	return dev;
+}
+
+static void close_node(struct fw_device *dev)
+{
+	if (dev == &device)
+		return;
+	fw_device_close(dev);
+	free(dev);
+}
+
+/* the isochronous resource manager's registers are accessed directly */
+static bool open_irm(void)
+{
+	if (!irm) {
+		irm = open_node(device.bus.irm_node_id);
+		/* after a bus reset, the IRM might be another node */
+		fw_engine_set_retry_on_reset(engine, false);
+	}
+	return irm != NULL;
+}
+
+/* sends a quadlet read or a compare_swap request to the IRM */
+static u32 irm_request(u32 tcode, u64 offset, u32 arg, u32 value, u32 *result)
+{
+	struct response response;
+	u32 lock_data[2];
+
+	lock_data[0] = __cpu_to_be32(arg);
+	lock_data[1] = __cpu_to_be32(value);
+	if (tcode == TCODE_LOCK_COMPARE_SWAP)
+		send_request(irm, tcode, offset, lock_data, 8, &response);
+	else
+		send_request(irm, tcode, offset, NULL, 4, &response);
+	if (response.rcode == RCODE_COMPLETE) {
+		if (response.length != 4)
+			return RCODE_DATA_ERROR;
+		*result = __be32_to_cpu(response.data[0]);
+	}
+	return response.rcode;
+}
+
+/* computes the new register value; returns false if the change is not possible */
+typedef bool (*irm_update_func)(u32 old, u32 *new, u32 arg);
+
+/*
+ * Changes an IRM register with compare_swap.  When another node changed
+ * the register in the meantime, its current value comes back with the
+ * lock response, so the next attempt does not need another read.
+ */
+static bool update_irm_register(u64 offset, irm_update_func update, u32 arg)
+{
+	u32 old, new, result, rcode;
+	unsigned int attempt = 0;
+	bool have_old = false;
+
+	for (;;) {
+		if (!have_old) {
+			rcode = irm_request(TCODE_READ_QUADLET_REQUEST, offset, 0, 0, &old);
+			if (rcode == RCODE_COMPLETE)
+				have_old = true;
+		}
+		if (have_old) {
+			if (!update(old, &new, arg))
+				return false;
+			if (new == old)
+				return true;
+			rcode = irm_request(TCODE_LOCK_COMPARE_SWAP, offset, old, new, &result);
+			if (rcode == RCODE_COMPLETE && result == old)
+				return true;
+			/* a failed compare_swap returns the current value */
+			if (rcode == RCODE_COMPLETE)
+				old = result;
+		}
+		if (rcode != RCODE_COMPLETE && rcode != RCODE_BUSY)
+			break;
+		if (++attempt >= IRM_ATTEMPTS) {
+			fputs("IRM is too busy\n", stderr);
+			return false;
+		}
+		usleep(1000 << attempt);
+	}
+	print_rcode(rcode);
+	return false;
+}
+
+static bool take_bandwidth(u32 old, u32 *new, u32 units)
+{
+	if (old < units)
+		return false;
+	*new = old - units;
+	return true;
+}
+
+static bool give_bandwidth(u32 old, u32 *new, u32 units)
+{
+	if (old + units > BANDWIDTH_AVAILABLE_INITIAL)
+		return false;
+	*new = old + units;
+	return true;
+}
+
+/* a set bit in channels_available means that the channel is free */
+static bool take_channels(u32 old, u32 *new, u32 mask)
+{
+	if ((old & mask) != mask)
+		return false;
+	*new = old & ~mask;
+	return true;
+}
+
+static bool give_channels(u32 old, u32 *new, u32 mask)
+{
+	if (old & mask)
+		return false;
+	*new = old | mask;
+	return true;
+}
 
-static void open_device(void)
+/* converts a channel mask into the bit order of a channels_available register */
+static u32 channels_available_bits(u64 channels, bool hi)
 {
-	struct fw_cdev_get_info get_info;
-	struct fw_cdev_event_bus_reset bus_reset;
+	unsigned int ch;
+	u32 bits = 0;
 
-	fd = open(device_name, O_RDWR);
-	if (fd == -1) {
-		perror(device_name);
-		exit(EXIT_FAILURE);
-	}
+	for (ch = hi ? 0 : 32; ch < (hi ? 32 : 64); ++ch)
+		if (channels & (1uLL << ch))
+			bits |= 1u << (31 - ch % 32);
+	return bits;
+}
 
-#ifdef HAVE_CDEV_4
-	get_info.version = 4;
-#else
-	get_info.version = 3;
-#endif
-	get_info.rom_length = 0;
-	get_info.rom = 0;
-	get_info.bus_reset = ptr_to_u64(&bus_reset);
-	get_info.bus_reset_closure = 0;
-	if (ioctl(fd, FW_CDEV_IOC_GET_INFO, &get_info) < 0) {
-		perror("GET_INFO ioctl failed");
-		exit(EXIT_FAILURE);
-	}
-	card_index = get_info.card;
-	node_id = bus_reset.node_id;
-	generation = bus_reset.generation;
+/*
+ * Does the allocation with lock requests; every register is changed
+ * atomically, and the registers that have already been changed are
+ * restored if a later one fails.
+ */
+static bool lock_iso_resources(bool allocate, u64 channels, u32 bandwidth,
+			       u64 *done_channels, u32 *done_bandwidth)
+{
+	irm_update_func channel_update = allocate ? take_channels : give_channels;
+	irm_update_func channel_undo = allocate ? give_channels : take_channels;
+	u32 hi = channels_available_bits(channels, true);
+	u32 lo = channels_available_bits(channels, false);
+
+	*done_channels = 0;
+	*done_bandwidth = 0;
+	if (hi && !update_irm_register(CHANNELS_AVAILABLE_HI_ADDR, channel_update, hi))
+		return false;
+	if (lo && !update_irm_register(CHANNELS_AVAILABLE_LO_ADDR, channel_update, lo))
+		goto undo_hi;
+	if (bandwidth && !update_irm_register(BANDWIDTH_AVAILABLE_ADDR,
+					      allocate ? take_bandwidth : give_bandwidth,
+					      bandwidth))
+		goto undo_lo;
+	*done_channels = channels;
+	*done_bandwidth = bandwidth;
+	return true;
+
+undo_lo:
+	if (lo)
+		update_irm_register(CHANNELS_AVAILABLE_LO_ADDR, channel_undo, lo);
+undo_hi:
+	if (hi)
+		update_irm_register(CHANNELS_AVAILABLE_HI_ADDR, channel_undo, hi);
+	return false;
 }
 
-static struct fw_cdev_event_response *wait_for_response(void)
+/*
+ * Lets the kernel do the allocation.  Every ioctl handles at most one
+ * channel, so all of them are started first, and then all their
+ * events are collected.  Returns -1 if the kernel cannot do this.
+ */
+static int once_iso_resources(bool allocate, u64 channels, u32 bandwidth,
+			      u64 *done_channels, u32 *done_bandwidth)
 {
-	static u8 buf[sizeof(struct fw_cdev_event_response) + 16384];
-	int r;
-	struct fw_cdev_event_common *event;
+	struct fw_cdev_allocate_iso_resource resource;
+	union fw_cdev_event event;
+	unsigned int ch, pending = 0;
+	int request, r;
+
+	request = allocate ? FW_CDEV_IOC_ALLOCATE_ISO_RESOURCE_ONCE
+			   : FW_CDEV_IOC_DEALLOCATE_ISO_RESOURCE_ONCE;
+	*done_channels = 0;
+	*done_bandwidth = 0;
+	for (ch = 0; ch <= 64; ++ch) {
+		if (ch < 64 && !(channels & (1uLL << ch)))
+			continue;
+		if (ch == 64 && !bandwidth)
+			continue;
+		resource.closure = ch;
+		resource.channels = ch < 64 ? 1uLL << ch : 0;
+		resource.bandwidth = ch < 64 ? 0 : bandwidth;
+		resource.handle = 0;
+		if (ioctl(device.fd, request, &resource) < 0) {
+			if (!pending && (errno == ENOTTY || errno == EINVAL))
+				return -1;
+			perror(allocate ? "ALLOCATE_ISO_RESOURCE_ONCE ioctl failed"
+					: "DEALLOCATE_ISO_RESOURCE_ONCE ioctl failed");
+			exit(EXIT_FAILURE);
+		}
+		++pending;
+	}
 
-	for (;;) {
-		r = read(fd, buf, sizeof buf);
+	while (pending > 0) {
+		r = read(device.fd, &event, sizeof(event));
 		if (r < sizeof(struct fw_cdev_event_common)) {
 			fputs("short read\n", stderr);
 			exit(EXIT_FAILURE);
 		}
-		event = (void *)buf;
-		if (event->type == FW_CDEV_EVENT_RESPONSE)
-			return (struct fw_cdev_event_response *)buf;
+		if (event.common.type != FW_CDEV_EVENT_ISO_RESOURCE_ALLOCATED &&
+		    event.common.type != FW_CDEV_EVENT_ISO_RESOURCE_DEALLOCATED)
+			continue;
+		--pending;
+		if (event.iso_resource.channel >= 0)
+			*done_channels |= 1uLL << event.iso_resource.channel;
+		if (event.iso_resource.bandwidth > 0)
+			*done_bandwidth += event.iso_resource.bandwidth;
 	}
+	return *done_channels == channels && *done_bandwidth == bandwidth;
 }
 
-static void print_rcode(u32 rcode)
+static int iso_resources(bool allocate, u64 channels, u32 bandwidth,
+			 u64 *done_channels, u32 *done_bandwidth)
 {
-	const char *s;
+	int r;
 
-	switch (rcode) {
-	case RCODE_CONFLICT_ERROR:	s = "conflict error";	break;
-	case RCODE_DATA_ERROR:		s = "data error";	break;
-	case RCODE_TYPE_ERROR:		s = "type error";	break;
-	case RCODE_ADDRESS_ERROR:	s = "address error";	break;
-	case RCODE_SEND_ERROR:		s = "send error";	break;
-	case RCODE_CANCELLED:		s = "error: cancelled";	break;
-	case RCODE_BUSY:		s = "error: busy";	break;
-	case RCODE_GENERATION:		s = "error: bus reset";	break;
-	case RCODE_NO_ACK:		s = "error: no ack";	break;
-	default:			s = "unknown error";	break;
+	r = once_iso_resources(allocate, channels, bandwidth, done_channels, done_bandwidth);
+	if (r >= 0)
+		return r;
+	if (!open_irm()) {
+		fprintf(stderr, "cannot access the IRM (node %x)\n", device.bus.irm_node_id);
+		exit(EXIT_FAILURE);
 	}
-	fprintf(stderr, "%s\n", s);
+	return lock_iso_resources(allocate, channels, bandwidth, done_channels, done_bandwidth);
 }
 
-static void print_data(const char *prefix, const void *p, unsigned int length, bool allow_value)
+static u64 channels_from_available_bits(u32 hi, u32 lo)
 {
-	const u8 *data = p;
-	unsigned int line, col;
+	unsigned int ch;
+	u64 channels = 0;
 
-	if (allow_value) {
-		const u32 *data = p;
-		if (length == 4) {
-			printf("%s%08x\n", prefix, __be32_to_cpu(*data));
-			return;
-		}
-		if (length == 8) {
-			printf("%s%08x%08x\n", prefix, __be32_to_cpu(data[0]), __be32_to_cpu(data[1]));
-			return;
+	for (ch = 0; ch < 64; ++ch)
+		if ((ch < 32 ? hi : lo) & (1u << (31 - ch % 32)))
+			channels |= 1uLL << ch;
+	return channels;
+}
+
+static void print_channel_list(FILE *f, u64 channels)
+{
+	unsigned int first, last;
+	const char *separator = "";
+
+	if (!channels) {
+		fputs("none", f);
+		return;
+	}
+	for (first = 0; first < 64; first = last + 1) {
+		if (!(channels & (1uLL << first))) {
+			last = first;
+			continue;
 		}
+		for (last = first; last < 63 && (channels & (1uLL << (last + 1))); ++last)
+			;
+		if (first == last)
+			fprintf(f, "%s%u", separator, first);
+		else
+			fprintf(f, "%s%u-%u", separator, first, last);
+		separator = ",";
 	}
+}
 
-	for (line = 0; line < ((length + 15) & ~15); line += 16) {
-		printf("%s%03x:", prefix, line);
-		for (col = line; col < line + 16 && col < length; ++col)
-			printf(" %02x", data[col]);
-		printf("%*s", 1 + (line + 16 - col) * 3, "");
-		for (col = line; col < line + 16 && col < length; ++col)
-			if (data[col] >= 32 && data[col] < 127)
-				putchar(data[col]);
-			else
-				putchar('.');
-		putchar('\n');
+static void print_irm_state(void)
+{
+	u32 bandwidth, hi, lo;
+
+	if (!open_irm() ||
+	    irm_request(TCODE_READ_QUADLET_REQUEST, BANDWIDTH_AVAILABLE_ADDR, 0, 0, &bandwidth) != RCODE_COMPLETE ||
+	    irm_request(TCODE_READ_QUADLET_REQUEST, CHANNELS_AVAILABLE_HI_ADDR, 0, 0, &hi) != RCODE_COMPLETE ||
+	    irm_request(TCODE_READ_QUADLET_REQUEST, CHANNELS_AVAILABLE_LO_ADDR, 0, 0, &lo) != RCODE_COMPLETE) {
+		fprintf(stderr, "cannot read the IRM registers (node %x)\n", device.bus.irm_node_id);
+		return;
 	}
+	printf("IRM: node %x\n", device.bus.irm_node_id);
+	printf("bandwidth available: %u\n", bandwidth);
+	fputs("channels available: ", stdout);
+	print_channel_list(stdout, channels_from_available_bits(hi, lo));
+	putchar('\n');
 }
 
-static void do_read(void)
+static void do_iso_resources(bool allocate)
 {
-	struct fw_cdev_send_request send_request;
-	struct fw_cdev_event_response *response;
-
-	if (read_length == 4 && !(address & 3))
-		send_request.tcode = TCODE_READ_QUADLET_REQUEST;
-	else
-		send_request.tcode = TCODE_READ_BLOCK_REQUEST;
-	send_request.length = read_length;
-	send_request.offset = address;
-	send_request.closure = 0;
-	send_request.data = 0;
-	send_request.generation = generation;
-	if (ioctl(fd, FW_CDEV_IOC_SEND_REQUEST, &send_request) < 0) {
-		perror("SEND_REQUEST ioctl failed");
-		exit(EXIT_FAILURE);
+	u64 done_channels, undone_channels;
+	u32 done_bandwidth, undone_bandwidth;
+	bool ok;
+
+	ok = iso_resources(allocate, iso_channels, iso_bandwidth,
+			   &done_channels, &done_bandwidth);
+	if (!ok) {
+		fputs(allocate ? "allocation failed for channels " : "deallocation failed for channels ",
+		      stderr);
+		print_channel_list(stderr, iso_channels & ~done_channels);
+		if (done_bandwidth != iso_bandwidth)
+			fprintf(stderr, ", bandwidth %u", iso_bandwidth - done_bandwidth);
+		fputc('\n', stderr);
+		/* all or nothing */
+		if (allocate && (done_channels || done_bandwidth))
+			iso_resources(false, done_channels, done_bandwidth,
+				      &undone_channels, &undone_bandwidth);
 	}
-	response = wait_for_response();
-	if (response->rcode != RCODE_COMPLETE)
-		print_rcode(response->rcode);
-	else
-		print_data("result: ", response->data, response->length, response->length == read_length);
+	print_irm_state();
+	if (!ok)
+		exit(EXIT_FAILURE);
 }
 
-static void do_write_request(int request)
+static void do_allocate(void)
 {
-	struct fw_cdev_send_request send_request;
-	struct fw_cdev_event_response *response;
-
-	if (data.length == 4 && !(address & 3))
-		send_request.tcode = TCODE_WRITE_QUADLET_REQUEST;
-	else
-		send_request.tcode = TCODE_WRITE_BLOCK_REQUEST;
-	send_request.length = data.length;
-	send_request.offset = address;
-	send_request.closure = 0;
-	send_request.data = ptr_to_u64(data.data);
-	send_request.generation = generation;
-	if (ioctl(fd, request, &send_request) < 0) {
-		perror("SEND_REQUEST ioctl failed");
-		exit(EXIT_FAILURE);
-	}
-	response = wait_for_response();
-	if (response->rcode != RCODE_COMPLETE)
-		print_rcode(response->rcode);
+	do_iso_resources(true);
 }
 
-static void do_write(void)
+static void do_deallocate(void)
 {
-	do_write_request(FW_CDEV_IOC_SEND_REQUEST);
+	do_iso_resources(false);
 }
 
-static void do_broadcast(void)
+/* the CRC-16 of IEEE 1212, as used for config ROM blocks and the bus maps */
+static u16 crc16(const u32 *data, unsigned int quadlets)
 {
-	do_write_request(FW_CDEV_IOC_SEND_BROADCAST_REQUEST);
+	unsigned int i;
+	int shift;
+	u32 crc = 0, sum;
+
+	for (i = 0; i < quadlets; ++i)
+		for (shift = 28; shift >= 0; shift -= 4) {
+			sum = ((crc >> 12) ^ (data[i] >> shift)) & 0xf;
+			crc = (crc << 4) ^ (sum << 12) ^ (sum << 5) ^ sum;
+		}
+	return crc & 0xffff;
 }
 
-static void do_lock_request(u32 tcode)
+/* reads quadlets with as few requests as possible, all at once */
+static u32 read_block(struct fw_device *dev, u64 offset, u32 *buf, unsigned int quadlets)
 {
-	bool has_data2;
-	u8 *buf;
-	struct fw_cdev_send_request send_request;
-	struct fw_cdev_event_response *response;
+	struct chunk *chunks;
+	unsigned int count, i;
+	u32 rcode = RCODE_COMPLETE;
+
+	if (!quadlets)
+		return RCODE_COMPLETE;
+	chunks = transfer(dev, TRANSFER_READ, offset, (u8 *)buf, quadlets * 4, MAP_CHUNK, &count);
+	for (i = 0; i < count && rcode == RCODE_COMPLETE; ++i)
+		if (chunks[i].rcode != RCODE_COMPLETE)
+			rcode = chunks[i].rcode;
+		else if (chunks[i].received != chunks[i].length)
+			rcode = RCODE_DATA_ERROR;
+	free(chunks);
+	for (i = 0; i < quadlets; ++i)
+		buf[i] = __be32_to_cpu(buf[i]);
+	return rcode;
+}
 
-	has_data2 = tcode != TCODE_LOCK_FETCH_ADD && tcode != TCODE_LOCK_LITTLE_ADD;
-	if ((data.length != 4 && data.length != 8) ||
-	    (has_data2 && (data2.length != 4 && data2.length != 8))) {
-		fputs("data size must be 32 or 64 bits\n", stderr);
-		exit(EXIT_FAILURE);
-	}
-	if (has_data2 && data.length != data2.length) {
-		fputs("both data blocks must have the same size\n", stderr);
-		exit(EXIT_FAILURE);
+/*
+ * Reads a topology or speed map.  The first quadlet has the length and
+ * the CRC of the rest of the map, the second one the map's generation;
+ * the latter is read again afterwards, because the map might have been
+ * rewritten by a bus reset during the block reads.
+ */
+static u32 read_map(struct fw_device *dev, u64 offset,
+		    u32 *map, unsigned int max_quadlets)
+{
+	unsigned int attempt, length;
+	u32 rcode, map_generation;
+
+	for (attempt = 0; attempt < MAP_ATTEMPTS; ++attempt) {
+		rcode = read_block(dev, offset, map, 2);
+		if (rcode != RCODE_COMPLETE)
+			return rcode;
+		length = map[0] >> 16;
+		if (length < 1 || 1 + length > max_quadlets)
+			return RCODE_DATA_ERROR;
+		rcode = read_block(dev, offset + 8, map + 2, length - 1);
+		if (rcode != RCODE_COMPLETE)
+			return rcode;
+		rcode = read_block(dev, offset + 4, &map_generation, 1);
+		if (rcode != RCODE_COMPLETE)
+			return rcode;
+		if (map_generation == map[1] && crc16(map + 1, length) == (map[0] & 0xffff))
+			return RCODE_COMPLETE;
+		if (verbose)
+			fprintf(stderr, "map at %012llx changed while reading, retrying\n",
+				(unsigned long long)offset);
 	}
-	if (has_data2) {
-		buf = malloc(data.length * 2);
-		if (!buf) {
-			fputs("out of memory\n", stderr);
-			exit(EXIT_FAILURE);
+	return RCODE_DATA_ERROR;
+}
+
+/*
+ * The self IDs are in the order of the PHY IDs, and every node comes
+ * after all of its children, so the children of a node are the topmost
+ * nodes on a stack of those whose parent is not yet known.
+ */
+static bool decode_self_ids(struct topology *t, const u32 *self_ids, unsigned int count)
+{
+	u8 stack[MAX_NODES];
+	unsigned int n_stack = 0, i, port, children;
+	struct phy *phy;
+	u32 q;
+
+	t->node_count = 0;
+	for (i = 0; i < count; ) {
+		q = self_ids[i];
+		if ((q >> 30) != 2 || (q & 0x00800000) ||
+		    ((q >> 24) & 0x3f) != t->node_count || t->node_count >= MAX_NODES)
+			return false;
+		phy = &t->phys[t->node_count];
+		phy->speed = (q >> 14) & 3;
+		phy->gap_count = (q >> 16) & 0x3f;
+		phy->link_active = q & 0x00400000;
+		phy->contender = q & 0x00000800;
+		phy->port_count = 0;
+		for (port = 0; port < 3; ++port)
+			phy->ports[phy->port_count++] = (q >> (6 - port * 2)) & 3;
+		/* three ports in the first packet, eight in each extended one */
+		while (++i < count && (self_ids[i] & 0x00800000)) {
+			q = self_ids[i];
+			if (phy->port_count + 8 > ARRAY_SIZE(phy->ports))
+				return false;
+			for (port = 0; port < 8; ++port)
+				phy->ports[phy->port_count++] = (q >> (16 - port * 2)) & 3;
 		}
-		memcpy(buf, data.data, data.length);
-		memcpy(buf + data.length, data2.data, data2.length);
-	} else
-		buf = data.data;
-	send_request.tcode = tcode;;
-	send_request.length = has_data2 ? data.length * 2 : data.length;
-	send_request.offset = address;
-	send_request.closure = 0;
-	send_request.data = ptr_to_u64(buf);
-	send_request.generation = generation;
-	if (ioctl(fd, FW_CDEV_IOC_SEND_REQUEST, &send_request) < 0) {
-		perror("SEND_REQUEST ioctl failed");
-		exit(EXIT_FAILURE);
+		/* trailing unused ports do not count */
+		while (phy->port_count > 0 && phy->ports[phy->port_count - 1] == 0)
+			--phy->port_count;
+
+		children = 0;
+		for (port = 0; port < phy->port_count; ++port)
+			children += phy->ports[port] == 3;
+		if (children > n_stack)
+			return false;
+		while (children-- > 0)
+			t->phys[stack[--n_stack]].parent = t->node_count;
+		phy->parent = 0x3f;
+		stack[n_stack++] = t->node_count++;
 	}
-	response = wait_for_response();
-	if (response->rcode != RCODE_COMPLETE)
-		print_rcode(response->rcode);
-	else
-		print_data("old: ", response->data, response->length, true);
+	return n_stack == 1;
 }
 
-static void do_mask_swap(void)
+/* the speed between two nodes is that of the slowest PHY on the path */
+static void speeds_from_self_ids(struct topology *t)
 {
-	do_lock_request(TCODE_LOCK_MASK_SWAP);
+	unsigned int depth[MAX_NODES], a, b, i, j;
+	u8 speed;
+
+	if (t->node_count == 0)
+		return;
+	depth[t->node_count - 1] = 0;
+	for (i = t->node_count - 1; i-- > 0; )
+		depth[i] = depth[t->phys[i].parent] + 1;
+	for (i = 0; i < t->node_count; ++i)
+		for (j = 0; j < t->node_count; ++j) {
+			a = i;
+			b = j;
+			speed = t->phys[a].speed < t->phys[b].speed ? t->phys[a].speed : t->phys[b].speed;
+			while (a != b) {
+				if (depth[a] >= depth[b]) {
+					a = t->phys[a].parent;
+					if (t->phys[a].speed < speed)
+						speed = t->phys[a].speed;
+				} else {
+					b = t->phys[b].parent;
+					if (t->phys[b].speed < speed)
+						speed = t->phys[b].speed;
+				}
+			}
+			t->speed[i][j] = speed;
+		}
 }
 
-static void do_compare_swap(void)
+/*
+ * The speed map has one byte per pair of nodes, in rows of 64; it was
+ * deprecated by IEEE 1394a, so many bus managers do not implement it.
+ */
+static bool speeds_from_speed_map(struct topology *t, const u32 *map)
 {
-	do_lock_request(TCODE_LOCK_COMPARE_SWAP);
+	unsigned int length = map[0] >> 16, i, j, k;
+
+	if (map[1] != t->map_generation)
+		return false;
+	if (8 + 64 * (t->node_count - 1) + t->node_count > 4 * (1 + length))
+		return false;
+	for (i = 0; i < t->node_count; ++i)
+		for (j = 0; j < t->node_count; ++j) {
+			k = 64 * i + j;
+			t->speed[i][j] = (map[2 + k / 4] >> (24 - 8 * (k % 4))) & 0xff;
+		}
+	return true;
 }
 
-static void do_add_big(void)
+static char *topology_cache_name(void)
 {
-	do_lock_request(TCODE_LOCK_FETCH_ADD);
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char *name;
+
+	/* generations start again after a reboot, so the cache must not survive it */
+	if (!dir || !*dir)
+		return NULL;
+	if (asprintf(&name, "%s/firewire-topology-%u", dir, device.card) < 0)
+		return NULL;
+	return name;
 }
 
-static void do_add_little(void)
+/* the card is known by its local node's GUID */
+static bool get_local_guid(u64 *guid)
 {
-	do_lock_request(TCODE_LOCK_LITTLE_ADD);
+	struct fw_device *dev;
+	bool ok;
+
+	dev = open_node(device.bus.local_node_id);
+	if (!dev)
+		return false;
+	ok = dev->rom_length >= 20;
+	if (ok)
+		*guid = (u64)dev->rom[3] << 32 | dev->rom[4];
+	close_node(dev);
+	return ok;
 }
 
-static void do_bounded_add(void)
+/* a cache file might be truncated, or be left over from an older version */
+static bool topology_is_valid(const struct topology *t)
 {
-	do_lock_request(TCODE_LOCK_BOUNDED_ADD);
+	const struct phy *phy;
+	unsigned int i, j;
+
+	if (t->node_count > MAX_NODES)
+		return false;
+	for (i = 0; i < t->node_count; ++i) {
+		phy = &t->phys[i];
+		if ((phy->parent != 0x3f && phy->parent >= t->node_count) ||
+		    phy->speed > 3 || phy->port_count > ARRAY_SIZE(phy->ports))
+			return false;
+		for (j = 0; j < phy->port_count; ++j)
+			if (phy->ports[j] > 3)
+				return false;
+	}
+	return true;
 }
 
-static void do_wrap_add(void)
+static bool load_topology(struct topology *t, u64 guid)
 {
-	do_lock_request(TCODE_LOCK_WRAP_ADD);
+	char *name = topology_cache_name();
+	FILE *f;
+	bool ok;
+
+	if (!name)
+		return false;
+	f = fopen(name, "rb");
+	free(name);
+	if (!f)
+		return false;
+	ok = fread(t, sizeof(*t), 1, f) == 1 && t->magic == TOPOLOGY_CACHE_MAGIC &&
+	     t->card == device.card && t->guid == guid &&
+	     t->generation == device.bus.generation && topology_is_valid(t);
+	fclose(f);
+	return ok;
 }
 
-static void send_response(u32 handle, u32 rcode)
+static void save_topology(const struct topology *t)
 {
-	struct fw_cdev_send_response send_response;
-
-	send_response.rcode = rcode;
-	send_response.length = 0;
-	send_response.data = 0;
-	send_response.handle = handle;
-	if (ioctl(fd, FW_CDEV_IOC_SEND_RESPONSE, &send_response) < 0) {
-		perror("SEND_RESPONSE ioctl failed");
-		exit(EXIT_FAILURE);
+	char *name = topology_cache_name(), *tmp;
+	FILE *f;
+
+	if (!name)
+		return;
+	if (asprintf(&tmp, "%s.%d", name, (int)getpid()) < 0) {
+		free(name);
+		return;
+	}
+	f = fopen(tmp, "wb");
+	if (f) {
+		if (fwrite(t, sizeof(*t), 1, f) == 1 && fclose(f) == 0)
+			rename(tmp, name);
+		else
+			unlink(tmp);
 	}
+	free(tmp);
+	free(name);
 }
 
-static void do_fcp(void)
+static bool read_topology(struct topology *t, u64 guid)
 {
-	static u8 buf[sizeof(struct fw_cdev_event_response) + 0x200];
-	struct fw_cdev_allocate allocate;
-	struct fw_cdev_send_request send_request;
-	bool ack_received, response_received;
-	struct pollfd pfd;
-	int ready, r;
-	struct fw_cdev_event_common *event;
-
-	allocate.offset = FCP_RESPONSE_ADDR;
-	allocate.closure = 0;
-	allocate.length = 0x200;
-#ifdef HAVE_CDEV_4
-	allocate.region_end = allocate.offset + allocate.length;
-#endif
-	if (ioctl(fd, FW_CDEV_IOC_ALLOCATE, &allocate) < 0) {
-		perror("ALLOCATE ioctl failed");
-		exit(EXIT_FAILURE);
+	static u32 map[0x400];
+	struct fw_device *dev;
+	u32 rcode;
+	unsigned int self_id_count;
+
+	memset(t, 0, sizeof(*t));
+	t->magic = TOPOLOGY_CACHE_MAGIC;
+	t->card = device.card;
+	t->guid = guid;
+	t->generation = device.bus.generation;
+	/* without a bus manager, the local node has the maps */
+	t->map_node_id = (device.bus.bm_node_id & 0x3f) != 0x3f ? device.bus.bm_node_id : device.bus.local_node_id;
+	dev = open_node(t->map_node_id);
+	if (!dev) {
+		fprintf(stderr, "cannot access node %x\n", t->map_node_id);
+		return false;
 	}
 
-	send_request.tcode = data.length == 4 ? TCODE_WRITE_QUADLET_REQUEST : TCODE_WRITE_BLOCK_REQUEST;
-	send_request.length = data.length;
-	send_request.offset = FCP_COMMAND_ADDR;
-	send_request.closure = 0;
-	send_request.data = ptr_to_u64(data.data);
-	send_request.generation = generation;
-	if (ioctl(fd, FW_CDEV_IOC_SEND_REQUEST, &send_request) < 0) {
-		perror("SEND_REQUEST ioctl failed");
-		exit(EXIT_FAILURE);
+	rcode = read_map(dev, TOPOLOGY_MAP_ADDR, map, 0x100);
+	if (rcode != RCODE_COMPLETE) {
+		fputs("cannot read the topology map: ", stderr);
+		print_rcode(rcode);
+		goto error;
+	}
+	t->map_generation = map[1];
+	self_id_count = map[2] & 0xffff;
+	if (2 + self_id_count > (map[0] >> 16) ||
+	    !decode_self_ids(t, map + 3, self_id_count)) {
+		fputs("invalid self IDs in the topology map\n", stderr);
+		goto error;
 	}
 
-	ack_received = false;
-	response_received = false;
-	pfd.fd = fd;
-	pfd.events = POLLIN;
-	while (!ack_received || !response_received) {
-		/* XXX what's a practical timeout for FCP responses? */
-		ready = poll(&pfd, 1, 2345);
-		if (ready < 0) {
-			perror("poll failed");
-			exit(EXIT_FAILURE);
-		}
-		if (!ready) {
-			fputs("timeout\n", stderr);
-			exit(EXIT_FAILURE);
-		}
-		r = read(fd, buf, sizeof buf);
-		if (r < sizeof(struct fw_cdev_event_common)) {
-			fputs("short read\n", stderr);
-			exit(EXIT_FAILURE);
-		}
-		event = (void *)buf;
-		if (event->type == FW_CDEV_EVENT_BUS_RESET) {
-			fputs("bus reset\n", stderr);
-			exit(EXIT_FAILURE);
-		}
-		if (event->type == FW_CDEV_EVENT_RESPONSE) {
-			struct fw_cdev_event_response *response = (void *)buf;
-			if (response->rcode != RCODE_COMPLETE) {
-				print_rcode(response->rcode);
-				return;
-			}
-			ack_received = true;
-#ifdef HAVE_CDEV_4
-		} else if (event->type == FW_CDEV_EVENT_REQUEST2) {
-			struct fw_cdev_event_request2 *request = (void *)buf;
-			send_response(request->handle, RCODE_COMPLETE);
-			if (request->card == card_index &&
-			    (request->source_node_id & 0x3f) == (node_id & 0x3f) &&
-			    (request->tcode == TCODE_WRITE_QUADLET_REQUEST ||
-			     request->tcode == TCODE_WRITE_BLOCK_REQUEST) &&
-			    request->offset == FCP_RESPONSE_ADDR &&
-			    request->generation == generation) {
-				print_data("response: ", request->data, request->length, false);
-				response_received = true;
-			}
-#endif
-		} else if (event->type == FW_CDEV_EVENT_REQUEST) {
-			struct fw_cdev_event_request *request = (void *)buf;
-			send_response(request->handle, RCODE_COMPLETE);
-			if ((request->tcode == TCODE_WRITE_QUADLET_REQUEST ||
-			     request->tcode == TCODE_WRITE_BLOCK_REQUEST) &&
-			    request->offset == FCP_RESPONSE_ADDR) {
-				print_data("response: ", request->data, request->length, false);
-				response_received = true;
-			}
-		}
+	rcode = read_map(dev, SPEED_MAP_ADDR, map, 0x400);
+	t->from_speed_map = rcode == RCODE_COMPLETE && speeds_from_speed_map(t, map);
+	if (!t->from_speed_map) {
+		if (verbose && rcode != RCODE_ADDRESS_ERROR)
+			fputs("speed map not usable, using the self IDs\n", stderr);
+		speeds_from_self_ids(t);
 	}
-}
 
-static void do_bus_reset(u32 type)
-{
-	struct fw_cdev_initiate_bus_reset reset;
+	close_node(dev);
+	return true;
 
-	reset.type = type;
-	if (ioctl(fd, FW_CDEV_IOC_INITIATE_BUS_RESET, &reset) < 0) {
-		perror("INITIATE_BUS_RESET ioctl failed");
-		exit(EXIT_FAILURE);
-	}
+error:
+	close_node(dev);
+	return false;
 }
 
-static void do_reset(void)
+static void print_topology(const struct topology *t)
 {
-	do_bus_reset(FW_CDEV_SHORT_RESET);
+	static const char *const speed_names[] = { "S100", "S200", "S400", "S800" };
+	static const char port_chars[] = { ' ', '-', 'p', 'c' };
+	const struct phy *phy;
+	unsigned int i, j;
+
+	printf("topology map of node %x, generation %u, %u nodes\n",
+	       t->map_node_id, t->map_generation, t->node_count);
+	puts("node  parent speed gap link contender ports");
+	for (i = 0; i < t->node_count; ++i) {
+		phy = &t->phys[i];
+		printf("%4x  ", 0xffc0 | i);
+		if (phy->parent == 0x3f)
+			fputs("root  ", stdout);
+		else
+			printf("%4x  ", 0xffc0 | phy->parent);
+		printf(" %-5s %3u %-4s %-9s ", speed_names[phy->speed], phy->gap_count,
+		       phy->link_active ? "yes" : "no", phy->contender ? "yes" : "no");
+		for (j = 0; j < phy->port_count; ++j)
+			putchar(port_chars[phy->ports[j]]);
+		putchar('\n');
+	}
+
+	printf("speeds (from %s):\n", t->from_speed_map ? "speed map" : "self IDs");
+	fputs("    ", stdout);
+	for (j = 0; j < t->node_count; ++j)
+		printf(" %4u", j);
+	putchar('\n');
+	for (i = 0; i < t->node_count; ++i) {
+		printf("%4u", i);
+		for (j = 0; j < t->node_count; ++j)
+			if (t->speed[i][j] < ARRAY_SIZE(speed_names))
+				printf(" %s", speed_names[t->speed[i][j]]);
+			else
+				printf(" %4x", t->speed[i][j]);
+		putchar('\n');
+	}
 }
 
-static void do_long_reset(void)
+static void do_topology(void)
 {
-	do_bus_reset(FW_CDEV_LONG_RESET);
+	struct topology t;
+	u64 guid, start;
+	bool have_guid;
+
+	have_guid = get_local_guid(&guid);
+	if (have_guid && load_topology(&t, guid)) {
+		if (verbose)
+			puts("cached for this bus generation");
+	} else {
+		if (!read_topology(&t, have_guid ? guid : 0))
+			exit(EXIT_FAILURE);
+		/* without the local node's GUID, the cache cannot be checked */
+		if (have_guid)
+			save_topology(&t);
+	}
+	start = fw_timing_begin();
+	print_topology(&t);
+	fw_timing_end(FW_TIMING_PRINT, start);
 }
 
 static const struct command {
@@ -417,22 +1899,42 @@ static const struct command {
 	bool has_length;
 	bool has_data;
 	bool has_data2;
+	bool has_resources;
+	bool has_count;
+	bool daemon;		/* possible with --daemon */
+	u32 lock_tcode;
 } commands[] = {
-	{ "read",            do_read,         .has_addr = true, .has_length = true },
-	{ "write",           do_write,        .has_addr = true, .has_data = true },
+	{ "read",            do_read,         .has_addr = true, .has_length = true, .daemon = true },
+	{ "write",           do_write,        .has_addr = true, .has_data = true, .daemon = true },
 	{ "broadcast",       do_broadcast,    .has_addr = true, .has_data = true },
-	{ "mask_swap",       do_mask_swap,    .has_addr = true, .has_data = true, .has_data2 = true },
-	{ "compare_swap",    do_compare_swap, .has_addr = true, .has_data = true, .has_data2 = true },
-	{ "add",             do_add_big,      .has_addr = true, .has_data = true },
-	{ "add_big",         do_add_big,      .has_addr = true, .has_data = true },
-	{ "add_little",      do_add_little,   .has_addr = true, .has_data = true },
-	{ "bounded_add",     do_bounded_add,  .has_addr = true, .has_data = true, .has_data2 = true },
-	{ "bounded_add_big", do_bounded_add,  .has_addr = true, .has_data = true, .has_data2 = true },
-	{ "wrap_add",        do_wrap_add,     .has_addr = true, .has_data = true, .has_data2 = true },
-	{ "wrap_add_big",    do_wrap_add,     .has_addr = true, .has_data = true, .has_data2 = true },
-	{ "fcp",             do_fcp,                            .has_data = true },
+	{ "mask_swap",       do_mask_swap,    .has_addr = true, .has_data = true, .has_data2 = true,
+	  .lock_tcode = TCODE_LOCK_MASK_SWAP, .daemon = true },
+	{ "compare_swap",    do_compare_swap, .has_addr = true, .has_data = true, .has_data2 = true,
+	  .lock_tcode = TCODE_LOCK_COMPARE_SWAP, .daemon = true },
+	{ "add",             do_add_big,      .has_addr = true, .has_data = true,
+	  .lock_tcode = TCODE_LOCK_FETCH_ADD, .daemon = true },
+	{ "add_big",         do_add_big,      .has_addr = true, .has_data = true,
+	  .lock_tcode = TCODE_LOCK_FETCH_ADD, .daemon = true },
+	{ "add_little",      do_add_little,   .has_addr = true, .has_data = true,
+	  .lock_tcode = TCODE_LOCK_LITTLE_ADD, .daemon = true },
+	{ "bounded_add",     do_bounded_add,  .has_addr = true, .has_data = true, .has_data2 = true,
+	  .lock_tcode = TCODE_LOCK_BOUNDED_ADD, .daemon = true },
+	{ "bounded_add_big", do_bounded_add,  .has_addr = true, .has_data = true, .has_data2 = true,
+	  .lock_tcode = TCODE_LOCK_BOUNDED_ADD, .daemon = true },
+	{ "wrap_add",        do_wrap_add,     .has_addr = true, .has_data = true, .has_data2 = true,
+	  .lock_tcode = TCODE_LOCK_WRAP_ADD, .daemon = true },
+	{ "wrap_add_big",    do_wrap_add,     .has_addr = true, .has_data = true, .has_data2 = true,
+	  .lock_tcode = TCODE_LOCK_WRAP_ADD, .daemon = true },
+	{ "update",          do_update,       .has_addr = true, .has_data = true, .has_data2 = true, .daemon = true },
+	{ "fcp",             do_fcp,                            .has_data = true, .daemon = true },
 	{ "reset",           do_reset },
 	{ "long_reset",      do_long_reset },
+#ifdef FW_CDEV_IOC_GET_CYCLE_TIMER2
+	{ "cycle_timer",     do_cycle_timer,  .has_count = true },
+#endif
+	{ "allocate",        do_allocate,     .has_resources = true },
+	{ "deallocate",      do_deallocate,   .has_resources = true },
+	{ "topology",        do_topology },
 };
 
 static const struct register_name {
@@ -661,23 +2163,90 @@ static void parse_data(const char *s, struct data *data)
 	data->length = len;
 }
 
+static void parse_channels(const char *s)
+{
+	const char *p = s;
+	char *endptr;
+	long first, last;
+
+	if (!strcasecmp(s, "none"))
+		return;
+	for (;;) {
+		first = strtol(p, &endptr, 10);
+		if (endptr == p)
+			goto invalid;
+		last = first;
+		if (*endptr == '-') {
+			p = endptr + 1;
+			last = strtol(p, &endptr, 10);
+			if (endptr == p)
+				goto invalid;
+		}
+		if (first < 0 || last > 63 || first > last) {
+			fputs("channel out of range\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		for (; first <= last; ++first)
+			iso_channels |= 1uLL << first;
+		if (*endptr == '\0')
+			return;
+		if (*endptr != ',')
+			goto invalid;
+		p = endptr + 1;
+	}
+
+invalid:
+	fprintf(stderr, "invalid channel list: `%s'\n", s);
+	exit(EXIT_FAILURE);
+}
+
+static void parse_bandwidth(const char *s)
+{
+	char *endptr;
+	unsigned long int b;
+
+	b = strtoul(s, &endptr, 0);
+	if (*s == '\0' || *endptr != '\0') {
+		fprintf(stderr, "invalid bandwidth: `%s'\n", s);
+		exit(EXIT_FAILURE);
+	}
+	if (b > BANDWIDTH_AVAILABLE_INITIAL) {
+		fputs("bandwidth out of range\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+	iso_bandwidth = b;
+}
+
 static void help(void)
 {
 	fputs("firewire-request <dev> read <addr> [<length>]\n"
 	      "firewire-request <dev> write <addr> <data>\n"
 	      "firewire-request <dev> <locktype> <addr> <data> [<data>]\n"
+	      "firewire-request <dev> update <addr> <mask> <data>\n"
 	      "firewire-request <dev> broadcast <addr> <data>\n"
 	      "firewire-request <dev> fcp <data>\n"
 	      "firewire-request <dev> reset|long_reset\n"
+#ifdef FW_CDEV_IOC_GET_CYCLE_TIMER2
+	      "firewire-request <dev> cycle_timer [<count>]\n"
+#endif
+	      "firewire-request <dev> allocate|deallocate <channels> [<bandwidth>]\n"
+	      "firewire-request <dev> topology\n"
 	      "\n"
-	      "<dev> is device node (/dev/fwX)\n"
+	      "<dev> is device node (/dev/fwX), guid:<eui64>, or name:<model>\n"
 	      "<addr> is address in hex or register name\n"
 	      "<length> is byte length in hex, default from register or 4\n"
 	      "<data> is data bytes in hex (spaces must be quoted)\n"
 	      "<locktype> is mask_swap|compare_swap|add_big|add_little|bounded_add|wrap_add\n"
+	      "<channels> is a list of channels or ranges, like 0,2,4-7, or none\n"
+	      "<bandwidth> is in allocation units, default 0\n"
 	      "\n"
 	      "Options:\n"
 	      " -D,--dump-register-names  show known register names and exit\n"
+	      " -d,--daemon               send the requests through firewire-daemon\n"
+	      " -B,--benchmark=secs       repeat the lock transaction for this many seconds\n"
+	      " -j,--jobs=count           number of benchmark processes (default 1)\n"
+	      " -r,--rate=hz              cycle timer samples per second (default 1000)\n"
+	      " -t,--timing               print where the time went to stderr\n"
 	      " -v,--verbose              more information\n"
 	      " -h,--help                 show this message and exit\n"
 	      " -V,--version              show version number and exit\n"
@@ -708,15 +2277,21 @@ static void help_registers(void)
 
 static command_func parse_parameters(int argc, char *argv[])
 {
-	static const char short_options[] = "DvhV";
+	static const char short_options[] = "DdB:j:r:tvhV";
 	static const struct option long_options[] = {
 		{ "dump-register-names", 0, NULL, 'D' },
+		{ "daemon", 0, NULL, 'd' },
+		{ "benchmark", 1, NULL, 'B' },
+		{ "jobs", 1, NULL, 'j' },
+		{ "rate", 1, NULL, 'r' },
+		{ "timing", 0, NULL, 't' },
 		{ "verbose", 0, NULL, 'v' },
 		{ "help", 0, NULL, 'h' },
 		{ "version", 0, NULL, 'V' },
 		{}
 	};
 	int c;
+	char *endptr;
 	bool show_regs = false, show_help = false, show_version = false;
 	const struct command *command;
 
@@ -725,6 +2300,35 @@ static command_func parse_parameters(int argc, char *argv[])
 		case 'D':
 			show_regs = true;
 			break;
+		case 'd':
+			use_daemon = true;
+			break;
+		case 'B':
+			benchmark_duration = strtoul(optarg, &endptr, 10);
+			if (*optarg == '\0' || *endptr != '\0' || !benchmark_duration) {
+				fprintf(stderr, "invalid duration: `%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'j':
+			benchmark_jobs = strtoul(optarg, &endptr, 10);
+			if (*optarg == '\0' || *endptr != '\0' || !benchmark_jobs ||
+			    benchmark_jobs > 1024) {
+				fprintf(stderr, "invalid number of jobs: `%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'r':
+			sample_rate = strtoul(optarg, &endptr, 10);
+			if (*optarg == '\0' || *endptr != '\0' || !sample_rate ||
+			    sample_rate > 1000000) {
+				fprintf(stderr, "invalid rate: `%s'\n", optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 't':
+			fw_timing_enable();
+			break;
 		case 'v':
 			verbose = true;
 			break;
@@ -766,6 +2370,19 @@ static command_func parse_parameters(int argc, char *argv[])
 command_found:
 	++optind;
 
+	if (use_daemon && !command->daemon) {
+		fprintf(stderr, "%s is not possible with --daemon\n", command->name);
+		exit(EXIT_FAILURE);
+	}
+
+	if (benchmark_duration) {
+		if (!command->lock_tcode) {
+			fputs("only lock transactions can be benchmarked\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+		lock_tcode = command->lock_tcode;
+	}
+
 	if (command->has_addr) {
 		if (optind >= argc)
 			goto syntax_error;
@@ -793,12 +2410,33 @@ command_found:
 		parse_data(argv[optind++], &data2);
 	}
 
+	if (command->has_count && optind < argc) {
+		sample_count = strtoul(argv[optind], &endptr, 10);
+		if (*argv[optind] == '\0' || *endptr != '\0' || sample_count < 2) {
+			fprintf(stderr, "invalid count: `%s'\n", argv[optind]);
+			exit(EXIT_FAILURE);
+		}
+		++optind;
+	}
+
+	if (command->has_resources) {
+		if (optind >= argc)
+			goto syntax_error;
+		parse_channels(argv[optind++]);
+		if (optind < argc)
+			parse_bandwidth(argv[optind++]);
+		if (!iso_channels && !iso_bandwidth) {
+			fputs("no channels and no bandwidth specified\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+
 	if (optind < argc) {
 		fprintf(stderr, "superfluous parameter: `%s'\n", argv[optind]);
 		goto syntax_error;
 	}
 
-	return command->function;
+	return benchmark_duration ? do_benchmark : command->function;
 }
 
 int main(int argc, char *argv[])
@@ -806,8 +2444,13 @@ int main(int argc, char *argv[])
 	command_func fn;
 
 	fn = parse_parameters(argc, argv);
+	if (fn == do_benchmark) {
+		/* every job opens its own device */
+		fn();
+		return 0;
+	}
 	open_device();
 	fn();
-	close(fd);
+	close_device();
 	return 0;
 }
@@ -0,0 +1,1744 @@
+/*
+ * firewire-sim.c - simulated FireWire bus for the fw character devices
+ *
+ * This is an LD_PRELOAD library: it intercepts open(), ioctl(), read(),
+ * poll(), close() and scandir() on /dev/fw* and answers them from a
+ * simulated bus, so that the tools can be run without any hardware.
+ *
+ * licensed under the terms of the GNU General Public License, version 2
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/firewire-cdev.h>
+#include <linux/firewire-constants.h>
+
+#ifndef FW_CDEV_IOC_SEND_PHY_PACKET
+#error kernel headers too old
+#endif
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof *(a))
+
+#define u64_to_ptr(p) ((void *)(uintptr_t)(p))
+
+typedef __u8 u8;
+typedef __u16 u16;
+typedef __u32 u32;
+typedef __u64 u64;
+
+#define MAX_NODES	63
+#define MAX_PORTS	16
+#define NO_NODE		0xff
+
+#define CSR_BASE		0xfffff0000000uLL
+#define CSR_SIZE		0x2000
+#define MEMORY_SIZE		0x10000
+
+#define CSR_STATE_CLEAR		0x000
+#define CSR_STATE_SET		0x004
+#define CSR_NODE_IDS		0x008
+#define CSR_RESET_START		0x00c
+#define CSR_SPLIT_TIMEOUT_HI	0x018
+#define CSR_SPLIT_TIMEOUT_LO	0x01c
+#define CSR_CYCLE_TIME		0x200
+#define CSR_BUS_TIME		0x204
+#define CSR_BUSY_TIMEOUT	0x210
+#define CSR_PRIORITY_BUDGET	0x218
+#define CSR_BUS_MANAGER_ID	0x21c
+#define CSR_BANDWIDTH_AVAILABLE	0x220
+#define CSR_CHANNELS_AVAILABLE_HI 0x224
+#define CSR_CHANNELS_AVAILABLE_LO 0x228
+#define CSR_BROADCAST_CHANNEL	0x234
+#define CSR_FCP_COMMAND		0xb00
+#define CSR_FCP_RESPONSE	0xd00
+#define CSR_CONFIG_ROM		0x400
+#define CSR_CONFIG_ROM_END	0x800
+#define CSR_TOPOLOGY_MAP	0x1000
+#define CSR_TOPOLOGY_MAP_END	0x1400
+
+#define STATE_CMSTR		0x00000100
+
+#define ROM_QUADLETS		9
+
+#define PORT_NONE		1
+#define PORT_PARENT		2
+#define PORT_CHILD		3
+
+#define TICKS_PER_SECOND	24576000u
+
+#define AVC_NOT_IMPLEMENTED	0x08
+
+#define MAX_ALLOCATIONS		8
+
+#define DEFAULT_CONFIG \
+	"node local contender speed S400 guid 0x0001020304050607 model 0x000001\n" \
+	"node parent 0 speed S400 guid 0x0001020304050608 vendor 0x00a02d model 0x000002\n" \
+	"node parent 0 speed S200 guid 0x0001020304050609 vendor 0x00a02d model 0x000003\n"
+
+/*
+ * The bus is shared with forked children, so that parallel benchmark jobs
+ * contend for the same registers; the event queues belong to the process
+ * that opened the device file.  Times are CLOCK_MONOTONIC, which is the same
+ * for all processes.
+ */
+struct sim_node {
+	bool local;
+	bool link_active;
+	bool contender;
+	u8 speed;
+	u8 max_rec;
+	u8 port_count;
+	u8 phy_id;
+	u8 gap_count;
+	u8 parent;
+	u8 peer[MAX_PORTS];
+	bool port_disabled[MAX_PORTS];
+	u32 vendor_id;
+	u32 model_id;
+	u64 guid;
+	u32 phy_vendor;
+	u32 phy_product;
+	u32 state;
+	u32 rom[ROM_QUADLETS];
+	u32 csr[CSR_SIZE / 4];
+	u8 memory[MEMORY_SIZE];
+};
+
+struct sim_bus {
+	int lock;
+	unsigned int node_count;
+	u32 generation;
+	u8 by_phy_id[MAX_NODES];
+	u8 root;
+	int pending_root;
+	int pending_gap_count;
+	unsigned int latency_us;
+	unsigned int busy_percent;
+	unsigned int reset_interval_ms;
+	u64 next_reset_ns;
+	u64 start_ns;
+	struct sim_node nodes[MAX_NODES];
+};
+
+struct sim_event {
+	struct sim_event *next;
+	u64 ready_ns;
+	size_t size;
+	u64 data[];
+};
+
+struct allocation {
+	u64 offset;
+	u64 end;
+	u64 closure;
+	u32 handle;
+};
+
+struct client {
+	struct client *next;
+	int fd;
+	bool nonblock;
+	unsigned int node;
+	u64 bus_reset_closure;
+	bool phy_receive;
+	u64 phy_receive_closure;
+	u32 generation;
+	struct sim_event *head, **tail;
+	struct allocation allocations[MAX_ALLOCATIONS];
+	unsigned int allocation_count;
+	u32 next_handle;
+};
+
+/* calls on the device files, for benchmarks */
+enum { CALL_OPEN, CALL_CLOSE, CALL_IOCTL, CALL_READ, CALL_POLL, CALL_SCANDIR, CALL_COUNT };
+
+static const char *const call_names[CALL_COUNT] = {
+	"open", "close", "ioctl", "read", "poll", "scandir"
+};
+
+static struct sim_bus *bus;
+static struct client *clients;
+static unsigned long calls[CALL_COUNT];
+static pid_t calls_pid;
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static ssize_t (*real_read)(int, void *, size_t);
+static int (*real_poll)(struct pollfd *, nfds_t, int);
+
+static void fail(const char *fmt, ...)
+{
+	va_list ap;
+
+	fputs("firewire-sim: ", stderr);
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fputc('\n', stderr);
+	exit(EXIT_FAILURE);
+}
+
+/* a forked child starts counting from zero */
+static void count_call(unsigned int call)
+{
+	if (calls_pid != getpid()) {
+		memset(calls, 0, sizeof(calls));
+		calls_pid = getpid();
+	}
+	++calls[call];
+}
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000uLL + ts.tv_nsec;
+}
+
+static void sleep_until(u64 ns)
+{
+	struct timespec ts;
+
+	ts.tv_sec = ns / 1000000000u;
+	ts.tv_nsec = ns % 1000000000u;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+static void lock_bus(void)
+{
+	while (__atomic_exchange_n(&bus->lock, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+}
+
+static void unlock_bus(void)
+{
+	__atomic_store_n(&bus->lock, 0, __ATOMIC_RELEASE);
+}
+
+static u16 crc16(const u32 *data, unsigned int length)
+{
+	unsigned int i, shift;
+	u32 crc = 0, sum;
+
+	for (i = 0; i < length; ++i) {
+		for (shift = 28; ; shift -= 4) {
+			sum = ((crc >> 12) ^ (data[i] >> shift)) & 0xf;
+			crc = (crc << 4) ^ (sum << 12) ^ (sum << 5) ^ sum;
+			if (!shift)
+				break;
+		}
+		crc &= 0xffff;
+	}
+	return crc;
+}
+
+static u32 cycle_time(void)
+{
+	u64 ticks = (now_ns() - bus->start_ns) * (TICKS_PER_SECOND / 1000) / 1000000u;
+	u64 cycles = ticks / 3072;
+
+	return ((cycles / 8000) & 0x7f) << 25 | (cycles % 8000) << 12 | ticks % 3072;
+}
+
+/*
+ * configuration
+ */
+
+static const char *const speed_names[] = { "S100", "S200", "S400", "S800", "S1600", "S3200" };
+
+static void connect_nodes(unsigned int child, unsigned int parent)
+{
+	struct sim_node *c = &bus->nodes[child], *p = &bus->nodes[parent];
+	unsigned int i, j;
+
+	for (i = 0; i < MAX_PORTS && c->peer[i] != NO_NODE; ++i)
+		;
+	for (j = 0; j < MAX_PORTS && p->peer[j] != NO_NODE; ++j)
+		;
+	if (i >= MAX_PORTS || j >= MAX_PORTS)
+		fail("too many connections at node %u", i >= MAX_PORTS ? child : parent);
+	c->peer[i] = parent;
+	p->peer[j] = child;
+}
+
+static unsigned long parse_number(const char *line_no, char **tokens, const char *key)
+{
+	char *endptr;
+	unsigned long value;
+
+	if (!*tokens)
+		fail("%s: missing value for `%s'", line_no, key);
+	value = strtoul(*tokens, &endptr, 0);
+	if (**tokens == '\0' || *endptr != '\0')
+		fail("%s: invalid value for `%s': `%s'", line_no, key, *tokens);
+	return value;
+}
+
+static void parse_node(const char *line_no, char **tokens, int *parents)
+{
+	struct sim_node *node;
+	unsigned int index, i;
+	unsigned long value;
+
+	if (bus->node_count >= MAX_NODES)
+		fail("%s: too many nodes", line_no);
+	index = bus->node_count++;
+	node = &bus->nodes[index];
+	node->link_active = true;
+	node->speed = SCODE_400;
+	node->max_rec = 0;
+	node->port_count = 3;
+	node->gap_count = 63;
+	node->vendor_id = 0x001f11;
+	node->model_id = 0x000001;
+	node->guid = 0x001f110000000000uLL | index;
+	node->phy_vendor = 0x080028;
+	node->phy_product = 0x434195;
+	memset(node->peer, NO_NODE, sizeof(node->peer));
+	parents[index] = -1;
+
+	for (; *tokens; ++tokens) {
+		const char *key = *tokens;
+
+		if (!strcmp(key, "local")) {
+			node->local = true;
+		} else if (!strcmp(key, "contender")) {
+			node->contender = true;
+		} else if (!strcmp(key, "nolink")) {
+			node->link_active = false;
+		} else if (!strcmp(key, "speed")) {
+			if (!*++tokens)
+				fail("%s: missing value for `speed'", line_no);
+			for (i = 0; i < ARRAY_SIZE(speed_names); ++i)
+				if (!strcasecmp(*tokens, speed_names[i]))
+					break;
+			if (i >= ARRAY_SIZE(speed_names))
+				fail("%s: invalid speed: `%s'", line_no, *tokens);
+			node->speed = i;
+		} else if (!strcmp(key, "parent")) {
+			value = parse_number(line_no, ++tokens, key);
+			if (value >= index)
+				fail("%s: parent must be an earlier node", line_no);
+			parents[index] = value;
+		} else if (!strcmp(key, "ports")) {
+			value = parse_number(line_no, ++tokens, key);
+			if (value < 1 || value > MAX_PORTS)
+				fail("%s: ports must be between 1 and %u", line_no, MAX_PORTS);
+			node->port_count = value;
+		} else if (!strcmp(key, "maxrec")) {
+			value = parse_number(line_no, ++tokens, key);
+			if (value < 1 || value > 13)
+				fail("%s: maxrec must be between 1 and 13", line_no);
+			node->max_rec = value;
+		} else if (!strcmp(key, "guid")) {
+			if (!*++tokens)
+				fail("%s: missing value for `guid'", line_no);
+			node->guid = strtoull(*tokens, NULL, 16);
+		} else if (!strcmp(key, "vendor")) {
+			node->vendor_id = parse_number(line_no, ++tokens, key) & 0xffffff;
+		} else if (!strcmp(key, "model")) {
+			node->model_id = parse_number(line_no, ++tokens, key) & 0xffffff;
+		} else if (!strcmp(key, "phy")) {
+			node->phy_vendor = parse_number(line_no, ++tokens, key) & 0xffffff;
+			node->phy_product = parse_number(line_no, ++tokens, key) & 0xffffff;
+		} else {
+			fail("%s: unknown keyword `%s'", line_no, key);
+		}
+	}
+	if (!node->max_rec)
+		node->max_rec = node->speed + 8;
+}
+
+static void parse_config(FILE *f, const char *name)
+{
+	char line[512], line_no[300], *tokens[40], *p;
+	int parents[MAX_NODES];
+	unsigned int n = 0, count, i, roots = 0, locals = 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		snprintf(line_no, sizeof(line_no), "%s:%u", name, ++n);
+		p = strchr(line, '#');
+		if (p)
+			*p = '\0';
+		count = 0;
+		for (p = strtok(line, " \t\r\n"); p && count < ARRAY_SIZE(tokens) - 1;
+		     p = strtok(NULL, " \t\r\n"))
+			tokens[count++] = p;
+		tokens[count] = NULL;
+		if (!count)
+			continue;
+		if (!strcmp(tokens[0], "node"))
+			parse_node(line_no, tokens + 1, parents);
+		else if (!strcmp(tokens[0], "latency") && count == 2)
+			bus->latency_us = parse_number(line_no, tokens + 1, tokens[0]);
+		else if (!strcmp(tokens[0], "busy") && count == 2)
+			bus->busy_percent = parse_number(line_no, tokens + 1, tokens[0]);
+		else if (!strcmp(tokens[0], "reset") && count == 2)
+			bus->reset_interval_ms = parse_number(line_no, tokens + 1, tokens[0]);
+		else
+			fail("%s: syntax error", line_no);
+	}
+
+	if (!bus->node_count)
+		fail("%s: no nodes", name);
+	for (i = 0; i < bus->node_count; ++i) {
+		if (parents[i] < 0) {
+			bus->root = i;
+			++roots;
+		} else {
+			connect_nodes(i, parents[i]);
+		}
+		if (bus->nodes[i].local)
+			++locals;
+	}
+	if (roots != 1)
+		fail("%s: all nodes except one must have a parent", name);
+	if (locals > 1)
+		fail("%s: only one node can be local", name);
+	if (!locals)
+		bus->nodes[bus->root].local = true;
+	for (i = 0; i < bus->node_count; ++i)
+		if (bus->nodes[i].local && !bus->nodes[i].link_active)
+			fail("%s: the local node must have a link", name);
+	for (i = 0; i < bus->node_count; ++i) {
+		for (n = 0; n < MAX_PORTS && bus->nodes[i].peer[n] != NO_NODE; ++n)
+			;
+		if (bus->nodes[i].port_count < n)
+			bus->nodes[i].port_count = n;
+	}
+}
+
+static void build_config_rom(struct sim_node *node)
+{
+	u32 *rom = node->rom;
+
+	rom[1] = 0x31333934; /* "1394" */
+	rom[2] = (node->contender ? 0xf0000000 : 0x20000000) |
+		 0x00640000 | node->max_rec << 12 | node->speed;
+	rom[3] = node->guid >> 32;
+	rom[4] = node->guid;
+	rom[6] = 0x03000000 | node->vendor_id;
+	rom[7] = 0x17000000 | node->model_id;
+	rom[8] = 0x0c0083c0;
+	rom[5] = 3 << 16 | crc16(&rom[6], 3);
+	rom[0] = 4 << 24 | (ROM_QUADLETS - 1) << 16 | crc16(&rom[1], ROM_QUADLETS - 1);
+	memcpy(&node->csr[CSR_CONFIG_ROM / 4], rom, sizeof(node->rom));
+}
+
+/*
+ * topology
+ */
+
+static u8 parent_of(unsigned int index)
+{
+	return bus->nodes[index].parent;
+}
+
+/* the tree is re-rooted, and the PHY IDs reassigned, in every bus reset */
+static void number_nodes(unsigned int index, unsigned int parent, unsigned int *next_id)
+{
+	struct sim_node *node = &bus->nodes[index];
+	unsigned int i;
+
+	node->parent = parent;
+	for (i = 0; i < MAX_PORTS; ++i)
+		if (node->peer[i] != NO_NODE && node->peer[i] != parent)
+			number_nodes(node->peer[i], index, next_id);
+	node->phy_id = (*next_id)++;
+	bus->by_phy_id[node->phy_id] = index;
+}
+
+static unsigned int depth_of(unsigned int index)
+{
+	unsigned int depth = 0;
+
+	while (parent_of(index) != NO_NODE) {
+		index = parent_of(index);
+		++depth;
+	}
+	return depth;
+}
+
+/* the number of hops between two nodes, and the slowest speed on the way */
+static unsigned int path(unsigned int a, unsigned int b, u8 *speed)
+{
+	unsigned int da = depth_of(a), db = depth_of(b), hops = 0, moved;
+	u8 s = bus->nodes[a].speed < bus->nodes[b].speed ?
+	       bus->nodes[a].speed : bus->nodes[b].speed;
+
+	while (a != b) {
+		if (da >= db) {
+			a = parent_of(a);
+			--da;
+			moved = a;
+		} else {
+			b = parent_of(b);
+			--db;
+			moved = b;
+		}
+		if (bus->nodes[moved].speed < s)
+			s = bus->nodes[moved].speed;
+		++hops;
+	}
+	if (speed)
+		*speed = s;
+	return hops;
+}
+
+static unsigned int local_index(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < bus->node_count; ++i)
+		if (bus->nodes[i].local)
+			break;
+	return i;
+}
+
+static unsigned int self_ids_of(const struct sim_node *node, u32 *self_ids)
+{
+	unsigned int i, p, count = 1, status;
+
+	self_ids[0] = 0x80000000 | node->phy_id << 24 | node->link_active << 22 |
+		      node->gap_count << 16 | node->speed << 14 | node->contender << 11;
+	for (p = 0; p < node->port_count; ++p) {
+		if (node->peer[p] == NO_NODE)
+			status = PORT_NONE;
+		else if (node->peer[p] == node->parent)
+			status = PORT_PARENT;
+		else
+			status = PORT_CHILD;
+		if (p < 3) {
+			self_ids[0] |= status << (6 - p * 2);
+			continue;
+		}
+		i = (p - 3) / 8;
+		if (count <= i + 1) {
+			self_ids[count - 1] |= 1;
+			self_ids[count++] = 0x80800000 | node->phy_id << 24 | i << 20;
+		}
+		self_ids[count - 1] |= status << (16 - (p - 3) % 8 * 2);
+	}
+	return count;
+}
+
+static void update_topology_maps(void)
+{
+	u32 map[CSR_TOPOLOGY_MAP_END - CSR_TOPOLOGY_MAP];
+	unsigned int i, length = 3;
+
+	for (i = 0; i < bus->node_count; ++i)
+		length += self_ids_of(&bus->nodes[bus->by_phy_id[i]], &map[length]);
+	map[0] = (length - 1) << 16;
+	map[1] = bus->generation;
+	map[2] = bus->node_count << 16 | (length - 3);
+	map[0] |= crc16(&map[1], length - 1);
+	for (i = 0; i < bus->node_count; ++i)
+		memcpy(&bus->nodes[i].csr[CSR_TOPOLOGY_MAP / 4], map, length * 4);
+}
+
+static unsigned int irm_index(void)
+{
+	int id;
+
+	for (id = bus->node_count - 1; id >= 0; --id)
+		if (bus->nodes[bus->by_phy_id[id]].contender &&
+		    bus->nodes[bus->by_phy_id[id]].link_active)
+			return bus->by_phy_id[id];
+	return NO_NODE;
+}
+
+static void bus_reset_locked(void)
+{
+	unsigned int i, next_id = 0;
+	struct sim_node *node;
+
+	if (bus->pending_root >= 0)
+		bus->root = bus->pending_root;
+	for (i = 0; i < bus->node_count; ++i)
+		if (bus->pending_gap_count >= 0)
+			bus->nodes[i].gap_count = bus->pending_gap_count;
+	bus->pending_root = -1;
+	bus->pending_gap_count = -1;
+
+	number_nodes(bus->root, NO_NODE, &next_id);
+	++bus->generation;
+	for (i = 0; i < bus->node_count; ++i) {
+		node = &bus->nodes[i];
+		node->state = i == bus->root ? STATE_CMSTR : 0;
+		node->csr[CSR_BUS_MANAGER_ID / 4] = 0x3f;
+		node->csr[CSR_BANDWIDTH_AVAILABLE / 4] = 4915;
+		node->csr[CSR_CHANNELS_AVAILABLE_HI / 4] = 0xffffffff;
+		node->csr[CSR_CHANNELS_AVAILABLE_LO / 4] = 0xffffffff;
+		node->csr[CSR_BROADCAST_CHANNEL / 4] = 0x8000001f;
+	}
+	update_topology_maps();
+	if (bus->reset_interval_ms)
+		bus->next_reset_ns = now_ns() + bus->reset_interval_ms * 1000000uLL;
+}
+
+static void init_node_csrs(struct sim_node *node)
+{
+	node->csr[CSR_SPLIT_TIMEOUT_LO / 4] = 800 << 19;
+	node->csr[CSR_BUSY_TIMEOUT / 4] = 0x00000f00;
+	node->csr[CSR_PRIORITY_BUDGET / 4] = 0;
+	build_config_rom(node);
+}
+
+static void init_bus(void)
+{
+	const char *name = getenv("FIREWIRE_SIM");
+	unsigned int i;
+	FILE *f;
+
+	if (name && *name) {
+		f = fopen(name, "r");
+		if (!f)
+			fail("%s: %s", name, strerror(errno));
+		parse_config(f, name);
+		fclose(f);
+	} else {
+		f = fmemopen((void *)DEFAULT_CONFIG, strlen(DEFAULT_CONFIG), "r");
+		if (!f)
+			fail("cannot read the default configuration");
+		parse_config(f, "default configuration");
+		fclose(f);
+	}
+
+	for (i = 0; i < bus->node_count; ++i)
+		init_node_csrs(&bus->nodes[i]);
+	bus->start_ns = now_ns();
+	bus->pending_root = -1;
+	bus->pending_gap_count = -1;
+	bus_reset_locked();
+}
+
+/*
+ * With a state file, the bus survives the process, so that one command
+ * can see what an earlier one did; the file is initialized when it has
+ * the wrong size, i.e., when it is new.
+ */
+static void map_state_file(const char *name)
+{
+	struct stat st;
+	bool fresh;
+	int fd;
+
+	fd = real_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd == -1 || flock(fd, LOCK_EX) < 0 || fstat(fd, &st) < 0)
+		fail("%s: %s", name, strerror(errno));
+	fresh = st.st_size != sizeof(*bus);
+	if (fresh && (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(*bus)) < 0))
+		fail("%s: %s", name, strerror(errno));
+	bus = mmap(NULL, sizeof(*bus), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (bus == MAP_FAILED)
+		fail("%s: %s", name, strerror(errno));
+	if (fresh)
+		init_bus();
+	flock(fd, LOCK_UN);
+	real_close(fd);
+}
+
+__attribute__((constructor))
+static void init(void)
+{
+	const char *state = getenv("FIREWIRE_SIM_STATE");
+
+	real_open = dlsym(RTLD_NEXT, "open");
+	real_close = dlsym(RTLD_NEXT, "close");
+	real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+	real_read = dlsym(RTLD_NEXT, "read");
+	real_poll = dlsym(RTLD_NEXT, "poll");
+	if (!real_open || !real_close || !real_ioctl || !real_read || !real_poll)
+		fail("cannot find the C library functions");
+
+	if (state && *state) {
+		map_state_file(state);
+		return;
+	}
+	bus = mmap(NULL, sizeof(*bus), PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (bus == MAP_FAILED)
+		fail("cannot allocate the bus: %s", strerror(errno));
+	init_bus();
+}
+
+/* one line per process, appended in a single write */
+__attribute__((destructor))
+static void write_stats(void)
+{
+	const char *name = getenv("FIREWIRE_SIM_STATS");
+	char line[256];
+	unsigned int i;
+	int fd, length = 0;
+
+	if (!name || !*name || calls_pid != getpid())
+		return;
+	for (i = 0; i < CALL_COUNT; ++i)
+		length += snprintf(line + length, sizeof(line) - length, "%s%s=%lu",
+				   i ? " " : "", call_names[i], calls[i]);
+	line[length++] = '\n';
+	fd = real_open(name, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1)
+		return;
+	if (write(fd, line, length) != length)
+		perror(name);
+	real_close(fd);
+}
+
+/*
+ * device files: fw0 is the local node, the other nodes with active links
+ * follow in the order of the configuration
+ */
+
+static int device_node(unsigned int device)
+{
+	unsigned int i, n = 0;
+
+	if (device == 0)
+		return local_index();
+	for (i = 0; i < bus->node_count; ++i)
+		if (!bus->nodes[i].local && bus->nodes[i].link_active && ++n == device)
+			return i;
+	return -1;
+}
+
+static unsigned int device_count(void)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < bus->node_count; ++i)
+		if (bus->nodes[i].link_active)
+			++n;
+	return n;
+}
+
+static int parse_device_name(const char *path)
+{
+	const char *p;
+	unsigned int device = 0;
+
+	if (strncmp(path, "/dev/fw", 7) || !path[7])
+		return -1;
+	for (p = path + 7; *p; ++p) {
+		if (!isdigit(*p) || device > MAX_NODES)
+			return -1;
+		device = device * 10 + (*p - '0');
+	}
+	return device;
+}
+
+static struct client *find_client(int fd)
+{
+	struct client *c;
+
+	for (c = clients; c; c = c->next)
+		if (c->fd == fd)
+			return c;
+	return NULL;
+}
+
+static void queue_event(struct client *c, u64 ready_ns, const void *data, size_t size)
+{
+	struct sim_event *e;
+	u64 one = 1;
+
+	e = malloc(sizeof(*e) + size);
+	if (!e)
+		fail("out of memory");
+	e->next = NULL;
+	e->ready_ns = ready_ns;
+	e->size = size;
+	memcpy(e->data, data, size);
+	*c->tail = e;
+	c->tail = &e->next;
+	if (write(c->fd, &one, sizeof(one)) != sizeof(one))
+		fail("cannot signal event: %s", strerror(errno));
+}
+
+static void fill_bus_reset(const struct client *c, struct fw_cdev_event_bus_reset *r)
+{
+	u32 bm_id = bus->nodes[irm_index() == NO_NODE ? 0 : irm_index()].csr[CSR_BUS_MANAGER_ID / 4];
+
+	memset(r, 0, sizeof(*r));
+	r->closure = c->bus_reset_closure;
+	r->type = FW_CDEV_EVENT_BUS_RESET;
+	r->node_id = 0xffc0 | bus->nodes[c->node].phy_id;
+	r->local_node_id = 0xffc0 | bus->nodes[local_index()].phy_id;
+	r->bm_node_id = irm_index() == NO_NODE || bm_id == 0x3f ? 0xffff : 0xffc0 | bm_id;
+	r->irm_node_id = irm_index() == NO_NODE ? 0xffff : 0xffc0 | bus->nodes[irm_index()].phy_id;
+	r->root_node_id = 0xffc0 | bus->nodes[bus->root].phy_id;
+	r->generation = bus->generation;
+}
+
+/* bus resets done by other processes are noticed late, but not missed */
+static void sync_generation(struct client *c)
+{
+	struct fw_cdev_event_bus_reset r;
+
+	lock_bus();
+	if (bus->reset_interval_ms && now_ns() >= bus->next_reset_ns)
+		bus_reset_locked();
+	if (c->generation != bus->generation) {
+		c->generation = bus->generation;
+		fill_bus_reset(c, &r);
+		queue_event(c, 0, &r, sizeof(r));
+	}
+	unlock_bus();
+}
+
+static void sync_all_clients(void)
+{
+	struct client *c;
+
+	for (c = clients; c; c = c->next)
+		sync_generation(c);
+}
+
+static int sim_open(const char *path, int flags)
+{
+	struct client *c;
+	int device, node;
+
+	device = parse_device_name(path);
+	if (device < 0)
+		return -2;
+	count_call(CALL_OPEN);
+	node = device_node(device);
+	if (node < 0) {
+		errno = ENOENT;
+		return -1;
+	}
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		errno = ENOMEM;
+		return -1;
+	}
+	c->fd = eventfd(0, EFD_SEMAPHORE | (flags & O_NONBLOCK ? EFD_NONBLOCK : 0) |
+			   (flags & O_CLOEXEC ? EFD_CLOEXEC : 0));
+	if (c->fd == -1) {
+		free(c);
+		return -1;
+	}
+	c->nonblock = flags & O_NONBLOCK;
+	c->node = node;
+	c->tail = &c->head;
+	lock_bus();
+	c->generation = bus->generation;
+	unlock_bus();
+	c->next = clients;
+	clients = c;
+	return c->fd;
+}
+
+int open(const char *path, int flags, ...)
+{
+	va_list ap;
+	mode_t mode = 0;
+	int fd;
+
+	if (flags & (O_CREAT | O_TMPFILE)) {
+		va_start(ap, flags);
+		mode = va_arg(ap, mode_t);
+		va_end(ap);
+	}
+	fd = sim_open(path, flags);
+	if (fd != -2)
+		return fd;
+	return real_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) __attribute__((alias("open")));
+
+int __open_2(const char *path, int flags)
+{
+	return open(path, flags);
+}
+
+int __open64_2(const char *path, int flags) __attribute__((alias("__open_2")));
+
+int close(int fd)
+{
+	struct client **p, *c;
+	struct sim_event *e;
+
+	for (p = &clients; *p; p = &(*p)->next)
+		if ((*p)->fd == fd) {
+			count_call(CALL_CLOSE);
+			c = *p;
+			*p = c->next;
+			while ((e = c->head)) {
+				c->head = e->next;
+				free(e);
+			}
+			free(c);
+			break;
+		}
+	return real_close(fd);
+}
+
+/*
+ * asynchronous requests
+ */
+
+static u32 read_csr(struct sim_node *node, unsigned int offset)
+{
+	switch (offset) {
+	case CSR_STATE_CLEAR:
+	case CSR_STATE_SET:
+		return node->state;
+	case CSR_NODE_IDS:
+		return (0xffc0 | node->phy_id) << 16;
+	case CSR_CYCLE_TIME:
+		return cycle_time();
+	case CSR_BUS_TIME:
+		return node->csr[offset / 4] | (cycle_time() >> 25);
+	default:
+		return node->csr[offset / 4];
+	}
+}
+
+static void write_csr(struct sim_node *node, unsigned int offset, u32 value)
+{
+	switch (offset) {
+	case CSR_STATE_CLEAR:
+		node->state &= ~value;
+		break;
+	case CSR_STATE_SET:
+		node->state |= value;
+		break;
+	case CSR_NODE_IDS:
+		break;
+	case CSR_RESET_START:
+		bus_reset_locked();
+		break;
+	case CSR_BUS_TIME:
+		node->csr[offset / 4] = value & ~0x7f;
+		break;
+	default:
+		node->csr[offset / 4] = value;
+		break;
+	}
+}
+
+static bool csr_is_read_only(unsigned int offset)
+{
+	return offset == CSR_CYCLE_TIME ||
+	       (offset >= CSR_CONFIG_ROM && offset < CSR_CONFIG_ROM_END) ||
+	       offset >= CSR_TOPOLOGY_MAP;
+}
+
+/* returns the rcode */
+static u32 access_memory(struct sim_node *node, u64 offset, u8 *buf,
+			 unsigned int length, bool write)
+{
+	unsigned int i;
+	u32 value;
+
+	if (offset + length <= MEMORY_SIZE) {
+		if (write)
+			memcpy(&node->memory[offset], buf, length);
+		else
+			memcpy(buf, &node->memory[offset], length);
+		return RCODE_COMPLETE;
+	}
+	if (offset < CSR_BASE || offset + length > CSR_BASE + CSR_SIZE ||
+	    (offset | length) & 3)
+		return RCODE_ADDRESS_ERROR;
+	offset -= CSR_BASE;
+	for (i = 0; i < length; i += 4) {
+		if (write) {
+			if (csr_is_read_only(offset + i))
+				return RCODE_ADDRESS_ERROR;
+			value = buf[i] << 24 | buf[i + 1] << 16 | buf[i + 2] << 8 | buf[i + 3];
+			write_csr(node, offset + i, value);
+		} else {
+			value = read_csr(node, offset + i);
+			buf[i] = value >> 24;
+			buf[i + 1] = value >> 16;
+			buf[i + 2] = value >> 8;
+			buf[i + 3] = value;
+		}
+	}
+	return RCODE_COMPLETE;
+}
+
+static u64 get_be(const u8 *p, unsigned int size)
+{
+	u64 v = 0;
+	unsigned int i;
+
+	for (i = 0; i < size; ++i)
+		v = v << 8 | p[i];
+	return v;
+}
+
+static void put_be(u8 *p, unsigned int size, u64 v)
+{
+	while (size--) {
+		p[size] = v;
+		v >>= 8;
+	}
+}
+
+static u64 swap_bytes(u64 v, unsigned int size)
+{
+	u8 buf[8];
+	unsigned int i;
+
+	put_be(buf, size, v);
+	for (v = 0, i = size; i > 0; --i)
+		v = v << 8 | buf[i - 1];
+	return v;
+}
+
+/* returns the rcode; the old value is returned in buf */
+static u32 lock_memory(struct sim_node *node, u32 tcode, u64 offset, u8 *buf,
+		       unsigned int *length)
+{
+	bool has_arg = tcode != TCODE_LOCK_FETCH_ADD && tcode != TCODE_LOCK_LITTLE_ADD;
+	unsigned int size = has_arg ? *length / 2 : *length;
+	u64 old, new, arg, data, mask = size == 8 ? ~0uLL : 0xffffffffuLL;
+	u8 value[8];
+	u32 rcode;
+
+	if (size != 4 && size != 8)
+		return RCODE_TYPE_ERROR;
+	arg = has_arg ? get_be(buf, size) : 0;
+	data = get_be(buf + (has_arg ? size : 0), size);
+	rcode = access_memory(node, offset, value, size, false);
+	if (rcode != RCODE_COMPLETE)
+		return rcode;
+	old = get_be(value, size);
+
+	switch (tcode) {
+	case TCODE_LOCK_MASK_SWAP:
+		new = (data & arg) | (old & ~arg);
+		break;
+	case TCODE_LOCK_COMPARE_SWAP:
+		new = old == arg ? data : old;
+		break;
+	case TCODE_LOCK_FETCH_ADD:
+		new = old + data;
+		break;
+	case TCODE_LOCK_LITTLE_ADD:
+		new = swap_bytes((swap_bytes(old, size) + swap_bytes(data, size)) & mask, size);
+		break;
+	case TCODE_LOCK_BOUNDED_ADD:
+		new = old != arg ? old + data : old;
+		break;
+	case TCODE_LOCK_WRAP_ADD:
+		new = old != arg ? old + data : data;
+		break;
+	default:
+		return RCODE_TYPE_ERROR;
+	}
+	put_be(value, size, new & mask);
+	if (new != old) {
+		rcode = access_memory(node, offset, value, size, true);
+		if (rcode != RCODE_COMPLETE)
+			return rcode;
+	}
+	put_be(buf, size, old);
+	*length = size;
+	return RCODE_COMPLETE;
+}
+
+/* forked benchmark jobs must not all get the same busy acks */
+static bool inject_busy(void)
+{
+	static pid_t seeded_pid;
+
+	if (!bus->busy_percent)
+		return false;
+	if (seeded_pid != getpid()) {
+		seeded_pid = getpid();
+		srand(seeded_pid ^ now_ns());
+	}
+	return (unsigned int)rand() % 100 < bus->busy_percent;
+}
+
+/*
+ * Returns the rcode; buf holds the request's data, and then the response's.
+ * The speed limit is checked by the kernel, but max_rec by the node itself.
+ */
+static u32 handle_request(unsigned int target, u32 tcode, u64 offset, u8 *buf,
+			  unsigned int *length)
+{
+	struct sim_node *node = &bus->nodes[target];
+	unsigned int max_payload = 2u << node->max_rec, length_written;
+
+	if (inject_busy())
+		return RCODE_BUSY;
+
+	switch (tcode) {
+	case TCODE_READ_QUADLET_REQUEST:
+	case TCODE_WRITE_QUADLET_REQUEST:
+		if (*length != 4)
+			return RCODE_TYPE_ERROR;
+		break;
+	case TCODE_READ_BLOCK_REQUEST:
+	case TCODE_WRITE_BLOCK_REQUEST:
+		if (*length > max_payload)
+			return RCODE_TYPE_ERROR;
+		break;
+	}
+
+	switch (tcode) {
+	case TCODE_READ_QUADLET_REQUEST:
+	case TCODE_READ_BLOCK_REQUEST:
+		return access_memory(node, offset, buf, *length, false);
+	case TCODE_WRITE_QUADLET_REQUEST:
+	case TCODE_WRITE_BLOCK_REQUEST:
+		length_written = *length;
+		*length = 0;
+		return access_memory(node, offset, buf, length_written, true);
+	default:
+		return lock_memory(node, tcode, offset, buf, length);
+	}
+}
+
+/* the response comes back after the request and the response have passed all hops */
+static u64 response_time(unsigned int target)
+{
+	return now_ns() + 2uLL * path(local_index(), target, NULL) * bus->latency_us * 1000;
+}
+
+static bool is_fcp_command(unsigned int target, const struct fw_cdev_send_request *request)
+{
+	return !bus->nodes[target].local &&
+	       (request->tcode == TCODE_WRITE_QUADLET_REQUEST ||
+		request->tcode == TCODE_WRITE_BLOCK_REQUEST) &&
+	       request->offset == CSR_BASE + CSR_FCP_COMMAND &&
+	       request->length >= 4;
+}
+
+/*
+ * Every simulated node is an AV/C unit that does not implement anything;
+ * its response is written to the local node's FCP_RESPONSE register, and
+ * goes to all clients that have allocated it, through whichever device
+ * file they have opened.
+ */
+static void send_fcp_response(unsigned int source, u8 *data, unsigned int length,
+			      u32 tcode, u64 ready_ns)
+{
+	struct fw_cdev_event_request2 *event;
+	struct allocation *a;
+	struct client *r;
+	u64 offset = CSR_BASE + CSR_FCP_RESPONSE;
+	unsigned int i;
+
+	event = malloc(sizeof(*event) + length);
+	if (!event)
+		fail("out of memory");
+	data[0] = AVC_NOT_IMPLEMENTED;
+	lock_bus();
+	event->source_node_id = 0xffc0 | bus->nodes[source].phy_id;
+	event->destination_node_id = 0xffc0 | bus->nodes[local_index()].phy_id;
+	event->generation = bus->generation;
+	ready_ns += response_time(source) - now_ns();
+	unlock_bus();
+	event->type = FW_CDEV_EVENT_REQUEST2;
+	event->tcode = tcode;
+	event->offset = offset;
+	event->card = 0;
+	event->length = length;
+	memcpy(event->data, data, length);
+
+	for (r = clients; r; r = r->next) {
+		for (i = 0; i < r->allocation_count; ++i) {
+			a = &r->allocations[i];
+			if (offset >= a->offset && offset + length <= a->end) {
+				event->closure = a->closure;
+				event->handle = r->next_handle++;
+				queue_event(r, ready_ns, event,
+					    offsetof(typeof(*event), data) + length);
+				break;
+			}
+		}
+	}
+	free(event);
+}
+
+static int sim_send_request(struct client *c, struct fw_cdev_send_request *request,
+			    bool broadcast)
+{
+	struct fw_cdev_event_response *response;
+	unsigned int length = request->length, i;
+	u32 rcode;
+	u64 ready_ns;
+	u8 speed;
+
+	switch (request->tcode) {
+	case TCODE_READ_QUADLET_REQUEST:
+	case TCODE_READ_BLOCK_REQUEST:
+	case TCODE_WRITE_QUADLET_REQUEST:
+	case TCODE_WRITE_BLOCK_REQUEST:
+		if (broadcast && request->tcode != TCODE_WRITE_QUADLET_REQUEST &&
+		    request->tcode != TCODE_WRITE_BLOCK_REQUEST) {
+			errno = EINVAL;
+			return -1;
+		}
+		break;
+	case TCODE_LOCK_MASK_SWAP:
+	case TCODE_LOCK_COMPARE_SWAP:
+	case TCODE_LOCK_FETCH_ADD:
+	case TCODE_LOCK_LITTLE_ADD:
+	case TCODE_LOCK_BOUNDED_ADD:
+	case TCODE_LOCK_WRAP_ADD:
+		if (!broadcast)
+			break;
+		/* fall through */
+	default:
+		errno = EINVAL;
+		return -1;
+	}
+	if (length > 4096) {
+		errno = EIO;
+		return -1;
+	}
+
+	response = malloc(sizeof(*response) + length);
+	if (!response) {
+		errno = ENOMEM;
+		return -1;
+	}
+	if (request->tcode != TCODE_READ_QUADLET_REQUEST &&
+	    request->tcode != TCODE_READ_BLOCK_REQUEST)
+		memcpy(response->data, u64_to_ptr(request->data), length);
+
+	lock_bus();
+	path(local_index(), c->node, &speed);
+	if (length > 512u << (broadcast ? SCODE_100 : speed)) {
+		unlock_bus();
+		free(response);
+		errno = EIO;
+		return -1;
+	}
+	if (request->generation != bus->generation) {
+		rcode = RCODE_GENERATION;
+		length = 0;
+	} else if (broadcast) {
+		for (i = 0; i < bus->node_count; ++i)
+			if (!bus->nodes[i].local && bus->nodes[i].link_active) {
+				length = request->length;
+				handle_request(i, request->tcode, request->offset,
+					       (u8 *)response->data, &length);
+			}
+		rcode = RCODE_COMPLETE;
+		length = 0;
+	} else {
+		rcode = handle_request(c->node, request->tcode, request->offset,
+				       (u8 *)response->data, &length);
+		if (rcode != RCODE_COMPLETE)
+			length = 0;
+	}
+	ready_ns = response_time(c->node);
+	unlock_bus();
+
+	response->closure = request->closure;
+	response->type = FW_CDEV_EVENT_RESPONSE;
+	response->rcode = rcode;
+	response->length = length;
+	queue_event(c, ready_ns, response, offsetof(typeof(*response), data) + length);
+	if (!broadcast && rcode == RCODE_COMPLETE && is_fcp_command(c->node, request))
+		send_fcp_response(c->node, (u8 *)response->data, request->length,
+				  request->tcode, ready_ns);
+	free(response);
+	sync_all_clients();
+	return 0;
+}
+
+/*
+ * PHY packets
+ */
+
+static u8 phy_register(const struct sim_node *node, unsigned int page,
+		       unsigned int port, unsigned int reg)
+{
+	bool connected;
+
+	switch (reg) {
+	case 0:
+		return node->phy_id << 2 | (node->parent == NO_NODE) << 1;
+	case 1:
+		return node->gap_count;
+	case 2:
+		return 7 << 5 | node->port_count;
+	case 3:
+		return (node->speed < 2 ? node->speed : 2) << 5;
+	case 4:
+		return node->link_active << 7 | node->contender << 6;
+	case 5:
+	case 6:
+	case 7:
+		return 0;
+	}
+	if (page == 0 && port < node->port_count) {
+		connected = node->peer[port] != NO_NODE && !node->port_disabled[port];
+		if (reg == 8)
+			return (connected ? 0xf0 : 0x00) |
+			       (connected && node->peer[port] != node->parent) << 3 |
+			       connected << 2 | connected << 1 | node->port_disabled[port];
+		if (reg == 9 && connected)
+			return node->speed << 5;
+		return 0;
+	}
+	if (page == 1) {
+		switch (reg) {
+		case 8:
+			return 1;
+		case 10:
+			return node->phy_vendor >> 16;
+		case 11:
+			return node->phy_vendor >> 8;
+		case 12:
+			return node->phy_vendor;
+		case 13:
+			return node->phy_product >> 16;
+		case 14:
+			return node->phy_product >> 8;
+		case 15:
+			return node->phy_product;
+		}
+	}
+	return 0;
+}
+
+static u32 remote_command(struct sim_node *node, u32 packet)
+{
+	unsigned int port = (packet >> 11) & 0xf, cmd = packet & 7;
+	u32 reply = (packet & 0xff03f807) | 0xa << 18;
+
+	if (port >= node->port_count)
+		return reply;
+	if (cmd == 1)
+		node->port_disabled[port] = true;
+	else if (cmd == 5)
+		node->port_disabled[port] = false;
+	reply |= 1 << 3;
+	if (node->port_disabled[port])
+		reply |= 1 << 4;
+	else if (node->peer[port] != NO_NODE)
+		reply |= 1 << 5 | 1 << 6;
+	return reply;
+}
+
+/* returns the number of reply packets */
+static unsigned int handle_phy_packet(u32 packet, u32 *replies, u32 *ping_ticks)
+{
+	unsigned int phy_id = (packet >> 24) & 0x3f, hops;
+	struct sim_node *node = NULL;
+	unsigned int reg;
+
+	if (phy_id < bus->node_count)
+		node = &bus->nodes[bus->by_phy_id[phy_id]];
+
+	if ((packet >> 30) == 1) {
+		/* link-on */
+		if (node)
+			node->link_active = true;
+		return 0;
+	}
+	if ((packet >> 30) != 0)
+		return 0;
+	if (packet & (3 << 22)) {
+		/* PHY configuration, effective at the next bus reset */
+		if ((packet & (1 << 23)) && node)
+			bus->pending_root = bus->by_phy_id[phy_id];
+		if (packet & (1 << 22))
+			bus->pending_gap_count = (packet >> 16) & 0x3f;
+		return 0;
+	}
+	if (!node)
+		return 0;
+
+	switch ((packet >> 18) & 0xf) {
+	case 0:
+		/* ping */
+		hops = path(local_index(), bus->by_phy_id[phy_id], NULL);
+		*ping_ticks = (2uLL * hops * bus->latency_us * TICKS_PER_SECOND + 999999) / 1000000 +
+			      2 * hops * 4 + 4;
+		return self_ids_of(node, replies);
+	case 1:
+	case 5:
+		/* remote access */
+		reg = (packet >> 8) & 7;
+		if (packet & (4 << 18))
+			reg += 8;
+		replies[0] = (packet & 0xff03ff00) | (packet & (7 << 18)) | (2 << 18) |
+			     phy_register(node, (packet >> 15) & 7, (packet >> 11) & 0xf, reg);
+		return 1;
+	case 8:
+		replies[0] = remote_command(node, packet);
+		return 1;
+	default:
+		/* resume, and everything else, has no reply */
+		return 0;
+	}
+}
+
+static int sim_send_phy_packet(struct client *c, struct fw_cdev_send_phy_packet *p)
+{
+	u64 buf[(sizeof(struct fw_cdev_event_phy_packet) + 8 + 7) / 8];
+	struct fw_cdev_event_phy_packet *event = (void *)buf;
+	u32 replies[8], ping_ticks = 0, rcode = RCODE_COMPLETE;
+	unsigned int count = 0, i;
+	u64 ready_ns;
+	struct client *r;
+
+	if (!bus->nodes[c->node].local) {
+		errno = ENOSYS;
+		return -1;
+	}
+
+	lock_bus();
+	if (p->generation != bus->generation)
+		rcode = RCODE_GENERATION;
+	else if (p->data[1] == ~p->data[0])
+		count = handle_phy_packet(p->data[0], replies, &ping_ticks);
+	ready_ns = now_ns() + ping_ticks * 1000000uLL / (TICKS_PER_SECOND / 1000);
+	unlock_bus();
+
+	event->closure = p->closure;
+	event->type = FW_CDEV_EVENT_PHY_PACKET_SENT;
+	event->rcode = rcode;
+	event->length = ping_ticks ? 4 : 0;
+	event->data[0] = ping_ticks;
+	queue_event(c, ready_ns, event, offsetof(typeof(*event), data) + event->length);
+
+	for (i = 0; i < count; ++i)
+		for (r = clients; r; r = r->next)
+			if (r->phy_receive) {
+				event->closure = r->phy_receive_closure;
+				event->type = FW_CDEV_EVENT_PHY_PACKET_RECEIVED;
+				event->rcode = RCODE_COMPLETE;
+				event->length = 8;
+				event->data[0] = replies[i];
+				event->data[1] = ~replies[i];
+				queue_event(r, ready_ns, event, offsetof(typeof(*event), data) + 8);
+			}
+	return 0;
+}
+
+/*
+ * ioctls
+ */
+
+static int sim_get_info(struct client *c, struct fw_cdev_get_info *info)
+{
+	struct fw_cdev_event_bus_reset r;
+	unsigned int length;
+
+	c->bus_reset_closure = info->bus_reset_closure;
+	lock_bus();
+	length = sizeof(bus->nodes[c->node].rom);
+	if (info->rom)
+		memcpy(u64_to_ptr(info->rom), bus->nodes[c->node].rom,
+		       info->rom_length < length ? info->rom_length : length);
+	fill_bus_reset(c, &r);
+	unlock_bus();
+
+	info->version = 5;
+	info->rom_length = length;
+	info->card = 0;
+	if (info->bus_reset)
+		memcpy(u64_to_ptr(info->bus_reset), &r, sizeof(r));
+	return 0;
+}
+
+static int sim_get_cycle_timer2(struct fw_cdev_get_cycle_timer2 *ct)
+{
+	struct timespec ts;
+
+	if (clock_gettime(ct->clk_id, &ts) < 0)
+		return -1;
+	ct->tv_sec = ts.tv_sec;
+	ct->tv_nsec = ts.tv_nsec;
+	ct->cycle_timer = cycle_time();
+	return 0;
+}
+
+static int sim_allocate(struct client *c, struct fw_cdev_allocate *allocate)
+{
+	struct allocation *a;
+
+	if (c->allocation_count >= MAX_ALLOCATIONS) {
+		errno = EBUSY;
+		return -1;
+	}
+	a = &c->allocations[c->allocation_count++];
+	a->offset = allocate->offset;
+	a->end = allocate->offset + allocate->length;
+	a->closure = allocate->closure;
+	a->handle = c->next_handle++;
+	allocate->handle = a->handle;
+	return 0;
+}
+
+static int sim_deallocate(struct client *c, struct fw_cdev_deallocate *deallocate)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->allocation_count; ++i)
+		if (c->allocations[i].handle == deallocate->handle) {
+			c->allocations[i] = c->allocations[--c->allocation_count];
+			return 0;
+		}
+	errno = EINVAL;
+	return -1;
+}
+
+static int sim_ioctl(struct client *c, unsigned long request, void *arg)
+{
+	struct fw_cdev_get_cycle_timer *ct;
+	struct timespec ts;
+	u8 speed;
+
+	count_call(CALL_IOCTL);
+	sync_generation(c);
+	switch (request) {
+	case FW_CDEV_IOC_GET_INFO:
+		return sim_get_info(c, arg);
+	case FW_CDEV_IOC_SEND_REQUEST:
+		return sim_send_request(c, arg, false);
+	case FW_CDEV_IOC_SEND_BROADCAST_REQUEST:
+		return sim_send_request(c, arg, true);
+	case FW_CDEV_IOC_INITIATE_BUS_RESET:
+		lock_bus();
+		bus_reset_locked();
+		unlock_bus();
+		sync_all_clients();
+		return 0;
+	case FW_CDEV_IOC_GET_CYCLE_TIMER:
+		ct = arg;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ct->local_time = ts.tv_sec * 1000000uLL + ts.tv_nsec / 1000;
+		ct->cycle_timer = cycle_time();
+		return 0;
+	case FW_CDEV_IOC_GET_CYCLE_TIMER2:
+		return sim_get_cycle_timer2(arg);
+	case FW_CDEV_IOC_GET_SPEED:
+		lock_bus();
+		path(local_index(), c->node, &speed);
+		unlock_bus();
+		return speed;
+	case FW_CDEV_IOC_SEND_PHY_PACKET:
+		return sim_send_phy_packet(c, arg);
+	case FW_CDEV_IOC_RECEIVE_PHY_PACKETS:
+		if (!bus->nodes[c->node].local) {
+			errno = ENOSYS;
+			return -1;
+		}
+		c->phy_receive = true;
+		c->phy_receive_closure = ((struct fw_cdev_receive_phy_packets *)arg)->closure;
+		return 0;
+	case FW_CDEV_IOC_ALLOCATE:
+		return sim_allocate(c, arg);
+	case FW_CDEV_IOC_DEALLOCATE:
+		return sim_deallocate(c, arg);
+	case FW_CDEV_IOC_SEND_RESPONSE:
+		/* requests from the simulated nodes never fail */
+		return 0;
+	default:
+		/* isochronous contexts and resources */
+		errno = ENOTTY;
+		return -1;
+	}
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	struct client *c;
+	va_list ap;
+	void *arg;
+
+	va_start(ap, request);
+	arg = va_arg(ap, void *);
+	va_end(ap);
+	c = find_client(fd);
+	if (!c)
+		return real_ioctl(fd, request, arg);
+	return sim_ioctl(c, request, arg);
+}
+
+/*
+ * events
+ */
+
+static ssize_t sim_read(struct client *c, void *buf, size_t count)
+{
+	struct sim_event *e;
+	u64 value;
+	size_t size;
+
+	sync_generation(c);
+	while (!c->head) {
+		if (c->nonblock) {
+			errno = EAGAIN;
+			return -1;
+		}
+		/* nothing will happen on the bus, except for an injected reset */
+		if (bus->reset_interval_ms)
+			sleep_until(bus->next_reset_ns);
+		else if (real_read(c->fd, &value, sizeof(value)) < 0)
+			return -1;
+		sync_generation(c);
+	}
+
+	e = c->head;
+	if (real_read(c->fd, &value, sizeof(value)) < 0)
+		return -1;
+	c->head = e->next;
+	if (!c->head)
+		c->tail = &c->head;
+	if (e->ready_ns > now_ns())
+		sleep_until(e->ready_ns);
+	size = count < e->size ? count : e->size;
+	memcpy(buf, e->data, size);
+	free(e);
+	return size;
+}
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	struct client *c = find_client(fd);
+
+	if (!c)
+		return real_read(fd, buf, count);
+	count_call(CALL_READ);
+	return sim_read(c, buf, count);
+}
+
+ssize_t __read_chk(int fd, void *buf, size_t count, size_t buflen)
+{
+	if (count > buflen)
+		abort();
+	return read(fd, buf, count);
+}
+
+/* the eventfds can be polled natively, but injected resets need a timeout */
+int poll(struct pollfd *fds, nfds_t nfds, int timeout)
+{
+	struct client *c;
+	bool any = false;
+	u64 deadline = 0, now, next;
+	nfds_t i;
+	int r, t;
+
+	for (i = 0; i < nfds; ++i) {
+		c = find_client(fds[i].fd);
+		if (c) {
+			sync_generation(c);
+			any = true;
+		}
+	}
+	if (any)
+		count_call(CALL_POLL);
+	if (!any || !bus->reset_interval_ms)
+		return real_poll(fds, nfds, timeout);
+
+	if (timeout >= 0)
+		deadline = now_ns() + timeout * 1000000uLL;
+	for (;;) {
+		now = now_ns();
+		next = bus->next_reset_ns;
+		if (timeout >= 0 && deadline < next)
+			next = deadline;
+		t = next > now ? (next - now + 999999) / 1000000 : 0;
+		r = real_poll(fds, nfds, t);
+		if (r != 0)
+			return r;
+		if (timeout >= 0 && now_ns() >= deadline)
+			return 0;
+		sync_all_clients();
+	}
+}
+
+int __poll_chk(struct pollfd *fds, nfds_t nfds, int timeout, size_t fdslen)
+{
+	if (fdslen / sizeof(*fds) < nfds)
+		abort();
+	return poll(fds, nfds, timeout);
+}
+
+/*
+ * device file enumeration: the simulated bus has no sysfs, so the tools fall
+ * back to looking at the device files themselves
+ */
+
+int scandir(const char *dir, struct dirent ***namelist,
+	    int (*filter)(const struct dirent *),
+	    int (*compar)(const struct dirent **, const struct dirent **))
+{
+	static int (*real_scandir)(const char *, struct dirent ***,
+				   int (*)(const struct dirent *),
+				   int (*)(const struct dirent **, const struct dirent **));
+	struct dirent **list, *d;
+	unsigned int count, i;
+	int n = 0;
+
+	if (!strcmp(dir, "/sys/bus/firewire/devices")) {
+		count_call(CALL_SCANDIR);
+		errno = ENOENT;
+		return -1;
+	}
+	if (strcmp(dir, "/dev") && strcmp(dir, "/dev/")) {
+		if (!real_scandir)
+			real_scandir = dlsym(RTLD_NEXT, "scandir");
+		return real_scandir(dir, namelist, filter, compar);
+	}
+
+	count_call(CALL_SCANDIR);
+	count = device_count();
+	list = malloc((count ? count : 1) * sizeof(*list));
+	if (!list) {
+		errno = ENOMEM;
+		return -1;
+	}
+	for (i = 0; i < count; ++i) {
+		d = calloc(1, sizeof(*d));
+		if (!d) {
+			while (n > 0)
+				free(list[--n]);
+			free(list);
+			errno = ENOMEM;
+			return -1;
+		}
+		d->d_ino = i + 1;
+		d->d_reclen = sizeof(*d);
+		d->d_type = DT_CHR;
+		snprintf(d->d_name, sizeof(d->d_name), "fw%u", i);
+		if (filter && !filter(d))
+			free(d);
+		else
+			list[n++] = d;
+	}
+	if (compar)
+		qsort(list, n, sizeof(*list), (int (*)(const void *, const void *))compar);
+	*namelist = list;
+	return n;
+}
@@ -0,0 +1,1007 @@
+/*
+ * fwutils.c - common code of the FireWire utilities
+ *
+ * licensed under the terms of the GNU General Public License, version 2
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/firewire-cdev.h>
+#include <linux/firewire-constants.h>
+#include "fwutils.h"
+
+#define ptr_to_u64(p) ((uintptr_t)(p))
+#define u64_to_ptr(p) ((void *)(uintptr_t)(p))
+
+typedef __u8 u8;
+typedef __u32 u32;
+typedef __u64 u64;
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof *(a))
+
+enum request_kind {
+	KIND_REQUEST,
+	KIND_BROADCAST,
+	KIND_PHY_PACKET,
+};
+
+struct request {
+	struct request *prev, *next;
+	struct fw_device *dev;
+	enum request_kind kind;
+	u32 tcode;
+	u64 offset;
+	u32 quadlets[2];
+	u32 generation;		/* with which it was sent */
+	unsigned int resets;
+	bool timed_out;		/* already completed, but still owned by the kernel */
+	u64 deadline;		/* in microseconds */
+	fw_response_func func;
+	void *arg;
+	unsigned int length;
+	u8 data[];
+};
+
+struct request_list {
+	struct request *head, *tail;
+};
+
+struct fw_engine {
+	struct fw_device **devices;
+	unsigned int device_count;
+	struct pollfd *pfds;
+	struct request_list queued;	/* in the order of submission */
+	struct request_list in_flight;
+	unsigned int pending;
+	unsigned int timeout_ms;
+	bool retry_on_reset;
+	fw_device_func reset_func;
+	void *reset_arg;
+	fw_device_func removal_func;
+	void *removal_arg;
+	fw_event_func event_func;
+	void *event_arg;
+	/* the largest event is a response or request with a payload of 16 KB */
+#ifdef HAVE_CDEV_4
+	u64 buf[(sizeof(struct fw_cdev_event_request2) + 16384) / 8 + 1];
+#else
+	u64 buf[(sizeof(struct fw_cdev_event_request) + 16384) / 8 + 1];
+#endif
+};
+
+/*
+ * Device files
+ */
+
+int fw_device_filter(const struct dirent *dirent)
+{
+	unsigned int i;
+
+	if (dirent->d_name[0] != 'f' ||
+	    dirent->d_name[1] != 'w')
+		return false;
+	i = 2;
+	do {
+		if (!isdigit(dirent->d_name[i]))
+			return false;
+	} while (dirent->d_name[++i]);
+	return true;
+}
+
+int fw_device_number(const char *name)
+{
+	unsigned long n;
+	char *end;
+
+	if (!strncmp(name, "/dev/", 5))
+		name += 5;
+	if (strncmp(name, "fw", 2) || !isdigit(name[2]))
+		return -1;
+	n = strtoul(name + 2, &end, 10);
+	if (*end || n > 0x7fffffff)
+		return -1;
+	return n;
+}
+
+int fw_scan_devices(const char *dir, struct dirent ***namelist)
+{
+	u64 t = fw_timing_begin();
+	int count;
+
+	count = scandir(dir, namelist, fw_device_filter, versionsort);
+	fw_timing_end(FW_TIMING_SCAN, t);
+	return count;
+}
+
+void fw_free_devices(struct dirent **namelist, int count)
+{
+	int i;
+
+	for (i = 0; i < count; ++i)
+		free(namelist[i]);
+	free(namelist);
+}
+
+static int get_info(struct fw_device *dev)
+{
+	struct fw_cdev_get_info get_info;
+	__u32 version;
+	u64 t;
+	int r;
+
+	/*
+	 * The kernel behaves as the version we ask for, but returns its own,
+	 * so the lower one is what we get.  Version 5 also makes the kernel
+	 * flush iso interrupt headers that would overflow their page.
+	 */
+#if defined(FW_CDEV_IOC_FLUSH_ISO)
+	version = 5;
+#elif defined(HAVE_CDEV_4)
+	version = 4;
+#else
+	version = 3;
+#endif
+	get_info.version = version;
+	get_info.rom_length = sizeof(dev->rom);
+	get_info.rom = ptr_to_u64(dev->rom);
+	get_info.bus_reset = ptr_to_u64(&dev->bus);
+	get_info.bus_reset_closure = 0;
+	t = fw_timing_begin();
+	r = ioctl(dev->fd, FW_CDEV_IOC_GET_INFO, &get_info);
+	fw_timing_end(FW_TIMING_GET_INFO, t);
+	if (r < 0)
+		return -1;
+	dev->card = get_info.card;
+	dev->version = get_info.version < version ? get_info.version : version;
+	dev->rom_length = get_info.rom_length < sizeof(dev->rom)
+			  ? get_info.rom_length : sizeof(dev->rom);
+	return 0;
+}
+
+int fw_device_open(struct fw_device *dev, const char *name)
+{
+	u64 t;
+	int err;
+
+	memset(dev, 0, sizeof(*dev));
+	dev->name = strdup(name);
+	if (!dev->name)
+		return -1;
+	t = fw_timing_begin();
+	dev->fd = open(name, O_RDWR);
+	fw_timing_end(FW_TIMING_OPEN, t);
+	if (dev->fd == -1)
+		goto error;
+	if (get_info(dev) < 0) {
+		err = errno;
+		close(dev->fd);
+		errno = err;
+		goto error;
+	}
+	return 0;
+
+error:
+	err = errno;
+	free(dev->name);
+	dev->name = NULL;
+	dev->fd = -1;
+	errno = err;
+	return -1;
+}
+
+int fw_device_update(struct fw_device *dev)
+{
+	return get_info(dev);
+}
+
+void fw_device_close(struct fw_device *dev)
+{
+	if (dev->engine)
+		fw_engine_remove_device(dev->engine, dev);
+	if (dev->fd != -1)
+		close(dev->fd);
+	free(dev->name);
+	dev->name = NULL;
+	dev->fd = -1;
+}
+
+/*
+ * The largest block request to the node is limited by the max_rec field
+ * of its bus info block, and by the speed of the path to it (512 bytes
+ * at S100, doubling with every step).  The kernel knows both for the
+ * current generation, so this costs no bus transaction.
+ */
+unsigned int fw_device_max_payload(const struct fw_device *dev)
+{
+	unsigned int max_payload, max_rec, speed = SCODE_100;
+
+#ifdef FW_CDEV_IOC_GET_SPEED
+	int r = ioctl(dev->fd, FW_CDEV_IOC_GET_SPEED);
+	if (r >= 0)
+		speed = r;
+#endif
+	max_payload = 512 << speed;
+	if (dev->rom_length >= 12) {
+		/* the kernel caches the ROM in CPU byte order */
+		max_rec = (dev->rom[2] >> 12) & 0xf;
+		/* 0 and values above 4096 bytes are reserved */
+		if (max_rec >= 1 && max_rec <= 11 && (2u << max_rec) < max_payload)
+			max_payload = 2u << max_rec;
+	}
+	return max_payload;
+}
+
+int fw_device_find(struct fw_device *dev,
+		   bool (*match)(const struct fw_device *dev, void *arg), void *arg)
+{
+	struct dirent **ents;
+	bool found = false, eacces = false;
+	char *name;
+	int count, i;
+
+	count = fw_scan_devices("/dev", &ents);
+	if (count < 0)
+		return -1;
+	for (i = 0; i < count && !found; ++i) {
+		if (asprintf(&name, "/dev/%s", ents[i]->d_name) < 0)
+			break;
+		if (fw_device_open(dev, name) == 0) {
+			found = match(dev, arg);
+			if (!found)
+				fw_device_close(dev);
+		} else if (errno == EACCES) {
+			eacces = true;
+		}
+		free(name);
+	}
+	fw_free_devices(ents, count);
+	if (found)
+		return 0;
+	errno = eacces ? EACCES : ENOENT;
+	return -1;
+}
+
+#ifdef FW_CDEV_IOC_RECEIVE_PHY_PACKETS
+int fw_device_receive_phy_packets(struct fw_device *dev)
+{
+	struct fw_cdev_receive_phy_packets receive_phy_packets;
+
+	receive_phy_packets.closure = 0;
+	return ioctl(dev->fd, FW_CDEV_IOC_RECEIVE_PHY_PACKETS, &receive_phy_packets);
+}
+#endif
+
+/*
+ * Asynchronous engine
+ */
+
+static u64 now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000uLL + ts.tv_nsec / 1000;
+}
+
+static void list_append(struct request_list *list, struct request *r)
+{
+	r->prev = list->tail;
+	r->next = NULL;
+	if (list->tail)
+		list->tail->next = r;
+	else
+		list->head = r;
+	list->tail = r;
+}
+
+static void list_prepend(struct request_list *list, struct request *r)
+{
+	r->prev = NULL;
+	r->next = list->head;
+	if (list->head)
+		list->head->prev = r;
+	else
+		list->tail = r;
+	list->head = r;
+}
+
+static void list_remove(struct request_list *list, struct request *r)
+{
+	if (r->prev)
+		r->prev->next = r->next;
+	else
+		list->head = r->next;
+	if (r->next)
+		r->next->prev = r->prev;
+	else
+		list->tail = r->prev;
+}
+
+struct fw_engine *fw_engine_new(void)
+{
+	return calloc(1, sizeof(struct fw_engine));
+}
+
+static void free_list(struct request_list *list)
+{
+	struct request *r, *next;
+
+	for (r = list->head; r; r = next) {
+		next = r->next;
+		free(r);
+	}
+	list->head = NULL;
+	list->tail = NULL;
+}
+
+void fw_engine_free(struct fw_engine *engine)
+{
+	unsigned int i;
+
+	if (!engine)
+		return;
+	for (i = 0; i < engine->device_count; ++i)
+		engine->devices[i]->engine = NULL;
+	free_list(&engine->queued);
+	free_list(&engine->in_flight);
+	free(engine->devices);
+	free(engine->pfds);
+	free(engine);
+}
+
+void fw_engine_set_timeout(struct fw_engine *engine, unsigned int ms)
+{
+	engine->timeout_ms = ms;
+}
+
+void fw_engine_set_retry_on_reset(struct fw_engine *engine, bool retry)
+{
+	engine->retry_on_reset = retry;
+}
+
+void fw_engine_set_reset_handler(struct fw_engine *engine, fw_device_func func, void *arg)
+{
+	engine->reset_func = func;
+	engine->reset_arg = arg;
+}
+
+void fw_engine_set_removal_handler(struct fw_engine *engine, fw_device_func func, void *arg)
+{
+	engine->removal_func = func;
+	engine->removal_arg = arg;
+}
+
+void fw_engine_set_event_handler(struct fw_engine *engine, fw_event_func func, void *arg)
+{
+	engine->event_func = func;
+	engine->event_arg = arg;
+}
+
+int fw_engine_add_device(struct fw_engine *engine, struct fw_device *dev)
+{
+	struct fw_device **devices;
+	struct pollfd *pfds;
+
+	if (dev->engine == engine)
+		return 0;
+	if (dev->engine) {
+		errno = EBUSY;
+		return -1;
+	}
+	devices = realloc(engine->devices, (engine->device_count + 1) * sizeof(*devices));
+	if (!devices)
+		return -1;
+	engine->devices = devices;
+	pfds = realloc(engine->pfds, (engine->device_count + 1) * sizeof(*pfds));
+	if (!pfds)
+		return -1;
+	engine->pfds = pfds;
+	engine->devices[engine->device_count++] = dev;
+	dev->engine = engine;
+	dev->in_flight = 0;
+	dev->queued = 0;
+	return 0;
+}
+
+static void cancel_requests(struct fw_engine *engine, struct request_list *list,
+			    struct fw_device *dev)
+{
+	struct request *r, *next;
+
+	for (r = list->head; r; r = next) {
+		next = r->next;
+		if (r->dev != dev)
+			continue;
+		list_remove(list, r);
+		if (!r->timed_out) {
+			--engine->pending;
+			r->func(dev, RCODE_CANCELLED, NULL, 0, r->arg);
+		}
+		free(r);
+	}
+}
+
+void fw_engine_remove_device(struct fw_engine *engine, struct fw_device *dev)
+{
+	unsigned int i;
+
+	if (dev->engine != engine)
+		return;
+	for (i = 0; i < engine->device_count; ++i)
+		if (engine->devices[i] == dev) {
+			engine->devices[i] = engine->devices[--engine->device_count];
+			break;
+		}
+	dev->engine = NULL;
+	cancel_requests(engine, &engine->queued, dev);
+	cancel_requests(engine, &engine->in_flight, dev);
+	dev->in_flight = 0;
+	dev->queued = 0;
+}
+
+/* the request is then owned by the kernel until its completion event */
+static int send_request(struct fw_engine *engine, struct request *r)
+{
+	struct fw_device *dev = r->dev;
+	u64 t = fw_timing_begin();
+	int ret;
+
+	r->generation = dev->bus.generation;
+	if (r->kind == KIND_PHY_PACKET) {
+#ifdef FW_CDEV_IOC_SEND_PHY_PACKET
+		struct fw_cdev_send_phy_packet send_phy_packet;
+
+		send_phy_packet.closure = ptr_to_u64(r);
+		send_phy_packet.data[0] = r->quadlets[0];
+		send_phy_packet.data[1] = r->quadlets[1];
+		send_phy_packet.generation = r->generation;
+		ret = ioctl(dev->fd, FW_CDEV_IOC_SEND_PHY_PACKET, &send_phy_packet);
+#else
+		errno = ENOTTY;
+		ret = -1;
+#endif
+	} else {
+		struct fw_cdev_send_request send_request;
+
+		send_request.tcode = r->tcode;
+		send_request.length = r->length;
+		send_request.offset = r->offset;
+		send_request.closure = ptr_to_u64(r);
+		send_request.data = r->length ? ptr_to_u64(r->data) : 0;
+		send_request.generation = r->generation;
+		ret = ioctl(dev->fd, r->kind == KIND_BROADCAST ? FW_CDEV_IOC_SEND_BROADCAST_REQUEST
+							       : FW_CDEV_IOC_SEND_REQUEST,
+			    &send_request);
+	}
+	fw_timing_end(FW_TIMING_SEND, t);
+	if (ret < 0)
+		return -1;
+	r->deadline = engine->timeout_ms ? now_us() + engine->timeout_ms * 1000uLL : 0;
+	++dev->in_flight;
+	list_append(&engine->in_flight, r);
+	return 0;
+}
+
+/*
+ * Sends the queued requests of all devices that have room for them; a
+ * request that cannot be sent at all completes with a send error.
+ */
+static void send_queued(struct fw_engine *engine)
+{
+	struct request *r, *next;
+
+	for (r = engine->queued.head; r; r = next) {
+		next = r->next;
+		if (r->dev->in_flight >= FW_MAX_IN_FLIGHT)
+			continue;
+		list_remove(&engine->queued, r);
+		--r->dev->queued;
+		if (send_request(engine, r) < 0) {
+			--engine->pending;
+			r->func(r->dev, RCODE_SEND_ERROR, NULL, 0, r->arg);
+			free(r);
+			/* the callback might have submitted or removed anything */
+			next = engine->queued.head;
+		}
+	}
+}
+
+static int submit(struct fw_engine *engine, struct fw_device *dev,
+		  enum request_kind kind, unsigned int tcode, u64 offset,
+		  const u32 *quadlets, const void *data, unsigned int length,
+		  fw_response_func func, void *arg)
+{
+	struct request *r;
+
+	if (dev->engine != engine) {
+		errno = EINVAL;
+		return -1;
+	}
+	r = malloc(sizeof(*r) + length);
+	if (!r)
+		return -1;
+	r->dev = dev;
+	r->kind = kind;
+	r->tcode = tcode;
+	r->offset = offset;
+	if (quadlets)
+		memcpy(r->quadlets, quadlets, sizeof(r->quadlets));
+	r->resets = 0;
+	r->timed_out = false;
+	r->func = func;
+	r->arg = arg;
+	r->length = length;
+	if (data && length)
+		memcpy(r->data, data, length);
+	else
+		memset(r->data, 0, length);
+
+	/* the first error is reported to the caller directly */
+	if (!dev->queued && dev->in_flight < FW_MAX_IN_FLIGHT) {
+		if (send_request(engine, r) < 0) {
+			free(r);
+			return -1;
+		}
+	} else {
+		list_append(&engine->queued, r);
+		++dev->queued;
+	}
+	++engine->pending;
+	return 0;
+}
+
+int fw_submit_request(struct fw_engine *engine, struct fw_device *dev,
+		      unsigned int tcode, __u64 offset,
+		      const void *data, unsigned int length,
+		      fw_response_func func, void *arg)
+{
+	return submit(engine, dev, KIND_REQUEST, tcode, offset, NULL,
+		      data, length, func, arg);
+}
+
+int fw_submit_broadcast_request(struct fw_engine *engine, struct fw_device *dev,
+				unsigned int tcode, __u64 offset,
+				const void *data, unsigned int length,
+				fw_response_func func, void *arg)
+{
+	return submit(engine, dev, KIND_BROADCAST, tcode, offset, NULL,
+		      data, length, func, arg);
+}
+
+#ifdef FW_CDEV_IOC_SEND_PHY_PACKET
+int fw_submit_phy_packet(struct fw_engine *engine, struct fw_device *dev,
+			 __u32 quadlet0, __u32 quadlet1,
+			 fw_response_func func, void *arg)
+{
+	u32 quadlets[2] = { quadlet0, quadlet1 };
+
+	return submit(engine, dev, KIND_PHY_PACKET, 0, 0, quadlets,
+		      NULL, 0, func, arg);
+}
+#endif
+
+unsigned int fw_engine_pending(const struct fw_engine *engine)
+{
+	return engine->pending;
+}
+
+/*
+ * A request that was not sent because of a bus reset goes to the front of
+ * the queue, so that it still precedes the later requests to its device.
+ */
+static bool retry_request(struct fw_engine *engine, struct request *r)
+{
+	if (!engine->retry_on_reset || r->resets >= FW_MAX_RESETS)
+		return false;
+	if (fw_device_update(r->dev) < 0 || r->dev->bus.generation == r->generation)
+		return false;
+	++r->resets;
+	list_prepend(&engine->queued, r);
+	++r->dev->queued;
+	return true;
+}
+
+static void complete(struct fw_engine *engine, struct request *r,
+		     u32 rcode, const void *data, unsigned int length)
+{
+	list_remove(&engine->in_flight, r);
+	--r->dev->in_flight;
+	if (r->timed_out) {
+		free(r);
+		return;
+	}
+	if (rcode == RCODE_GENERATION && retry_request(engine, r))
+		return;
+	--engine->pending;
+	r->func(r->dev, rcode, data, length, r->arg);
+	free(r);
+}
+
+static void handle_event(struct fw_engine *engine, struct fw_device *dev)
+{
+	union fw_cdev_event *event = (void *)engine->buf;
+	struct request *r;
+
+	switch (event->common.type) {
+	case FW_CDEV_EVENT_BUS_RESET:
+		dev->bus = event->bus_reset;
+		if (engine->reset_func)
+			engine->reset_func(dev, engine->reset_arg);
+		return;
+	case FW_CDEV_EVENT_RESPONSE:
+		r = u64_to_ptr(event->response.closure);
+		complete(engine, r, event->response.rcode,
+			 event->response.data, event->response.length);
+		return;
+#ifdef FW_CDEV_EVENT_PHY_PACKET_SENT
+	case FW_CDEV_EVENT_PHY_PACKET_SENT:
+		r = u64_to_ptr(event->phy_packet.closure);
+		if (r) {
+			complete(engine, r, event->phy_packet.rcode,
+				 event->phy_packet.data, event->phy_packet.length);
+			return;
+		}
+		break;
+#endif
+	}
+	if (engine->event_func)
+		engine->event_func(dev, event, engine->event_arg);
+}
+
+/* completes the requests whose time is up, and returns how many */
+static int expire_requests(struct fw_engine *engine, u64 now)
+{
+	struct request *r;
+	int count = 0;
+
+restart:
+	for (r = engine->in_flight.head; r; r = r->next) {
+		if (r->timed_out || !r->deadline || r->deadline > now)
+			continue;
+		r->timed_out = true;
+		--engine->pending;
+		++count;
+		r->func(r->dev, FW_RCODE_TIMEOUT, NULL, 0, r->arg);
+		/* the callback might have changed the list */
+		goto restart;
+	}
+	return count;
+}
+
+/* the poll timeout until the next request expires, or the caller's one */
+static int poll_timeout(const struct fw_engine *engine, int timeout_ms, u64 now)
+{
+	const struct request *r;
+	u64 next = 0;
+	int ms;
+
+	for (r = engine->in_flight.head; r; r = r->next)
+		if (!r->timed_out && r->deadline && (!next || r->deadline < next))
+			next = r->deadline;
+	if (!next)
+		return timeout_ms;
+	ms = next > now ? (next - now + 999) / 1000 : 0;
+	return timeout_ms >= 0 && timeout_ms < ms ? timeout_ms : ms;
+}
+
+int fw_engine_dispatch(struct fw_engine *engine, int timeout_ms)
+{
+	unsigned int i, count = engine->device_count;
+	struct fw_device *devices[count + 1];
+	ssize_t size;
+	int ready, events;
+	u64 t;
+
+	if (!count && !engine->pending) {
+		errno = EINVAL;
+		return -1;
+	}
+	for (i = 0; i < count; ++i) {
+		devices[i] = engine->devices[i];
+		engine->pfds[i].fd = devices[i]->fd;
+		engine->pfds[i].events = POLLIN;
+	}
+	t = fw_timing_begin();
+	ready = poll(engine->pfds, count, poll_timeout(engine, timeout_ms, now_us()));
+	fw_timing_end(FW_TIMING_WAIT, t);
+	if (ready < 0)
+		return errno == EINTR ? 0 : -1;
+
+	events = 0;
+	for (i = 0; i < count && ready > 0; ++i) {
+		if (!engine->pfds[i].revents)
+			continue;
+		--ready;
+		/* a callback might have removed the device */
+		if (devices[i]->engine != engine)
+			continue;
+		size = read(devices[i]->fd, engine->buf, sizeof(engine->buf));
+		if (size < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			if (errno != ENODEV || !engine->removal_func)
+				return -1;
+			fw_engine_remove_device(engine, devices[i]);
+			engine->removal_func(devices[i], engine->removal_arg);
+			++events;
+			continue;
+		}
+		if (size < sizeof(struct fw_cdev_event_common)) {
+			errno = EIO;
+			return -1;
+		}
+		handle_event(engine, devices[i]);
+		++events;
+	}
+	events += expire_requests(engine, now_us());
+	send_queued(engine);
+	return events;
+}
+
+int fw_engine_run(struct fw_engine *engine)
+{
+	while (engine->pending > 0)
+		if (fw_engine_dispatch(engine, -1) < 0)
+			return -1;
+	return 0;
+}
+
+/*
+ * Timing
+ */
+
+/* the last one also counts everything longer */
+#define TIMING_BUCKETS	24
+
+struct phase_timing {
+	unsigned long long count;
+	unsigned long long sum_ns;
+	unsigned long long min_ns;
+	unsigned long long max_ns;
+	unsigned long long buckets[TIMING_BUCKETS];	/* < 2^i microseconds */
+};
+
+/* in shared memory, so that forked processes add to it */
+static struct timing {
+	pid_t pid;
+	u64 start_ns;
+	struct phase_timing phases[FW_TIMING_PHASES];
+} *timing;
+
+static const char *const phase_names[FW_TIMING_PHASES] = {
+	[FW_TIMING_SCAN]     = "scan",
+	[FW_TIMING_OPEN]     = "open",
+	[FW_TIMING_GET_INFO] = "get_info",
+	[FW_TIMING_SEND]     = "send",
+	[FW_TIMING_WAIT]     = "wait",
+	[FW_TIMING_PRINT]    = "print",
+};
+
+static u64 now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000uLL + ts.tv_nsec;
+}
+
+static void print_timing(void)
+{
+	const struct phase_timing *p;
+	u64 total_ns, phases_ns = 0;
+	unsigned int i, b;
+
+	/* only the process that enabled timing reports */
+	if (timing->pid != getpid())
+		return;
+	total_ns = now_ns() - timing->start_ns;
+	fflush(stdout);
+	fprintf(stderr, "timing: %-8s %8s %11s %10s %10s %10s\n",
+		"phase", "calls", "total ms", "avg us", "min us", "max us");
+	for (i = 0; i < FW_TIMING_PHASES; ++i) {
+		p = &timing->phases[i];
+		if (!p->count)
+			continue;
+		phases_ns += p->sum_ns;
+		fprintf(stderr, "timing: %-8s %8llu %11.3f %10.1f %10.1f %10.1f\n",
+			phase_names[i], p->count, p->sum_ns / 1e6,
+			p->sum_ns / 1e3 / p->count, p->min_ns / 1e3, p->max_ns / 1e3);
+	}
+	/* forked processes run at the same time, so the sum can be larger */
+	if (total_ns > phases_ns)
+		fprintf(stderr, "timing: %-8s %8s %11.3f\n", "other", "", (total_ns - phases_ns) / 1e6);
+	fprintf(stderr, "timing: %-8s %8s %11.3f\n", "total", "", total_ns / 1e6);
+
+	for (i = 0; i < FW_TIMING_PHASES; ++i) {
+		p = &timing->phases[i];
+		if (p->count < 2)
+			continue;
+		fprintf(stderr, "timing: %s histogram:\n", phase_names[i]);
+		for (b = 0; b < TIMING_BUCKETS; ++b)
+			if (p->buckets[b])
+				fprintf(stderr, "  < %8llu us: %llu\n", 1uLL << b, p->buckets[b]);
+	}
+}
+
+void fw_timing_enable(void)
+{
+	unsigned int i;
+
+	if (timing)
+		return;
+	timing = mmap(NULL, sizeof(*timing), PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (timing == MAP_FAILED) {
+		timing = NULL;
+		perror("mmap failed");
+		return;
+	}
+	timing->pid = getpid();
+	for (i = 0; i < ARRAY_SIZE(timing->phases); ++i)
+		timing->phases[i].min_ns = UINT64_MAX;
+	atexit(print_timing);
+	timing->start_ns = now_ns();
+}
+
+__u64 fw_timing_begin(void)
+{
+	return timing ? now_ns() : 0;
+}
+
+void fw_timing_end(enum fw_timing_phase phase, __u64 begin)
+{
+	struct phase_timing *p;
+	unsigned long long ns, old;
+	unsigned int bucket = 0;
+
+	if (!timing || !begin)
+		return;
+	ns = now_ns() - begin;
+	p = &timing->phases[phase];
+	while (bucket < TIMING_BUCKETS - 1 && ns >= 1000uLL << bucket)
+		++bucket;
+	__atomic_fetch_add(&p->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&p->sum_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&p->buckets[bucket], 1, __ATOMIC_RELAXED);
+	old = __atomic_load_n(&p->min_ns, __ATOMIC_RELAXED);
+	while (ns < old && !__atomic_compare_exchange_n(&p->min_ns, &old, ns, false,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+	old = __atomic_load_n(&p->max_ns, __ATOMIC_RELAXED);
+	while (ns > old && !__atomic_compare_exchange_n(&p->max_ns, &old, ns, false,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/*
+ * Daemon protocol
+ */
+
+int fw_daemon_connect(void)
+{
+	struct sockaddr_un addr;
+	const char *path;
+	int sock, err;
+
+	path = getenv("FIREWIRE_DAEMON");
+	if (!path || !*path)
+		path = FW_DAEMON_SOCKET;
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		err = errno;
+		close(sock);
+		errno = err;
+		return -1;
+	}
+	return sock;
+}
+
+static int write_all(int sock, const void *buf, size_t length)
+{
+	ssize_t r;
+
+	while (length) {
+		r = send(sock, buf, length, MSG_NOSIGNAL);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const u8 *)buf + r;
+		length -= r;
+	}
+	return 0;
+}
+
+static int read_all(int sock, void *buf, size_t length)
+{
+	ssize_t r;
+
+	while (length) {
+		r = read(sock, buf, length);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (r == 0) {
+			errno = ECONNRESET;
+			return -1;
+		}
+		buf = (u8 *)buf + r;
+		length -= r;
+	}
+	return 0;
+}
+
+struct fw_daemon_reply *fw_daemon_call(int sock, struct fw_daemon_request *request,
+				       const void *data, unsigned int length)
+{
+	static u32 serial;
+	struct fw_daemon_reply header, *reply;
+	int err;
+
+	u64 t;
+	int r;
+
+	request->length = sizeof(*request) + length;
+	request->serial = ++serial;
+	t = fw_timing_begin();
+	r = write_all(sock, request, sizeof(*request));
+	if (r == 0)
+		r = write_all(sock, data, length);
+	fw_timing_end(FW_TIMING_SEND, t);
+	if (r < 0)
+		return NULL;
+
+	/* replies to earlier requests whose callers gave up are skipped */
+	for (;;) {
+		t = fw_timing_begin();
+		r = read_all(sock, &header, sizeof(header));
+		fw_timing_end(FW_TIMING_WAIT, t);
+		if (r < 0)
+			return NULL;
+		if (header.length < sizeof(header) ||
+		    header.length > sizeof(header) + FW_DAEMON_MAX_DATA) {
+			errno = EPROTO;
+			return NULL;
+		}
+		reply = malloc(header.length);
+		if (!reply)
+			return NULL;
+		*reply = header;
+		if (read_all(sock, reply->data, header.length - sizeof(header)) < 0) {
+			err = errno;
+			free(reply);
+			errno = err;
+			return NULL;
+		}
+		if (reply->serial == request->serial)
+			return reply;
+		free(reply);
+	}
+}
@@ -0,0 +1,265 @@
+/*
+ * fwutils.h - common code of the FireWire utilities
+ *
+ * Device enumeration, opening of device files, an asynchronous engine
+ * that sends requests and PHY packets on any number of device files at
+ * the same time, and handles bus resets and timeouts in one place, the
+ * protocol of firewire-daemon, and timing of the phases of a tool's work.
+ *
+ * licensed under the terms of the GNU General Public License, version 2
+ */
+
+#ifndef FWUTILS_H_INCLUDED
+#define FWUTILS_H_INCLUDED
+
+#include <stdbool.h>
+#include <dirent.h>
+#include <linux/firewire-cdev.h>
+
+/*
+ * Device files
+ */
+
+struct fw_device {
+	char *name;
+	int fd;
+	__u32 card;
+	__u32 version;				/* of the kernel's ABI */
+	struct fw_cdev_event_bus_reset bus;	/* node IDs and generation */
+	__u32 rom[256];				/* the kernel's cached copy, in CPU byte order */
+	unsigned int rom_length;		/* in bytes */
+
+	/* used by the engine */
+	struct fw_engine *engine;
+	unsigned int in_flight;
+	unsigned int queued;
+};
+
+/*
+ * Returns the device file for "guid:<eui64>" or "name:<model>", or the
+ * argument itself if it is neither.  Exits if the device is not found.
+ */
+const char *fw_resolve_device_name(const char *arg);
+
+/* the scandir() filter for "fwN" */
+int fw_device_filter(const struct dirent *dirent);
+
+/* returns N of "/dev/fwN" or "fwN", or -1 */
+int fw_device_number(const char *name);
+
+/* scans /dev or sysfs for fwN entries, sorted by number */
+int fw_scan_devices(const char *dir, struct dirent ***namelist);
+void fw_free_devices(struct dirent **namelist, int count);
+
+/* opens the device file, and gets its info; returns -1 and errno on failure */
+int fw_device_open(struct fw_device *dev, const char *name);
+
+/* gets the info again, e.g., after a bus reset */
+int fw_device_update(struct fw_device *dev);
+
+/* also removes the device from its engine */
+void fw_device_close(struct fw_device *dev);
+
+static inline bool fw_device_is_local(const struct fw_device *dev)
+{
+	return dev->bus.node_id == dev->bus.local_node_id;
+}
+
+/* the largest payload for the speed and the max_rec of the node */
+unsigned int fw_device_max_payload(const struct fw_device *dev);
+
+/*
+ * Opens the device files in /dev one by one, and returns 0 with the first
+ * one for which match() returns true.  Returns -1 with ENOENT if there is
+ * none, or with EACCES if some device file could not be opened.
+ */
+int fw_device_find(struct fw_device *dev,
+		   bool (*match)(const struct fw_device *dev, void *arg), void *arg);
+
+#ifdef FW_CDEV_IOC_RECEIVE_PHY_PACKETS
+/* lets PHY packets from the bus arrive as events; only for local nodes */
+int fw_device_receive_phy_packets(struct fw_device *dev);
+#endif
+
+/*
+ * Asynchronous engine
+ *
+ * Requests are submitted with a callback that gets the response's rcode
+ * and data.  Up to FW_MAX_IN_FLIGHT requests per device file are sent at
+ * the same time; the others are queued.  fw_engine_dispatch() waits for
+ * events on all device files, and calls the callbacks.
+ *
+ * The kernel completes every request eventually; with a timeout set, a
+ * request that gets no response in time completes with FW_RCODE_TIMEOUT
+ * instead.  With retry_on_reset, a request that
+ * was rejected because a bus reset happened in the meantime is sent again
+ * with the new generation (at most FW_MAX_RESETS times); a request with an
+ * old generation is never sent to the bus, so this is safe even for writes
+ * and locks.
+ */
+
+#define FW_MAX_IN_FLIGHT	32
+#define FW_MAX_RESETS		3
+#define FW_RCODE_TIMEOUT	0x100
+
+struct fw_engine;
+
+typedef void (*fw_response_func)(struct fw_device *dev, int rcode,
+				 const void *data, unsigned int length, void *arg);
+typedef void (*fw_device_func)(struct fw_device *dev, void *arg);
+typedef void (*fw_event_func)(struct fw_device *dev,
+			      const union fw_cdev_event *event, void *arg);
+
+struct fw_engine *fw_engine_new(void);
+void fw_engine_free(struct fw_engine *engine);
+
+/* 0 (the default) waits as long as the kernel does */
+void fw_engine_set_timeout(struct fw_engine *engine, unsigned int ms);
+void fw_engine_set_retry_on_reset(struct fw_engine *engine, bool retry);
+
+/* called after a device's info has been updated for a bus reset */
+void fw_engine_set_reset_handler(struct fw_engine *engine, fw_device_func func, void *arg);
+
+/*
+ * Called when a device has gone away, after it has been removed from the
+ * engine; without this handler, fw_engine_dispatch() fails with ENODEV.
+ */
+void fw_engine_set_removal_handler(struct fw_engine *engine, fw_device_func func, void *arg);
+
+/* called for all events that do not belong to a submitted request */
+void fw_engine_set_event_handler(struct fw_engine *engine, fw_event_func func, void *arg);
+
+int fw_engine_add_device(struct fw_engine *engine, struct fw_device *dev);
+
+/* completes the device's requests with RCODE_CANCELLED */
+void fw_engine_remove_device(struct fw_engine *engine, struct fw_device *dev);
+
+/* the data is copied; the callback may submit new requests */
+int fw_submit_request(struct fw_engine *engine, struct fw_device *dev,
+		      unsigned int tcode, __u64 offset,
+		      const void *data, unsigned int length,
+		      fw_response_func func, void *arg);
+int fw_submit_broadcast_request(struct fw_engine *engine, struct fw_device *dev,
+				unsigned int tcode, __u64 offset,
+				const void *data, unsigned int length,
+				fw_response_func func, void *arg);
+
+#ifdef FW_CDEV_IOC_SEND_PHY_PACKET
+/*
+ * Completes when the packet has been sent; the data is the ping time, if
+ * any.  The second quadlet is the inverse of the first one, except for
+ * VersaPHY packets.  Received PHY packets go to the event handler.
+ */
+int fw_submit_phy_packet(struct fw_engine *engine, struct fw_device *dev,
+			 __u32 quadlet0, __u32 quadlet1,
+			 fw_response_func func, void *arg);
+#endif
+
+/* the number of requests that have not yet completed */
+unsigned int fw_engine_pending(const struct fw_engine *engine);
+
+/*
+ * Waits up to timeout_ms (-1: forever) for events, and handles them.
+ * Returns the number of events, 0 on timeout, or -1 and errno.
+ */
+int fw_engine_dispatch(struct fw_engine *engine, int timeout_ms);
+
+/* dispatches until all requests have completed */
+int fw_engine_run(struct fw_engine *engine);
+
+/*
+ * Timing
+ *
+ * The library measures the phases that it does itself; the tools add
+ * their output.  The breakdown is printed to stderr at exit, with a
+ * histogram of every phase that happened more than once.  Processes that
+ * are forked afterwards add to the same numbers.
+ */
+
+enum fw_timing_phase {
+	FW_TIMING_SCAN,		/* scanning /dev or sysfs for devices */
+	FW_TIMING_OPEN,		/* opening device files */
+	FW_TIMING_GET_INFO,	/* the GET_INFO ioctl */
+	FW_TIMING_SEND,		/* the ioctls that send requests and PHY packets */
+	FW_TIMING_WAIT,		/* waiting for responses and other events */
+	FW_TIMING_PRINT,	/* printing the results */
+	FW_TIMING_PHASES
+};
+
+void fw_timing_enable(void);
+
+/* returns the start time for fw_timing_end(), or 0 if timing is off */
+__u64 fw_timing_begin(void);
+void fw_timing_end(enum fw_timing_phase phase, __u64 begin);
+
+/*
+ * Daemon protocol
+ *
+ * firewire-daemon keeps the device files open, and serves requests on a
+ * Unix stream socket.  Each message starts with its total length; all
+ * fields are in the CPU's byte order, and the data is as on the bus.  A
+ * client may send any number of requests without waiting; the replies
+ * come in the order in which the requests complete, and carry the serial
+ * number of their request.
+ */
+
+#define FW_DAEMON_SOCKET	"/run/firewire-daemon.socket"
+#define FW_DAEMON_MAX_DATA	65536
+
+/* the device field: N of /dev/fwN, or the local node of a card */
+#define FW_DAEMON_CARD(card)	(0x80000000u | (card))
+#define FW_DAEMON_ANY_CARD	0xffffffffu
+
+enum fw_daemon_type {
+	FW_DAEMON_BUS_INFO,	/* reply data: struct fw_daemon_bus_info */
+	FW_DAEMON_READ,		/* reply data: up to the first error or short response */
+	FW_DAEMON_WRITE,	/* data: any length; split like reads */
+	FW_DAEMON_LOCK,		/* reply data: the old value */
+	FW_DAEMON_FCP,		/* data: the command frame; reply data: the response frame */
+	FW_DAEMON_PHY,		/* data: two quadlets; reply data: the matching packets */
+};
+
+struct fw_daemon_request {
+	__u32 length;		/* of the message, including the data */
+	__u32 type;
+	__u32 serial;
+	__u32 device;
+	__u64 offset;		/* READ, WRITE, LOCK */
+	__u32 tcode;		/* LOCK */
+	__u32 read_length;	/* READ */
+	__u32 mask;		/* PHY: the bits of a response quadlet to compare, */
+	__u32 bits;		/*      and their values; a mask of 0 waits for none */
+	__u32 data[];
+};
+
+struct fw_daemon_reply {
+	__u32 length;		/* of the message, including the data */
+	__u32 serial;
+	__s32 error;		/* an errno value if the request was not done at all */
+	__u32 rcode;		/* of the first error, or FW_RCODE_TIMEOUT */
+	__u32 value;		/* READ, WRITE: the bytes done; PHY: the ping time */
+	__u32 data[];
+};
+
+struct fw_daemon_bus_info {
+	__u32 card;
+	__u32 generation;
+	__u32 node_id;
+	__u32 local_node_id;
+	__u32 bm_node_id;
+	__u32 irm_node_id;
+	__u32 root_node_id;
+	__u32 max_payload;
+};
+
+/* connects to $FIREWIRE_DAEMON or FW_DAEMON_SOCKET; -1 and errno on failure */
+int fw_daemon_connect(void);
+
+/*
+ * Sends the request with the data, and waits for its reply, which must be
+ * freed.  Returns NULL and errno on failure.
+ */
+struct fw_daemon_reply *fw_daemon_call(int sock, struct fw_daemon_request *request,
+				       const void *data, unsigned int length);
+
+#endif
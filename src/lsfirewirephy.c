@@ -24,8 +24,7 @@
 #include <sys/stat.h>
 #include <linux/firewire-cdev.h>
 #include <linux/firewire-constants.h>
-
-#define ptr_to_u64(p) ((uintptr_t)(p))
+#include "fwutils.h"
 
 #define PHY_REMOTE_ACCESS_PAGED(phy_id, page, port, reg) \
 	(((phy_id) << 24) | (5 << 18) | ((page) << 15) | ((port) << 11) | ((reg) << 8))
@@ -181,15 +180,21 @@ static const struct vendor {
 
 static char *device_file_name;
 static int list_phy_id = -1;
-static int fd;
+static unsigned int list_card;
+static struct fw_device device;
+static struct fw_engine *engine;
 static bool any_unknown_phys;
-struct fw_cdev_get_info get_info;
-struct fw_cdev_event_bus_reset bus_reset;
+static bool bus_reset_occurred;
+
+/* the registers 2..7 of the vendor-dependent page of every PHY */
+static u8 reg_values[63][6];
+static u8 regs_read[63];
 
 static void help(void)
 {
 	fputs("Usage: lsfirewirephy [options] [devicenode [phyid]]\n"
 	      "Options:\n"
+	      " -t, --timing    print where the time went to stderr\n"
 	      " -h, --help      show this message and exit\n"
 	      " -V, --version   show version number and exit\n"
 	      "\n"
@@ -200,8 +205,9 @@ static void help(void)
 
 static void parse_parameters(int argc, char *argv[])
 {
-	static const char short_options[] = "hV";
+	static const char short_options[] = "thV";
 	static const struct option long_options[] = {
+		{ "timing", 0, NULL, 't' },
 		{ "help", 0, NULL, 'h' },
 		{ "version", 0, NULL, 'V' },
 		{}
@@ -211,6 +217,9 @@ static void parse_parameters(int argc, char *argv[])
 
 	while ((c = getopt_long(argc, argv, short_options, long_options, NULL)) != -1) {
 		switch (c) {
+		case 't':
+			fw_timing_enable();
+			break;
 		case 'h':
 			help();
 			exit(EXIT_SUCCESS);
@@ -225,7 +234,7 @@ static void parse_parameters(int argc, char *argv[])
 	}
 
 	if (optind < argc) {
-		device_file_name = strdup(argv[optind++]);
+		device_file_name = strdup(fw_resolve_device_name(argv[optind++]));
 		if (!device_file_name) {
 			fputs("out of memory\n", stderr);
 			exit(EXIT_FAILURE);
@@ -247,110 +256,70 @@ static void parse_parameters(int argc, char *argv[])
 	}
 }
 
-static struct dirent **fw_dirents;
-static int fw_dirent_count;
-static int fw_dirent_index;
-
-static int fw_filter(const struct dirent *dirent)
-{
-	return dirent->d_name[0] == 'f' &&
-	       dirent->d_name[1] == 'w' &&
-	       isdigit(dirent->d_name[2]);
-}
-
-static void init_enumerated_fw_devs(void)
-{
-	fw_dirent_count = scandir("/dev", &fw_dirents, fw_filter, versionsort);
-	if (fw_dirent_count < 0) {
-		perror("cannot read /dev");
-		exit(EXIT_FAILURE);
-	}
-	fw_dirent_index = 0;
-}
-
-static void cleanup_enumerated_fw_devs(void)
-{
-	int i;
-
-	for (i = 0; i < fw_dirent_count; ++i)
-		free(fw_dirents[i]);
-	free(fw_dirents);
-	fw_dirents = NULL;
-	fw_dirent_count = 0;
-}
-
-static bool has_enumerated_fw_dev(void)
+static bool open_device(const char *name, bool force)
 {
-	free(device_file_name);
-	device_file_name = NULL;
-
-	if (fw_dirent_index < fw_dirent_count) {
-		if (asprintf(&device_file_name, "/dev/%s",
-			     fw_dirents[fw_dirent_index]->d_name) < 0) {
-			perror("asprintf failed");
-			exit(EXIT_FAILURE);
-		}
-		return true;
-	} else {
-		cleanup_enumerated_fw_devs();
-		return false;
-	}
-}
-
-static void next_enumerated_fw_dev(void)
-{
-	++fw_dirent_index;
-}
-
-static bool open_device(bool force)
-{
-	fd = open(device_file_name, O_RDWR);
-	if (fd == -1) {
+	if (fw_device_open(&device, name) < 0) {
 		if (!force && errno == ENODEV)
 			return false;
-		perror(device_file_name);
-		exit(EXIT_FAILURE);
-	}
-
-	get_info.version = 4;
-	get_info.rom_length = 0;
-	get_info.rom = 0;
-	get_info.bus_reset = ptr_to_u64(&bus_reset);
-	get_info.bus_reset_closure = 0;
-	if (ioctl(fd, FW_CDEV_IOC_GET_INFO, &get_info) < 0) {
-		perror("GET_INFO ioctl failed");
+		perror(name);
 		exit(EXIT_FAILURE);
 	}
-	if (get_info.version < 4) {
+	if (device.version < 4) {
 		fputs("this kernel is too old\n", stderr);
 		exit(EXIT_FAILURE);
 	}
-
 	return true;
 }
 
 static void enable_phy_packets(void)
 {
-	struct fw_cdev_receive_phy_packets receive_phy_packets;
-
-	receive_phy_packets.closure = 0;
-	if (ioctl(fd, FW_CDEV_IOC_RECEIVE_PHY_PACKETS, &receive_phy_packets) < 0) {
+	if (fw_device_receive_phy_packets(&device) < 0) {
 		perror("RECEIVE_PHY_PACKETS ioctl failed");
 		exit(EXIT_FAILURE);
 	}
+	if (fw_engine_add_device(engine, &device) < 0) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
+	}
 }
 
-static bool device_is_local_node(void)
+static void check_local_node(void)
 {
-	return bus_reset.node_id == bus_reset.local_node_id;
+	if (!fw_device_is_local(&device)) {
+		fprintf(stderr, "%s: not a local node\n", device.name);
+		exit(EXIT_FAILURE);
+	}
 }
 
-static void check_local_node(void)
+/*
+ * Opens the device files in /dev one by one, and calls fn for each of
+ * them until it returns true; returns whether it did.
+ */
+static bool for_each_device(bool (*fn)(void))
 {
-	if (!device_is_local_node()) {
-		fprintf(stderr, "%s: not a local node\n", device_file_name);
+	struct dirent **ents;
+	char *name;
+	int count, i;
+	bool done = false;
+
+	count = fw_scan_devices("/dev", &ents);
+	if (count < 0) {
+		perror("cannot read /dev");
 		exit(EXIT_FAILURE);
 	}
+	for (i = 0; i < count && !done; ++i) {
+		if (asprintf(&name, "/dev/%s", ents[i]->d_name) < 0) {
+			perror("asprintf failed");
+			exit(EXIT_FAILURE);
+		}
+		if (open_device(name, false)) {
+			done = fn();
+			fw_device_close(&device);
+		}
+		free(name);
+	}
+	fw_free_devices(ents, count);
+	return done;
 }
 
 static const struct vendor *search_vendor(u24 oui)
@@ -376,147 +345,191 @@ static const struct phy *search_phy(const struct vendor *vendor, u24 id)
 	return NULL;
 }
 
-static void list_phy(void)
+static void phy_packet_sent(struct fw_device *dev, int rcode,
+			    const void *data, unsigned int length, void *arg)
 {
-	struct fw_cdev_send_phy_packet send_phy_packet;
-	unsigned int reg, regs_read;
-	int ready, r;
-	struct pollfd pfd;
-	u8 buf[256];
-	struct fw_cdev_event_common *event;
-	u8 reg_values[6];
-	u24 oui, id;
-	const struct vendor *vendor;
-	const struct phy *phy;
-
-	send_phy_packet.closure = 0;
-	send_phy_packet.generation = bus_reset.generation;
-	for (reg = 2; reg <= 7; ++reg) {
-		send_phy_packet.data[0] = PHY_REMOTE_ACCESS_PAGED(list_phy_id, 1, 0, reg);
-		send_phy_packet.data[1] = ~send_phy_packet.data[0];
-		if (ioctl(fd, FW_CDEV_IOC_SEND_PHY_PACKET, &send_phy_packet) < 0) {
-			perror("SEND_PHY_PACKET ioctl failed");
-			exit(EXIT_FAILURE);
-		}
+	/* after a bus reset, everything is sent again */
+	if (rcode != RCODE_COMPLETE && rcode != RCODE_GENERATION) {
+		fprintf(stderr, "PHY packet failed: rcode %u\n", (unsigned int)rcode);
+		exit(EXIT_FAILURE);
 	}
+}
 
-	pfd.fd = fd;
-	pfd.events = POLLIN;
-	regs_read = 0;
-	while (regs_read != 0xfc) {
-		ready = poll(&pfd, 1, 123);
-		if (ready < 0) {
-			perror("poll failed");
-			exit(EXIT_FAILURE);
-		}
-		if (!ready) {
-			fputs("timeout\n", stderr);
-			return; /* try next PHY */
-		}
-		r = read(fd, buf, sizeof buf);
-		if (r < sizeof(struct fw_cdev_event_common)) {
-			fputs("short read\n", stderr);
-			exit(EXIT_FAILURE);
-		}
-		event = (void *)buf;
-		if (event->type == FW_CDEV_EVENT_BUS_RESET) {
-			/* TODO: retry */
-			fputs("bus reset\n", stderr);
-			exit(EXIT_FAILURE);
-		}
-		if (event->type == FW_CDEV_EVENT_PHY_PACKET_SENT) {
-			struct fw_cdev_event_phy_packet *phy_packet = (void *)buf;
-			if (phy_packet->rcode != RCODE_COMPLETE) {
-				fprintf(stderr, "PHY packet failed: rcode %u\n",
-					(unsigned int)phy_packet->rcode);
-				exit(EXIT_FAILURE);
-			}
-		} else if (event->type == FW_CDEV_EVENT_PHY_PACKET_RECEIVED) {
-			struct fw_cdev_event_phy_packet *phy_packet = (void *)buf;
-			if (phy_packet->length == 8 &&
-			    (phy_packet->data[0] & 0xffff8000)
-			    == PHY_REMOTE_REPLY_PAGED(list_phy_id, 1, 0, 0, 0)) {
-				reg = (phy_packet->data[0] >> 8) & 7;
-				if (reg >= 2) {
-					reg_values[reg - 2] = phy_packet->data[0] & 0xff;
-					regs_read |= 1 << reg;
-				}
-			}
-		}
+static void phy_packet_received(struct fw_device *dev,
+				const union fw_cdev_event *event, void *arg)
+{
+	const struct fw_cdev_event_phy_packet *phy_packet = &event->phy_packet;
+	unsigned int phy_id, reg;
+
+	if (event->common.type != FW_CDEV_EVENT_PHY_PACKET_RECEIVED ||
+	    phy_packet->length != 8 ||
+	    (phy_packet->data[0] & 0xc0ff8000) != PHY_REMOTE_REPLY_PAGED(0, 1, 0, 0, 0))
+		return;
+	phy_id = (phy_packet->data[0] >> 24) & 0x3f;
+	reg = (phy_packet->data[0] >> 8) & 7;
+	if (phy_id < 63 && reg >= 2) {
+		reg_values[phy_id][reg - 2] = phy_packet->data[0] & 0xff;
+		regs_read[phy_id] |= 1 << reg;
 	}
+}
+
+static void note_bus_reset(struct fw_device *dev, void *arg)
+{
+	bus_reset_occurred = true;
+}
 
-	oui = (reg_values[0] << 16) | (reg_values[1] << 8) | reg_values[2];
-	id  = (reg_values[3] << 16) | (reg_values[4] << 8) | reg_values[5];
+static void print_phy(int phy_id)
+{
+	const u8 *regs = reg_values[phy_id];
+	u24 oui, id;
+	const struct vendor *vendor;
+	const struct phy *phy;
+	u64 t = fw_timing_begin();
+
+	oui = (regs[0] << 16) | (regs[1] << 8) | regs[2];
+	id  = (regs[3] << 16) | (regs[4] << 8) | regs[5];
 	vendor = search_vendor(oui);
 	phy = vendor ? search_phy(vendor, id) : NULL;
 
-	printf("bus %u, node %d: %06x:%06x  ", get_info.card, list_phy_id, oui, id);
+	printf("bus %u, node %d: %06x:%06x  ", device.card, phy_id, oui, id);
 	if (vendor)
 		printf("%s %s\n", vendor->name, phy ? phy->name : "(unknown)");
 	else
 		printf("%s\n", "(unknown)");
+	fw_timing_end(FW_TIMING_PRINT, t);
 
 	if (!phy)
 		any_unknown_phys = true;
 }
 
+static bool all_read(int first, int last)
+{
+	int phy_id;
+
+	for (phy_id = first; phy_id <= last; ++phy_id)
+		if (regs_read[phy_id] != 0xfc)
+			return false;
+	return true;
+}
+
+/*
+ * Reads the vendor and product IDs of one PHY, or of all PHYs (phy_id -1).
+ * The replies tell which PHY they come from, so the packets for all PHYs
+ * are sent at once.  A bus reset renumbers the PHYs, so it starts over.
+ */
+static void list_phys(int phy_id)
+{
+	unsigned int attempt, reg;
+	int first, last, id, ready;
+
+	for (attempt = 0; ; ++attempt) {
+		first = phy_id >= 0 ? phy_id : 0;
+		last = phy_id >= 0 ? phy_id : device.bus.root_node_id & 0x3f;
+		memset(regs_read, 0, sizeof(regs_read));
+		bus_reset_occurred = false;
+		for (id = first; id <= last; ++id)
+			for (reg = 2; reg <= 7; ++reg)
+				if (fw_submit_phy_packet(engine, &device,
+							 PHY_REMOTE_ACCESS_PAGED(id, 1, 0, reg),
+							 ~PHY_REMOTE_ACCESS_PAGED(id, 1, 0, reg),
+							 phy_packet_sent, NULL) < 0) {
+					perror("SEND_PHY_PACKET ioctl failed");
+					exit(EXIT_FAILURE);
+				}
+
+		while (!bus_reset_occurred &&
+		       (fw_engine_pending(engine) || !all_read(first, last))) {
+			ready = fw_engine_dispatch(engine, 123);
+			if (ready < 0) {
+				perror("reading events failed");
+				exit(EXIT_FAILURE);
+			}
+			if (!ready)
+				break; /* the missing PHYs time out */
+		}
+		if (fw_engine_run(engine) < 0) {
+			perror("reading events failed");
+			exit(EXIT_FAILURE);
+		}
+		if (!bus_reset_occurred)
+			break;
+		if (attempt >= 2) {
+			fputs("bus reset\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (id = first; id <= last; ++id)
+		if (regs_read[id] == 0xfc)
+			print_phy(id);
+		else
+			fputs("timeout\n", stderr);
+}
+
 static void list_one_phy(void)
 {
-	open_device(true);
+	open_device(device_file_name, true);
 	check_local_node();
 	enable_phy_packets();
-	list_phy();
-	close(fd);
+	list_phys(list_phy_id);
+	fw_device_close(&device);
+}
+
+static bool list_card_local_node(void)
+{
+	if (device.card != list_card || !fw_device_is_local(&device))
+		return false;
+	enable_phy_packets();
+	list_phys(list_phy_id);
+	return true;
 }
 
 static void list_device(void)
 {
-	unsigned int list_card;
-
-	open_device(true);
-	list_phy_id = bus_reset.node_id & 0x3f;
-	list_card = get_info.card;
-	if (!device_is_local_node()) {
-		close(fd);
-		for (init_enumerated_fw_devs();
-		     has_enumerated_fw_dev();
-		     next_enumerated_fw_dev()) {
-			if (!open_device(false))
-				continue;
-			if (get_info.card == list_card &&
-			    device_is_local_node())
-				goto found;
-			close(fd);
-		}
+	open_device(device_file_name, true);
+	list_phy_id = device.bus.node_id & 0x3f;
+	list_card = device.card;
+	if (fw_device_is_local(&device)) {
+		list_card_local_node();
+		fw_device_close(&device);
+		return;
+	}
+	fw_device_close(&device);
+	if (!for_each_device(list_card_local_node)) {
 		fprintf(stderr, "local node for card %u not found\n", list_card);
 		exit(EXIT_FAILURE);
 	}
-found:
-	enable_phy_packets();
-	list_phy();
-	close(fd);
+}
+
+static bool list_bus(void)
+{
+	if (fw_device_is_local(&device)) {
+		enable_phy_packets();
+		list_phys(-1);
+	}
+	return false;
 }
 
 static void list_all_buses(void)
 {
-	for (init_enumerated_fw_devs();
-	     has_enumerated_fw_dev();
-	     next_enumerated_fw_dev()) {
-		if (!open_device(false))
-			continue;
-		if (device_is_local_node()) {
-			int root_phy_id = bus_reset.root_node_id & 0x3f;
-			enable_phy_packets();
-			for (list_phy_id = 0; list_phy_id <= root_phy_id; ++list_phy_id)
-				list_phy();
-		}
-		close(fd);
+	for_each_device(list_bus);
+}
+
+static void create_engine(void)
+{
+	engine = fw_engine_new();
+	if (!engine) {
+		fputs("out of memory\n", stderr);
+		exit(EXIT_FAILURE);
 	}
+	fw_engine_set_event_handler(engine, phy_packet_received, NULL);
+	fw_engine_set_reset_handler(engine, note_bus_reset, NULL);
 }
 
 int main(int argc, char *argv[])
 {
 	parse_parameters(argc, argv);
+	create_engine();
 	if (device_file_name)
 		if (list_phy_id >= 0)
 			list_one_phy();
@@ -527,5 +540,6 @@ int main(int argc, char *argv[])
 	if (any_unknown_phys)
 		fputs("  Please check this web page for updated PHY IDs:\n"
 		      "  http://code.google.com/p/jujuutils/wiki/PhyIds\n", stderr);
+	fw_engine_free(engine);
 	return 0;
 }